@@ -5,12 +5,23 @@
  * @author Taiming Liu <taimingl@andrew.cmu.edu>
  */
 
+#define _GNU_SOURCE /* pthread_setaffinity_np, pipe2, close_range */
+
 #include "csapp.h"
+#include "proxy_admit.h"
 #include "proxy_cache.h"
+#include "proxy_coro.h"
+#include "proxy_health.h"
+#include "proxy_log.h"
+#include "proxy_probe.h"
+#include "proxy_stats.h"
+#include "proxy_trace.h"
+#include "proxy_uring.h"
 
 #include <assert.h>
 #include <ctype.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -19,12 +30,19 @@
 #include <unistd.h>
 
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
+#include <sys/prctl.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
 
 /*
  * Debug macros, which can be enabled by adding -DDEBUG in the Makefile
@@ -42,21 +60,81 @@
 #define THREAD
 #define CACHING
 
-#define HOSTLEN 256
-#define SERVLEN 8
+/* Default socket deadlines, in milliseconds (0 disables) */
+#define DEF_HEADER_TIMEOUT 20000
+#define DEF_UPSTREAM_TIMEOUT 30000
+#define DEF_WRITE_TIMEOUT 30000
+
+/* Environment of a binary started by an upgrade, naming inherited fds */
+#define ENV_LISTEN_FDS "PROXY_LISTEN_FDS" // listening socket per listener
+#define ENV_CACHE_FDS "PROXY_CACHE_FDS"   // cache memfd per listener
+#define ENV_READY_FD "PROXY_READY_FD"     // pipe to report listening on
+
+/* Requests for this URL are answered by the proxy itself, with its stats */
+#define STATUS_HOST "proxy.local"
+#define STATUS_PATH "/status"
+
+/* Room for the status page, which is cut short if it needs more */
+#define STATUS_SIZE (64 * 1024)
+
+/* Time for an upgraded binary to start listening, in milliseconds */
+#define UPGRADE_TIMEOUT 10000
+
+/* Interval between checks while draining, in microseconds */
+#define DRAIN_INTERVAL 100000
 
 /*Typedef for convenience. */
 typedef struct sockaddr SA;
 
+/* An accept loop, and what the connections it accepts work with. */
+typedef struct {
+    int listenfd;                  // Listening socket of this loop
+    int cpu;                       // Core of the loop and connections, or -1
+    cache_t *cache;                // Cache for requests on this listener
+    admit_t admit;                 // Connection and fetch limits
+    pthread_t tid;                 // Thread running the accept loop
+    volatile sig_atomic_t stopped; // Accept loop has returned, see drain
+} listener_t;
+
 /* Information about a connected client. */
 typedef struct {
-    struct sockaddr_in addr; // Socket address
-    socklen_t addrlen;       // Socket address length
-    int connfd;              // Client connection file descriptor
-    char host[HOSTLEN];      // Client host
-    char serv[SERVLEN];      // Client service (port)
+    struct sockaddr_in addr;  // Socket address
+    socklen_t addrlen;        // Socket address length
+    int connfd;               // Client connection file descriptor
+    struct timespec deadline; // When the request head must have arrived
+    long long start;          // Monotonic ns it was accepted, for latencies
+    listener_t *listener;     // Listener the client connected through
+    log_record_t record;      // What the access log will say about it
+    trace_record_t trace;     // Phases of serving it, if it is traced
 } client_info;
 
+/*
+ * A request line and what is built from it. Together they would take much
+ * of the stack of a coroutine, so serve() keeps them on the heap.
+ */
+typedef struct {
+    rio_t rio;                   // Buffered reads of the request head
+    char line[MAXLINE];          // Request line
+    char method[MAXLINE];        // Method, from the request line
+    char uri[MAXLINE];           // URI, from the request line
+    char host[MAXLINE];          // Host of the URI, with the port
+    char path[MAXLINE];          // Path of the URI
+    char srv_hostname[MAXLINE];  // Host of the URI, without the port
+    char srv_port[MAXLINE];      // Port of the URI
+    char proxy_request[MAXLINE]; // Request head sent to the web server
+} request_t;
+
+/* A response being fetched, and the copy of it kept for the cache. */
+typedef struct {
+    char *buf;       // MAX_OBJECT_SIZE bytes, or NULL when not caching
+    size_t size;     // Bytes received so far
+    cache_t *cache;  // Cache the response goes to
+    char *uri;       // Key of the response in the cache
+    bool cached;     // Response has been inserted into the cache
+    int status;      // HTTP status of the response, 0 until it starts
+    long long first; // Monotonic ns the response started arriving at
+} fetch_t;
+
 /*
  * String to use for the User-Agent header.
  * Don't forget to terminate with \r\n
@@ -69,15 +147,109 @@ static const char *proxy_header_connection = "Proxy-Connection: close\r\n";
 
 /* Global variables */
 
-/** @brief cache structure to cache requests */
+/** @brief cache structure to cache requests, shared by all listeners */
 static cache_t *cache;
 
+/** @brief the listeners, for the counters printed on SIGUSR1 */
+static listener_t *all_listeners;
+
+/** @brief health of origins, for short-circuiting requests to dead ones */
+static health_t health;
+
+/** @brief binary to exec on upgrade, and the arguments to give it */
+static char exe_path[PATH_MAX];
+static char **saved_argv;
+
+/** @brief set once another process has taken over the listeners */
+static volatile sig_atomic_t draining = 0;
+
+/** @brief set in pre-forked workers, which leave upgrades to the master */
+static bool is_worker = false;
+
+/** @brief which of the pre-forked workers this process is, from 0 */
+static int worker_index = 0;
+
+/* Runtime options, set from the command line in main() */
+static struct {
+    unsigned int breaker_threshold; // Failures before an origin is cut off
+    unsigned int breaker_cooldown;  // Seconds before a cut-off origin is probed
+    long header_timeout;            // Ms for a client to send its request head
+    long upstream_timeout;          // Ms for a web server to send each chunk
+    long write_timeout;             // Ms for a client to take each chunk
+    unsigned int max_conns;         // Connections served at once
+    unsigned int max_fetches;       // Fetches to web servers in flight at once
+    bool lanes;                     // Serve cache hits ahead of misses
+    unsigned int max_queued;        // Misses that may wait for a fetch slot
+    unsigned int hit_reserve;       // Connections kept free of misses
+    int listeners;                  // Per-core listeners, 0 for one per core
+    bool per_core;                  // Use per-core SO_REUSEPORT listeners
+    bool partition;                 // Give each listener its own cache
+    bool uring;                     // Use the io_uring engine if available
+    int coro_threads;               // Coroutine workers, 0 for one per core
+    bool coro;                      // Serve connections as coroutines
+    int processes;                  // Pre-forked workers, 0 for one per core
+    bool prefork;                   // Pre-fork workers sharing one cache
+    unsigned int hot_objects;       // Hot objects each thread keeps handy
+    const char *access_log;         // Access log file, NULL for stdout
+    unsigned int trace_rate;        // Trace one request in this many
+    const char *trace_file;         // File to append traced requests to
+} opts = {
+    .breaker_threshold = HEALTH_DEF_THRESHOLD,
+    .breaker_cooldown = HEALTH_DEF_COOLDOWN,
+    .header_timeout = DEF_HEADER_TIMEOUT,
+    .upstream_timeout = DEF_UPSTREAM_TIMEOUT,
+    .write_timeout = DEF_WRITE_TIMEOUT,
+    .max_conns = ADMIT_DEF_MAX_CONNS,
+    .max_fetches = ADMIT_DEF_MAX_FETCHES,
+    .lanes = false,
+    .max_queued = ADMIT_DEF_MAX_QUEUED,
+    .hit_reserve = ADMIT_DEF_HIT_RESERVE,
+    .listeners = 1,
+    .per_core = false,
+    .partition = false,
+    .uring = false,
+    .coro_threads = 0,
+    .coro = false,
+    .processes = 0,
+    .prefork = false,
+    .hot_objects = 0,
+    .access_log = NULL,
+    .trace_rate = 0,
+    .trace_file = TRACE_DEF_FILE,
+};
+
+/**
+ * set_timeout - sets a receive or send timeout on a socket
+ *
+ * `which` is SO_RCVTIMEO or SO_SNDTIMEO. A blocked read or write on the
+ * socket then fails with EAGAIN once `ms` milliseconds pass without progress.
+ * A timeout of 0 leaves the socket blocking forever.
+ */
+static void set_timeout(int fd, int which, long ms) {
+    struct timeval tv;
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    if (setsockopt(fd, SOL_SOCKET, which, &tv, sizeof(tv)) < 0) {
+        perror("setsockopt");
+    }
+}
+
+/**
+ * timed_out - tells whether the last failed socket call hit its timeout
+ *
+ */
+static bool timed_out(void) {
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
 /**
  * clienterror - returns an error message to the client
  *
+ * The status and size of the message go into the access log record.
  */
-void clienterror(int fd, const char *errnum, const char *shortmsg,
-                 const char *longmsg) {
+void clienterror(client_info *client, const char *errnum,
+                 const char *shortmsg, const char *longmsg) {
+    int fd = client->connfd;
     char buf[MAXLINE];
     char body[MAXBUF];
     size_t buflen;
@@ -109,16 +281,46 @@ void clienterror(int fd, const char *errnum, const char *shortmsg,
     }
 
     /* Write the headers */
-    if (rio_writen(fd, buf, buflen) < 0) {
+    if (coro_writen(fd, buf, buflen) < 0) {
         fprintf(stderr, "Error writing error response headers to client\n");
         return;
     }
 
     /* Write the body */
-    if (rio_writen(fd, body, bodylen) < 0) {
+    if (coro_writen(fd, body, bodylen) < 0) {
         fprintf(stderr, "Error writing error response body to client\n");
         return;
     }
+    client->record.status = atoi(errnum);
+    client->record.bytes = buflen + bodylen;
+}
+
+/**
+ * read_header_line - reads one line of the request head before the deadline
+ *
+ * The receive timeout is re-armed with the time left before every read
+ * from the socket, so a client trickling its request a byte at a time
+ * cannot hold a thread past the deadline.
+ */
+static ssize_t read_header_line(client_info *client, rio_t *rp, char *buf,
+                                size_t maxlen) {
+    if (opts.header_timeout > 0) {
+        return coro_readlineb_until(rp, buf, maxlen, &client->deadline);
+    }
+    return coro_readlineb(rp, buf, maxlen);
+}
+
+/**
+ * header_failed - accounts for a failed read of the request head
+ *
+ * A client that ran out of time is told so; one that hung up is not.
+ */
+static void header_failed(client_info *client, ssize_t res) {
+    if (res < 0 && timed_out()) {
+        stats_inc(STAT_TIMEOUT_HEADER);
+        clienterror(client, "408", "Request Timeout",
+                    "Proxy did not receive the request in time");
+    }
 }
 
 /**
@@ -197,7 +399,9 @@ bool build_requesthdrs(client_info *client, rio_t *rp, char *proxy_request,
     strcat(proxy_request, header_user_agent); // Req user agent
 
     while (true) {
-        if (rio_readlineb(rp, buf, sizeof(buf)) <= 0) {
+        ssize_t res = read_header_line(client, rp, buf, sizeof(buf));
+        if (res <= 0) {
+            header_failed(client, res);
             return true;
         }
 
@@ -210,7 +414,7 @@ bool build_requesthdrs(client_info *client, rio_t *rp, char *proxy_request,
         /* Parse header into name and value */
         if (sscanf(buf, "%[^:]: %[^\r\n]", name, value) != 2) {
             /* Error parsing header */
-            clienterror(client->connfd, "400", "Bad Request",
+            clienterror(client, "400", "Bad Request",
                         "Proxy could not parse request headers");
             return true;
         }
@@ -230,143 +434,551 @@ bool build_requesthdrs(client_info *client, rio_t *rp, char *proxy_request,
 }
 
 /**
- * do_proxy - fetch from real web server and respond to client.
+ * response_status - returns the status code of a response, 0 if unknown
  *
- * Forwards requests from clients to web servers and forwards responses
- * from webservers back to clients
+ * Only looks at the status line, which is all in the first chunk.
+ */
+static int response_status(const char *buf, size_t len) {
+    if (len < 12 || strncmp(buf, "HTTP/1.", 7) != 0 || buf[8] != ' ' ||
+        !isdigit(buf[9]) || !isdigit(buf[10]) || !isdigit(buf[11])) {
+        return 0;
+    }
+    return (buf[9] - '0') * 100 + (buf[10] - '0') * 10 + (buf[11] - '0');
+}
+
+/**
+ * copy_chunk - adds a chunk of a response to the copy kept for the cache
+ *
+ * Called before the chunk is relayed. With the last chunk the response is
+ * published, before the client sees its end, so that a request for it
+ * right after this one is already a hit.
  *
+ * Returns false once the response has outgrown the cache, as the rest of
+ * it need not be copied (see uring_chunk_fn).
  */
-void do_proxy(client_info *client, char *proxy_request, char *srv_hostname,
-              char *srv_port, char *uri) {
-    int proxy_clientfd;
-    char srv_buf[MAXLINE];
-    memset(srv_buf, 0, MAXLINE * sizeof(char));
+static bool copy_chunk(void *arg, const char *buf, size_t len, bool last) {
+    fetch_t *fetch = arg;
+    if (fetch->size == 0) {
+        fetch->status = response_status(buf, len);
+        fetch->first = stats_clock();
+        PROBE2(upstream_first_byte, fetch->uri, len);
+    }
+    if (fetch->buf == NULL) {
+        fetch->size += len;
+        return false;
+    }
+    if (fetch->size + len <= MAX_OBJECT_SIZE) {
+        memcpy(fetch->buf + fetch->size, buf, len);
+    }
+    fetch->size += len;
+    if (last && fetch->size < MAX_OBJECT_SIZE) {
+        insert_cache(fetch->cache, fetch->uri, fetch->buf, fetch->size);
+        fetch->cached = true;
+    }
+    return fetch->size <= MAX_OBJECT_SIZE;
+}
+
+/**
+ * open_origin - connects to a web server and sends it the request
+ *
+ * Goes through the ring if one is given, otherwise through open_clientfd
+ * and rio (or their coroutine versions). Returns the connected socket,
+ * with the upstream send timeout set on the rio path, URING_ESEND if the
+ * request could not be sent, or another negative value if the web server
+ * could not be reached. Notes when the name was resolved in the trace.
+ */
+static int open_origin(client_info *client, uring_t *ring, char *hostname,
+                       char *port, char *request) {
+    long long resolved = 0;
+    int fd;
+    if (ring != NULL) {
+        fd = uring_connect(ring, hostname, port, request, strlen(request),
+                           opts.upstream_timeout, &resolved);
+    } else {
+        fd = coro_open_clientfd(hostname, port, opts.upstream_timeout,
+                                &resolved);
+    }
+    if (resolved != 0) {
+        trace_mark(&client->trace, TRACE_RESOLVED, resolved);
+    }
+    if (ring != NULL) {
+        return fd;
+    }
+    if (fd < 0) {
+        return fd;
+    }
+    set_timeout(fd, SO_SNDTIMEO, opts.upstream_timeout);
+    if (coro_writen(fd, request, strlen(request)) < 0) {
+        close(fd);
+        return URING_ESEND;
+    }
+    return fd;
+}
+
 #ifdef CACHING
-    size_t prev_size = 0;
-    size_t cache_value_size;
-    char cache_value[MAX_OBJECT_SIZE];
-    memset(cache_value, 0, MAX_OBJECT_SIZE * sizeof(char));
+/**
+ * lookup - looks a request up in the cache, timing the lookup
+ *
+ * Copies the response into value and returns its size, or 0 on a miss.
+ * Lock waits are told apart from other threads' by how much the thread's
+ * own total grows; nothing can yield to another coroutine in between.
+ */
+static size_t lookup(client_info *client, char *uri, char *value) {
+    unsigned long waited = stats_thread_sum(HIST_CACHE_LOCK);
+    long long start = stats_clock();
+    size_t size = retrieve_cache(client->listener->cache, uri, value);
+    long long now = stats_clock();
+    stats_time(HIST_LOOKUP, now - start);
+    if (client->trace.start_ns != 0) {
+        client->trace.lock_us += stats_thread_sum(HIST_CACHE_LOCK) - waited;
+        trace_mark(&client->trace, TRACE_LOOKUP, now);
+    }
+    return size;
+}
 
-    if ((cache_value_size = retrieve_cache(cache, uri, cache_value)) == 0) {
+/**
+ * write_hit - writes a response found in the cache to the client
+ *
+ */
+static void write_hit(client_info *client, const char *value, size_t size) {
+    client->record.cache = LOG_HIT;
+    client->record.status = response_status(value, size);
+    stats_add(STAT_BYTES_CACHE, (long)size);
+    if (coro_writen(client->connfd, value, size) < 0) {
+        if (timed_out()) {
+            stats_inc(STAT_TIMEOUT_WRITE);
+        }
+        return;
+    }
+    client->record.bytes = size;
+    trace_mark(&client->trace, TRACE_RELAYED, stats_clock());
+}
 #endif
-        // not found in cache, retrieve from web server
-        proxy_clientfd = open_clientfd(srv_hostname, srv_port);
-        if (proxy_clientfd < 0) {
+
+/**
+ * fetch_origin - fetches a response from the web server for the client
+ *
+ * Relays the response to the client as it arrives, and caches it if it
+ * arrives whole and fits. value is MAX_OBJECT_SIZE bytes to copy it into,
+ * or NULL if it is not to be cached.
+ */
+static void fetch_origin(client_info *client, char *proxy_request,
+                         char *srv_hostname, char *srv_port, char *uri,
+                         char *value) {
+    int proxy_clientfd;
+    char origin[HEALTH_KEYLEN];
+    char srv_buf[MAXLINE];
+    admit_t *admit = &client->listener->admit;
+    fetch_t fetch = {value, 0, client->listener->cache, uri, false, 0};
+
+    // not found in cache, retrieve from web server
+    stats_inc(STAT_MISSES);
+    client->record.cache = LOG_MISS;
+    snprintf(origin, sizeof(origin), "%s:%s", srv_hostname, srv_port);
+    if (!check_origin(&health, origin)) {
+        clienterror(client, "503", "Service Unavailable",
+                    "Proxy is not forwarding to this server right now");
+        return;
+    }
+
+    // past the fetch limit, only cache hits are answered
+    if (!acquire_fetch(admit)) {
+        clienterror(client, "503", "Service Unavailable",
+                    "Proxy is overloaded, please retry later");
+        return;
+    }
+
+    // a ring blocks its thread, which coroutines share
+    uring_t *ring = opts.uring && !in_coro() ? uring_get() : NULL;
+    long long connect_start = stats_clock();
+    PROBE2(upstream_connect_start, srv_hostname, srv_port);
+    proxy_clientfd =
+        open_origin(client, ring, srv_hostname, srv_port, proxy_request);
+    PROBE3(upstream_connect_end, srv_hostname, srv_port, proxy_clientfd);
+    long long relay_start = stats_clock();
+    stats_time(HIST_CONNECT, relay_start - connect_start);
+    trace_mark(&client->trace, TRACE_CONNECTED, relay_start);
+    if (proxy_clientfd < 0) {
+        if (ring != NULL) {
+            uring_put(ring);
+        }
+        report_origin(&health, origin, false);
+        release_fetch(admit);
+        if (proxy_clientfd == URING_ESEND) {
+            fprintf(stderr, "Error: writing to web server error\n");
+            clienterror(client, "502", "Bad Gateway",
+                        "Proxy could not send the request to the web server");
+        } else {
             fprintf(stderr, "Failed to connect to web server: %s:%s\n",
                     srv_hostname, srv_port);
-            return;
+            clienterror(client, "502", "Bad Gateway",
+                        "Proxy could not connect to the web server");
         }
+        return;
+    }
 
-        if (rio_writen(proxy_clientfd, proxy_request, strlen(proxy_request)) <
-            0) {
-            fprintf(stderr, "Error: writing to web server error\n");
-            return;
+    int size = 0;
+    bool upstream_timed_out;
+    if (ring != NULL) {
+        // uring_relay reports how the relay ended the way rio would:
+        // size is 0 at EOF, < 0 if the read failed, > 0 if the write did
+        uring_relay_result_t relay;
+        uring_relay(ring, proxy_clientfd, client->connfd,
+                    opts.upstream_timeout, opts.write_timeout, copy_chunk,
+                    &fetch, &relay);
+        uring_put(ring);
+        size = relay.in_err != 0 ? -1 : relay.eof ? 0 : 1;
+        upstream_timed_out = relay.in_err == EAGAIN;
+        if (relay.out_err == EAGAIN) {
+            stats_inc(STAT_TIMEOUT_WRITE);
         }
+    } else {
+        set_timeout(proxy_clientfd, SO_RCVTIMEO, opts.upstream_timeout);
+        while ((size = coro_readn(proxy_clientfd, srv_buf, MAXLINE)) > 0) {
+            // a short read means the web server is done
+            copy_chunk(&fetch, srv_buf, size, size < MAXLINE);
+            if (coro_writen(client->connfd, srv_buf, size) < 0) {
+                // client is gone or stopped reading, stop relaying
+                if (timed_out()) {
+                    stats_inc(STAT_TIMEOUT_WRITE);
+                }
+                break;
+            }
+        }
+        upstream_timed_out = size < 0 && timed_out();
+    }
+    size_t response_size = fetch.size;
+    close(proxy_clientfd);
+    release_fetch(admit);
+    long long relay_end = stats_clock();
+    stats_time(HIST_ORIGIN, relay_end - relay_start);
+    stats_add(STAT_BYTES_ORIGIN, (long)response_size);
+    client->record.upstream_ns = relay_end - connect_start;
+    if (fetch.first != 0) {
+        trace_mark(&client->trace, TRACE_FIRST_BYTE, fetch.first);
+    }
+    trace_mark(&client->trace, TRACE_RELAYED, relay_end);
+    client->record.status = fetch.status;
+    client->record.bytes = response_size;
+
+    // an origin that errors out or closes without answering has failed
+    if (upstream_timed_out) {
+        stats_inc(STAT_TIMEOUT_UPSTREAM);
+    }
+    report_origin(&health, origin,
+                  size > 0 || (size == 0 && response_size > 0));
+    if (response_size == 0) {
+        if (upstream_timed_out) {
+            clienterror(client, "504", "Gateway Timeout",
+                        "Web server did not respond in time");
+        } else {
+            clienterror(client, "502", "Bad Gateway",
+                        "Proxy received no response from the web server");
+        }
+        return;
+    }
 
-        int size = 0;
 #ifdef CACHING
-        size_t response_size = 0;
+    // store to cache if the whole response arrived and can fit
+    if (!fetch.cached && value != NULL && size == 0 &&
+        response_size < MAX_OBJECT_SIZE) {
+        insert_cache(fetch.cache, uri, value, response_size);
+    } else if (!fetch.cached) {
+        stats_inc(STAT_BYPASS);
+        client->record.cache = LOG_BYPASS;
+    }
 #endif
-        while ((size = rio_readn(proxy_clientfd, srv_buf, MAXLINE)) > 0) {
+}
+
+/**
+ * do_proxy - fetch from real web server and respond to client.
+ *
+ * Forwards requests from clients to web servers and forwards responses
+ * from webservers back to clients. The response, from the cache or for
+ * it, is copied through a buffer on the heap, as at MAX_OBJECT_SIZE it is
+ * too big for the stack of a coroutine.
+ */
+void do_proxy(client_info *client, char *proxy_request, char *srv_hostname,
+              char *srv_port, char *uri) {
 #ifdef CACHING
-            response_size += size;
-            if (response_size <= MAX_OBJECT_SIZE) {
-                // strncat(cache_value, srv_buf, size);
-                memcpy(cache_value + prev_size, srv_buf, size);
-            }
-            prev_size = response_size;
+    char *cache_value = malloc(MAX_OBJECT_SIZE);
+    if (cache_value == NULL) {
+        clienterror(client, "500", "Internal Server Error",
+                    "Proxy is out of memory");
+        return;
+    }
+    size_t cache_value_size = lookup(client, uri, cache_value);
+    if (cache_value_size > 0) {
+        // retrieved directly from cache and write to client
+        stats_inc(STAT_HITS);
+        write_hit(client, cache_value, cache_value_size);
+    } else {
+        fetch_origin(client, proxy_request, srv_hostname, srv_port, uri,
+                     cache_value);
+    }
+    free(cache_value);
+#else
+    fetch_origin(client, proxy_request, srv_hostname, srv_port, uri, NULL);
 #endif
-            rio_writen(client->connfd, srv_buf, size);
-        }
-        close(proxy_clientfd);
+}
 
+/**
+ * report_caches - reports on each cache the listeners use, once each
+ *
+ * Safe to call from a signal handler when writing to a file descriptor.
+ */
+static void report_caches(stats_out_t *out) {
 #ifdef CACHING
-        // store to cache if total response can fit
-        if (response_size < MAX_OBJECT_SIZE) {
-            insert_cache(cache, uri, cache_value, response_size);
+    for (int i = 0; all_listeners != NULL && i < opts.listeners; i++) {
+        bool seen = false; // listeners may share a cache
+        for (int j = 0; j < i; j++) {
+            seen = seen || all_listeners[j].cache == all_listeners[i].cache;
+        }
+        if (!seen) {
+            report_cache(all_listeners[i].cache, i, out);
         }
-
-    } else {
-        // retrieved directly from cache and write to client
-        rio_writen(client->connfd, cache_value, cache_value_size);
     }
+#else
+    (void)out;
 #endif
 }
 
 /**
- * serve - handles one HTTP request/response transaction
+ * discard_headers - reads the rest of a request head and drops it
  *
+ * So that closing the connection after answering does not reset it.
+ * Returns false, having answered the client, if the head could not be
+ * read.
  */
-void serve(client_info *client) {
-    // Get some extra info about the client (hostname/port)
-    // This is optional, but it's nice to know who's connected
-    int res = getnameinfo((SA *)&client->addr, client->addrlen, client->host,
-                          sizeof(client->host), client->serv,
-                          sizeof(client->serv), 0);
-    if (res == 0) {
-        printf("Accepted connection from %s:%s\n", client->host, client->serv);
+static bool discard_headers(client_info *client, rio_t *rp) {
+    char buf[MAXLINE];
+    ssize_t n;
+    while ((n = read_header_line(client, rp, buf, sizeof(buf))) > 0) {
+        if (strcmp(buf, "\r\n") == 0) {
+            break;
+        }
+    }
+    if (n <= 0) {
+        header_failed(client, n);
+        return false;
+    }
+    long long now = stats_clock();
+    stats_time(HIST_HEADER, now - client->start);
+    trace_mark(&client->trace, TRACE_HEADER, now);
+    return true;
+}
+
+/**
+ * serve_status - answers a request for the proxy's own status page
+ *
+ * The page has the same "name value" lines as SIGUSR1 prints: counters,
+ * latency histograms and the state of the caches. With pre-forked
+ * workers, the counters are those of the worker that took the request.
+ */
+static void serve_status(client_info *client, rio_t *rp) {
+    if (!discard_headers(client, rp)) {
+        return;
+    }
+    stats_out_t out = {.fd = -1, .buf = malloc(STATUS_SIZE)};
+    if (out.buf == NULL) {
+        clienterror(client, "500", "Internal Server Error",
+                    "Proxy is out of memory");
+        return;
+    }
+    out.size = STATUS_SIZE;
+    out.buf[0] = '\0';
+    report_stats(&out);
+    report_caches(&out);
+
+    char header[MAXLINE];
+    int len = snprintf(header, sizeof(header),
+                       "HTTP/1.0 200 OK\r\n"
+                       "Content-Type: text/plain\r\n"
+                       "Content-Length: %zu\r\n"
+                       "Connection: close\r\n\r\n",
+                       out.len);
+    if (coro_writen(client->connfd, header, len) < 0 ||
+        coro_writen(client->connfd, out.buf, out.len) < 0) {
+        if (timed_out()) {
+            stats_inc(STAT_TIMEOUT_WRITE);
+        }
     } else {
-        fprintf(stderr, "getnameinfo failed: %s\n", gai_strerror(res));
+        client->record.status = 200;
+        client->record.bytes = len + out.len;
+        trace_mark(&client->trace, TRACE_RELAYED, stats_clock());
+    }
+    free(out.buf);
+}
+
+#ifdef CACHING
+/**
+ * serve_hit - answers a request from the cache on the fast lane
+ *
+ * Called right after the request line is parsed, before the headers are
+ * read, so that a hit never waits behind header building or fetch slots.
+ * On a hit the rest of the request head is read and discarded, so that
+ * closing the connection does not reset it, and the cached response is
+ * written. Returns false on a miss, with the request head left unread.
+ */
+static bool serve_hit(client_info *client, rio_t *rp, char *uri) {
+    char *cache_value = malloc(MAX_OBJECT_SIZE); // see do_proxy
+    if (cache_value == NULL) {
+        return false;
+    }
+    size_t cache_value_size = lookup(client, uri, cache_value);
+    if (cache_value_size == 0) {
+        free(cache_value);
+        return false;
     }
+    stats_inc(STAT_EARLY_HIT);
+    stats_inc(STAT_HITS);
+
+    if (discard_headers(client, rp)) {
+        write_hit(client, cache_value, cache_value_size);
+    }
+    free(cache_value);
+    return true;
+}
+#endif
 
-    rio_t rio;
+/**
+ * serve_request - reads a request into req and answers it
+ *
+ */
+static void serve_request(client_info *client, request_t *req) {
+    rio_t *rp = &req->rio;
     // Associate a descriptor with a read buffer and reset buffer
-    rio_readinitb(&rio, client->connfd);
+    rio_readinitb(rp, client->connfd);
 
     /* Read request line */
-    char buf[MAXLINE];
     // Robustly read a text line (buffered)
-    if (rio_readlineb(&rio, buf, sizeof(buf)) <= 0) {
+    ssize_t n = read_header_line(client, rp, req->line, sizeof(req->line));
+    if (n <= 0) {
+        header_failed(client, n);
         return;
     }
 
     /* parse the request line and check if it's well-formed */
-    char method[MAXLINE];
-    char uri[MAXLINE];
     char version;
 
     /* sscanf must parse exactly 3 things for request line to be well-formed */
     /* version must be either HTTP/1.0 or HTTP/1.1 */
-    if (sscanf(buf, "%s %s HTTP/1.%c", method, uri, &version) != 3 ||
+    if (sscanf(req->line, "%s %s HTTP/1.%c", req->method, req->uri,
+               &version) != 3 ||
         (version != '0' && version != '1')) {
-        clienterror(client->connfd, "400", "Bad Request",
+        clienterror(client, "400", "Bad Request",
                     "Proxy received a malformed request");
         return;
     }
+    size_t uri_len = strnlen(req->uri, LOG_URI_LEN - 1);
+    memcpy(client->record.uri, req->uri, uri_len);
+    client->record.uri[uri_len] = '\0';
 
     /* Check that method is GET */
-    if (strcmp(method, "GET") != 0) {
-        clienterror(client->connfd, "501", "Not Implemented",
+    if (strcmp(req->method, "GET") != 0) {
+        clienterror(client, "501", "Not Implemented",
                     "Proxy does not implement this method");
         return;
     }
 
     /* Parse URI from GET request */
-    char host[MAXLINE];
-    char path[MAXLINE];
-    memset(host, 0, MAXLINE * sizeof(char));
-    memset(path, 0, MAXLINE * sizeof(char));
-    if (parse_uri(uri, host, path)) {
+    memset(req->host, 0, MAXLINE * sizeof(char));
+    memset(req->path, 0, MAXLINE * sizeof(char));
+    if (parse_uri(req->uri, req->host, req->path)) {
         printf("Failed to parse URI.\n");
         return;
     }
 
     /* Parse server hostname and port */
-    char srv_hostname[MAXLINE];
-    char srv_port[MAXLINE];
-    memset(srv_hostname, 0, MAXLINE * sizeof(char));
-    memset(srv_port, 0, MAXLINE * sizeof(char));
-    parse_port(host, srv_hostname, srv_port);
+    memset(req->srv_hostname, 0, MAXLINE * sizeof(char));
+    memset(req->srv_port, 0, MAXLINE * sizeof(char));
+    parse_port(req->host, req->srv_hostname, req->srv_port);
+    stats_inc(STAT_REQUESTS);
+
+    /* Requests for the proxy itself */
+    if (strcasecmp(req->srv_hostname, STATUS_HOST) == 0 &&
+        strcmp(req->path, STATUS_PATH) == 0) {
+        serve_status(client, rp);
+        return;
+    }
+
+#ifdef CACHING
+    /* With priority lanes, hits are answered before the headers are read */
+    if (opts.lanes && serve_hit(client, rp, req->uri)) {
+        return;
+    }
+#endif
 
     /* Make proxy_req for proxy */
-    char proxy_request[MAXLINE];
-    memset(proxy_request, 0, MAXLINE * sizeof(char));
-    if (build_requesthdrs(client, &rio, proxy_request, method, path, host)) {
+    memset(req->proxy_request, 0, MAXLINE * sizeof(char));
+    if (build_requesthdrs(client, rp, req->proxy_request, req->method,
+                          req->path, req->host)) {
         return;
     }
+    long long now = stats_clock();
+    stats_time(HIST_HEADER, now - client->start);
+    trace_mark(&client->trace, TRACE_HEADER, now);
 
     /* finally, proxy the request for client */
-    do_proxy(client, proxy_request, srv_hostname, srv_port, uri);
+    do_proxy(client, req->proxy_request, req->srv_hostname, req->srv_port,
+             req->uri);
+}
+
+/**
+ * serve - handles one HTTP request/response transaction
+ *
+ */
+void serve(client_info *client) {
+    PROBE1(request_start, client->connfd);
+
+    // The client's address goes into the access log, as a number only;
+    // multishot accept does not collect it, so ask for it
+    if (client->addrlen == 0) {
+        client->addrlen = sizeof(client->addr);
+        getpeername(client->connfd, (SA *)&client->addr, &client->addrlen);
+    }
+
+    /* Bound how long a client may take to send and receive */
+    clock_gettime(CLOCK_MONOTONIC, &client->deadline);
+    client->deadline.tv_sec += opts.header_timeout / 1000;
+    client->deadline.tv_nsec += (opts.header_timeout % 1000) * 1000000;
+    set_timeout(client->connfd, SO_SNDTIMEO, opts.write_timeout);
+
+    request_t *req = malloc(sizeof(request_t));
+    if (req == NULL) {
+        clienterror(client, "500", "Internal Server Error",
+                    "Proxy is out of memory");
+        return;
+    }
+    serve_request(client, req);
+    free(req);
+}
+
+/**
+ * finish_client - closes a served client and frees its connection slot
+ *
+ */
+static void finish_client(client_info *client) {
+    client->record.total_ns = stats_clock() - client->start;
+    client->record.client = client->addr;
+    stats_time(HIST_TOTAL, client->record.total_ns);
+    log_access(&client->record);
+    PROBE5(request_end, client->connfd, client->record.uri,
+           client->record.status, client->record.bytes,
+           client->record.total_ns);
+    close(client->connfd);
+    stats_add(STAT_CONNS_ACTIVE, -1);
+    release_conn(&client->listener->admit);
+
+    trace_record_t *trace = &client->trace;
+    if (trace->start_ns != 0) {
+        trace_mark(trace, TRACE_CLOSED, stats_clock());
+        trace->bytes = (uint32_t)client->record.bytes;
+        trace->status = (uint16_t)client->record.status;
+        trace->cache = (uint8_t)client->record.cache;
+        strncpy(trace->uri, client->record.uri, TRACE_URI_LEN);
+        trace_submit(trace);
+    }
 }
 
 #ifdef THREAD
@@ -377,65 +989,912 @@ void *thread(void *vargp) {
     pthread_detach(pthread_self());
     free((client_info *)vargp);
     serve(client);
-    close(client->connfd);
+    finish_client(client);
     return NULL;
 }
+
+/* Coroutine routine */
+static void coroutine(void *vargp) {
+    client_info *client = vargp;
+    serve(client);
+    finish_client(client);
+    free(client);
+}
 #endif
 
-int main(int argc, char **argv) {
-    int listenfd;
+/**
+ * accept_loop - accepts clients on a listener and serves them
+ *
+ * Returns only when draining for an upgrade, once it has stopped taking
+ * connections off the listener.
+ */
+static void accept_loop(listener_t *listener) {
 #ifdef THREAD
     pthread_t tid;
 #endif
+    uring_t *ring = opts.uring ? uring_new() : NULL;
 
-    /* Check command line args */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
-        exit(1);
-    }
-
-    Signal(SIGPIPE, SIG_IGN);
-
-#ifdef CACHING
-    /* initialize cache */
-    cache = (cache_t *)Malloc(sizeof(cache_t));
-    init_cache(cache);
-#endif
+    while (1) {
+        if (draining) {
+            // serve what the ring accepted already, the new process the rest
+            if (ring != NULL) {
+                uring_accept_cancel(ring);
+            }
+            if (ring == NULL || ring->stashed == 0) {
+                break;
+            }
+        }
 
-    listenfd = open_listenfd(argv[1]);
-    if (listenfd < 0) {
-        fprintf(stderr, "Failed to listen on port: %s\n", argv[1]);
-    } else {
-        printf("Proxy starts to listen on port: %s\n", argv[1]);
-    }
+        /* At the connection limit, wait here and let the backlog fill up */
+        if (!try_acquire_conn(&listener->admit)) {
+            if (ring != NULL) {
+                // or the kernel would go on accepting on our behalf
+                uring_accept_cancel(ring);
+            }
+            acquire_conn(&listener->admit);
+        }
 
-    while (1) {
         /* Allocate space on the stack for client info */
         client_info *client = malloc(sizeof(client_info));
 
         /* Initialize the length of the address */
         client->addrlen = sizeof(client->addr);
+        client->listener = listener;
 
         /* accept() will block until a client connects to the port */
-        client->connfd =
-            accept(listenfd, (SA *)&client->addr, &client->addrlen);
+        if (ring != NULL) {
+            client->connfd = uring_accept(ring, listener->listenfd);
+            if (client->connfd < 0 && errno == EINVAL) {
+                // a kernel without multishot accepts, missed by the probe
+                fprintf(stderr, "io_uring accept failed, using accept\n");
+                uring_put(ring);
+                ring = NULL;
+            } else {
+                client->addrlen = 0;
+                memset(&client->addr, 0, sizeof(client->addr));
+            }
+        }
+        if (ring == NULL) {
+            client->connfd = accept(listener->listenfd, (SA *)&client->addr,
+                                    &client->addrlen);
+        }
         if (client->connfd < 0) {
-            perror("accept");
+            if (errno != EINTR) {
+                perror("accept");
+            }
+            free(client);
+            release_conn(&listener->admit);
             continue;
         }
+        stats_inc(STAT_CONNS_ACCEPTED);
+        stats_add(STAT_CONNS_ACTIVE, 1);
+        client->start = stats_clock();
+        client->record = (log_record_t){.cache = LOG_NONE};
+        if (trace_sampled(client->start)) {
+            client->trace = (trace_record_t){.start_ns = client->start};
+        } else {
+            client->trace.start_ns = 0;
+        }
 
 #ifndef THREAD
         /* Connection is established; serve client */
         serve(client);
-        close(client->connfd);
+        finish_client(client);
+        free(client);
 #else
-        /* Spawn new thread to handle client */
+        if (opts.coro) {
+            /* Hand the client to a coroutine worker, its I/O must not block */
+            int flags = fcntl(client->connfd, F_GETFL);
+            if (fcntl(client->connfd, F_SETFL, flags | O_NONBLOCK) < 0 ||
+                !spawn_coro(coroutine, client)) {
+                perror("Error creating coroutine");
+                finish_client(client);
+                free(client);
+            }
+            continue;
+        }
+
+        /* Spawn new thread to handle client, it inherits our core */
         if (pthread_create(&tid, NULL, thread, (void *)client) != 0) {
             perror("Error creating thread");
+            finish_client(client);
+            free(client);
+        }
+#endif
+    }
+    listener->stopped = 1;
+}
+
+#ifdef THREAD
+/**
+ * open_listenfd_reuseport - open_listenfd for per-core listeners
+ *
+ * Same as open_listenfd, but sets SO_REUSEPORT before binding, so that
+ * several sockets can listen on the same port and the kernel spreads
+ * incoming connections across their separate accept queues.
+ */
+static int open_listenfd_reuseport(const char *port) {
+    struct addrinfo hints, *listp, *p;
+    int listenfd = -1, rc, optval = 1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    if ((rc = getaddrinfo(NULL, port, &hints, &listp)) != 0) {
+        fprintf(stderr, "getaddrinfo failed (port %s): %s\n", port,
+                gai_strerror(rc));
+        return -2;
+    }
+
+    for (p = listp; p; p = p->ai_next) {
+        listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (listenfd < 0) {
+            continue;
+        }
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+        if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval,
+                       sizeof(int)) == 0 &&
+            bind(listenfd, p->ai_addr, p->ai_addrlen) == 0) {
+            break;
+        }
+        close(listenfd);
+    }
+
+    freeaddrinfo(listp);
+    if (!p) {
+        return -1;
+    }
+    if (listen(listenfd, LISTENQ) < 0) {
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+#ifdef CACHING
+/**
+ * node_of_cpu - returns the NUMA node of a core, or -1 if unknown
+ *
+ */
+static int node_of_cpu(int cpu) {
+    char path[64];
+    for (int node = 0; node < CACHE_MAX_NODES; node++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d",
+                 cpu, node);
+        if (access(path, F_OK) == 0) {
+            return node;
+        }
+    }
+    return -1;
+}
+#endif
+
+/**
+ * listener_thread - pins itself to its listener's core, if the listener
+ * has one, and runs its loop
+ *
+ * Connection threads inherit the pinning, so a listener only gets a core
+ * when no other listener, of this process or another worker, shares it.
+ */
+static void *listener_thread(void *vargp) {
+    listener_t *listener = (listener_t *)vargp;
+    if (listener->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(listener->cpu, &cpus);
+        int rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (rc != 0) {
+            fprintf(stderr, "Failed to pin listener to core %d: %s\n",
+                    listener->cpu, strerror(rc));
         }
+    }
+    accept_loop(listener);
+    return NULL;
+}
 #endif
+
+/**
+ * usage - prints command line usage and exits
+ *
+ */
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [options] <port>\n", prog);
+    fprintf(stderr, "  -b <n>     failures before an origin is cut off"
+                    " (default %d)\n",
+            HEALTH_DEF_THRESHOLD);
+    fprintf(stderr, "  -B <secs>  seconds before a cut-off origin is probed"
+                    " (default %d)\n",
+            HEALTH_DEF_COOLDOWN);
+    fprintf(stderr, "  -r <ms>    time for a client to send its request"
+                    " (default %d, 0 = none)\n",
+            DEF_HEADER_TIMEOUT);
+    fprintf(stderr, "  -u <ms>    time for a web server to send each chunk"
+                    " (default %d, 0 = none)\n",
+            DEF_UPSTREAM_TIMEOUT);
+    fprintf(stderr, "  -w <ms>    time for a client to take each chunk"
+                    " (default %d, 0 = none)\n",
+            DEF_WRITE_TIMEOUT);
+    fprintf(stderr, "  -c <n>     connections served at once"
+                    " (default %d, 0 = no limit)\n",
+            ADMIT_DEF_MAX_CONNS);
+    fprintf(stderr, "  -f <n>     fetches to web servers at once"
+                    " (default %d, 0 = no limit)\n",
+            ADMIT_DEF_MAX_FETCHES);
+    fprintf(stderr, "  -L         priority lanes: serve cache hits ahead of"
+                    " misses\n");
+    fprintf(stderr, "  -q <n>     misses that may queue for a fetch with -L"
+                    " (default %d)\n",
+            ADMIT_DEF_MAX_QUEUED);
+    fprintf(stderr, "  -H <n>     connections kept free of misses with -L"
+                    " (default %d)\n",
+            ADMIT_DEF_HIT_RESERVE);
+    fprintf(stderr, "  -n <n>     n SO_REUSEPORT listeners, pinned to cores if"
+                    " enough (0 = one per core)\n");
+    fprintf(stderr, "  -S         give each -n listener its own share of the"
+                    " cache\n");
+    fprintf(stderr, "  -U         use io_uring for accepts and cache misses,"
+                    " if available\n");
+    fprintf(stderr, "  -M <n>     serve connections as coroutines on n threads"
+                    " (0 = one per core)\n");
+    fprintf(stderr, "  -P <n>     pre-fork n worker processes sharing one"
+                    " cache (0 = one per core)\n");
+    fprintf(stderr, "  -T <n>     each thread keeps references to its n"
+                    " hottest objects (max %d)\n",
+            CACHE_HOT_MAX);
+    fprintf(stderr, "  -l <file>  append the access log to file instead of"
+                    " stdout\n");
+    fprintf(stderr, "  -t <n>     trace the phases of one request in n"
+                    " (default: none)\n");
+    fprintf(stderr, "  -o <file>  append traced requests to file"
+                    " (default: " TRACE_DEF_FILE ")\n");
+    fprintf(stderr, "Send SIGUSR1 to print the proxy's counters, or GET"
+                    " http://" STATUS_HOST STATUS_PATH " through it.\n");
+    fprintf(stderr, "Send SIGUSR2 to upgrade to the binary on disk, keeping"
+                    " the cache.\n");
+    exit(1);
+}
+
+/**
+ * sigusr1_handler - prints the proxy's counters on demand
+ *
+ */
+static void sigusr1_handler(int sig) {
+    int olderrno = errno;
+    stats_out_t out = {.fd = STDOUT_FILENO};
+    report_stats(&out);
+    report_caches(&out);
+    errno = olderrno;
+}
+
+/**
+ * parse_num - parses a non-negative integer option argument
+ *
+ * Exits with usage if the argument is not a number.
+ */
+static unsigned long parse_num(const char *prog, const char *arg) {
+    char *end;
+    errno = 0;
+    unsigned long num = strtoul(arg, &end, 10);
+    if (errno != 0 || end == arg || *end != '\0' || arg[0] == '-') {
+        usage(prog);
+    }
+    return num;
+}
+
+/**
+ * inherited_fd - returns the i-th fd of a list passed by an upgrade
+ *
+ * `name` is one of the ENV_* variables, a comma-separated list of fds.
+ * Returns -1 if there is no such list or it is shorter.
+ */
+static int inherited_fd(const char *name, int i) {
+    const char *list = getenv(name);
+    while (list != NULL && *list != '\0') {
+        char *end;
+        long fd = strtol(list, &end, 10);
+        if (end == list || fd < 0 || fd > INT_MAX) {
+            break;
+        }
+        if (i-- == 0) {
+            return (int)fd;
+        }
+        list = *end == ',' ? end + 1 : end;
+    }
+    return -1;
+}
+
+/**
+ * adopt_cache - maps the i-th cache passed by an upgrade, or a new one
+ *
+ * Listeners that shared a cache before the upgrade share it after, as
+ * they all pass the same memfd. A new cache is placed on NUMA node node,
+ * or anywhere if it is -1, and holds capacity bytes; an adopted one keeps
+ * the capacity it had.
+ */
+static cache_t *adopt_cache(int i, int node, size_t capacity) {
+    int fd = inherited_fd(ENV_CACHE_FDS, i);
+    if (fd >= 0 && cache != NULL && fd == cache->fd) {
+        return cache;
+    }
+
+    cache_t *adopted = fd >= 0 ? attach_cache(fd) : NULL;
+    if (fd >= 0 && adopted == NULL) {
+        fprintf(stderr, "Cannot map the old cache, starting afresh\n");
+    }
+    if (adopted == NULL) {
+        if ((adopted = new_cache(node)) == NULL) {
+            fprintf(stderr, "Failed to allocate the cache\n");
+            exit(1);
+        }
+        if (capacity < MAX_CACHE_SIZE) {
+            set_cache_capacity(adopted, capacity);
+        }
+    }
+    return adopted;
+}
+
+/**
+ * close_inherited - closes what an upgrade passed in but is not used
+ *
+ * An old binary may have had more listeners, or a cache this one could not
+ * map. A listening socket left open and unaccepted would strand the
+ * connections the kernel hands it.
+ */
+static void close_inherited(listener_t *listeners) {
+    for (int i = opts.listeners; inherited_fd(ENV_LISTEN_FDS, i) >= 0; i++) {
+        close(inherited_fd(ENV_LISTEN_FDS, i));
+    }
+    for (int i = 0; inherited_fd(ENV_CACHE_FDS, i) >= 0; i++) {
+        int fd = inherited_fd(ENV_CACHE_FDS, i);
+        bool used = cache != NULL && cache->fd == fd;
+        for (int j = 0; j < opts.listeners && !used; j++) {
+            used = listeners[j].cache != NULL && listeners[j].cache->fd == fd;
+        }
+        // several listeners may pass one cache, close it only once
+        for (int j = 0; j < i && !used; j++) {
+            used = inherited_fd(ENV_CACHE_FDS, j) == fd;
+        }
+        if (!used) {
+            close(fd);
+        }
+    }
+}
+
+/**
+ * notify_ready - tells the process that started us by upgrade we listen
+ *
+ */
+static void notify_ready(void) {
+    int fd = inherited_fd(ENV_READY_FD, 0);
+    if (fd >= 0) {
+        if (write(fd, "", 1) != 1) {
+            perror("Failed to report the upgrade");
+        }
+        close(fd);
+    }
+    unsetenv(ENV_LISTEN_FDS);
+    unsetenv(ENV_CACHE_FDS);
+    unsetenv(ENV_READY_FD);
+}
+
+/**
+ * upgrade_env - builds the environment for the binary an upgrade starts
+ *
+ * Our own variables come first, all in the block at envp[0], followed by
+ * the rest of the environment; free with free(envp[0]) and free(envp).
+ */
+static char **upgrade_env(listener_t *listeners, int ready_fd) {
+    extern char **environ;
+    size_t nenv = 0;
+    while (environ[nenv] != NULL) {
+        nenv++;
+    }
+    char **envp = Malloc((nenv + 4) * sizeof(char *));
+
+    size_t list_len = (size_t)opts.listeners * 12 + 32;
+    char *block = Malloc(2 * list_len + 32);
+    char *listen_fds = block, *cache_fds = block + list_len;
+    int listen_len = sprintf(listen_fds, "%s=", ENV_LISTEN_FDS);
+    int cache_len = sprintf(cache_fds, "%s=", ENV_CACHE_FDS);
+    for (int i = 0; i < opts.listeners; i++) {
+        const char *sep = i > 0 ? "," : "";
+        listen_len += sprintf(listen_fds + listen_len, "%s%d", sep,
+                              listeners[i].listenfd);
+        if (listeners[i].cache != NULL) {
+            cache_len += sprintf(cache_fds + cache_len, "%s%d", sep,
+                                 listeners[i].cache->fd);
+        }
+    }
+    char *ready = block + 2 * list_len;
+    sprintf(ready, "%s=%d", ENV_READY_FD, ready_fd);
+
+    envp[0] = block;
+    envp[1] = cache_fds;
+    envp[2] = ready;
+    memcpy(envp + 3, environ, (nenv + 1) * sizeof(char *));
+    return envp;
+}
+
+/**
+ * launch_upgrade - starts the binary on disk, handing it our listeners
+ *
+ * The new process inherits the listening sockets and the cache memfds, so
+ * no connection is refused and no cached response is lost, and reports on
+ * a pipe once it listens. Returns true then; if it fails to, it is killed
+ * and we go on serving as if nothing happened.
+ */
+static bool launch_upgrade(listener_t *listeners) {
+    if (exe_path[0] == '\0') {
+        fprintf(stderr, "Cannot upgrade: path of the binary is unknown\n");
+        return false;
     }
-    free_cache(cache);
+    int ready[2];
+    if (pipe2(ready, O_CLOEXEC) < 0) {
+        perror("pipe2");
+        return false;
+    }
+
+    // the child may only make async-signal-safe calls, so prepare it all now
+    char **envp = upgrade_env(listeners, ready[1]);
+    long max_fd = sysconf(_SC_OPEN_MAX);
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR2);
 
+    pid_t pid = fork();
+    if (pid == 0) {
+        // nothing but what we hand over may leak into the new binary
+        if (close_range(3, ~0U, CLOSE_RANGE_CLOEXEC) < 0) {
+            for (int fd = 3; fd < max_fd; fd++) {
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+            }
+        }
+        for (int i = 0; i < opts.listeners; i++) {
+            fcntl(listeners[i].listenfd, F_SETFD, 0);
+            if (listeners[i].cache != NULL) {
+                fcntl(listeners[i].cache->fd, F_SETFD, 0);
+            }
+        }
+        fcntl(ready[1], F_SETFD, 0);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        execve(exe_path, saved_argv, envp);
+        _exit(127);
+    }
+    close(ready[1]);
+    free(envp[0]);
+    free(envp);
+    if (pid < 0) {
+        perror("fork");
+        close(ready[0]);
+        return false;
+    }
+
+    struct pollfd pfd = {.fd = ready[0], .events = POLLIN};
+    char byte;
+    int rc;
+    do {
+        rc = poll(&pfd, 1, UPGRADE_TIMEOUT);
+    } while (rc < 0 && errno == EINTR);
+    bool ok = rc == 1 && read(ready[0], &byte, 1) == 1;
+    close(ready[0]);
+    if (!ok) {
+        fprintf(stderr, "Upgrade failed: the new binary did not start\n");
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return false;
+    }
+    printf("Upgraded: process %d took over, draining\n", (int)pid);
+    fflush(stdout);
+    return true;
+}
+
+/**
+ * drain - stops accepting and exits once open connections are served
+ *
+ * Called once another process has the listeners. The accept loops are
+ * woken from accept with SIGRTMIN, over and over, since a loop may be just
+ * about to block again when the flag is set.
+ */
+static void drain(listener_t *listeners) {
+    draining = 1;
+    bool waiting = true;
+    while (waiting) {
+        waiting = false;
+        for (int i = 0; i < opts.listeners; i++) {
+            if (!listeners[i].stopped) {
+                waiting = true;
+                pthread_kill(listeners[i].tid, SIGRTMIN);
+            }
+        }
+        if (waiting) {
+            usleep(DRAIN_INTERVAL);
+        }
+    }
+
+    // the new process has its own copies of the listeners
+    for (int i = 0; i < opts.listeners; i++) {
+        close(listeners[i].listenfd);
+    }
+    while (stats_get(STAT_CONNS_ACTIVE) > 0) {
+        usleep(DRAIN_INTERVAL);
+    }
+    flush_log();
+    flush_trace();
+    exit(0);
+}
+
+/**
+ * wake_handler - does nothing, but makes a blocked accept fail with EINTR
+ *
+ */
+static void wake_handler(int sig) {
+}
+
+/**
+ * upgrade_thread - upgrades to the binary on disk on SIGUSR2
+ *
+ * SIGUSR2 is blocked in every thread and taken here by sigwait, so the
+ * upgrade runs as ordinary code rather than in a signal handler. A
+ * pre-forked worker is told by its master, and just drains.
+ */
+static void *upgrade_thread(void *vargp) {
+    listener_t *listeners = (listener_t *)vargp;
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR2);
+    pthread_detach(pthread_self());
+
+    while (1) {
+        int sig;
+        if (sigwait(&mask, &sig) == 0 &&
+            (is_worker || launch_upgrade(listeners))) {
+            drain(listeners);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * prefork - forks the worker processes and looks after them
+ *
+ * Returns in each worker. The master stays in here for good, starting a
+ * new worker whenever one dies, so that a crash only costs the connections
+ * of the worker that crashed; the shared cache recovers on its own. On
+ * SIGUSR2 it upgrades: once the new master listens, the workers drain and
+ * the old master exits with them.
+ */
+static void prefork(int nprocs, listener_t *listeners) {
+    pid_t master = getpid();
+    pid_t *pids = Calloc(nprocs, sizeof(pid_t));
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &mask, &old_mask);
+
+    fflush(stdout); // or every worker would write out what is buffered
+    while (1) {
+        for (int i = 0; i < nprocs; i++) {
+            if (pids[i] > 0) {
+                continue;
+            }
+            pid_t pid = fork();
+            if (pid == 0) {
+                // a worker must not outlive the master
+                prctl(PR_SET_PDEATHSIG, SIGTERM);
+                if (getppid() != master) {
+                    exit(0);
+                }
+                sigprocmask(SIG_SETMASK, &old_mask, NULL);
+                free(pids);
+                is_worker = true;
+                worker_index = i;
+                return;
+            }
+            if (pid < 0) {
+                perror("fork");
+                sleep(1);
+                continue;
+            }
+            pids[i] = pid;
+        }
+
+        if (sigwaitinfo(&mask, NULL) == SIGUSR2 && launch_upgrade(listeners)) {
+            for (int i = 0; i < nprocs; i++) {
+                if (pids[i] > 0) {
+                    kill(pids[i], SIGUSR2);
+                }
+            }
+            for (int i = 0; i < nprocs; i++) {
+                if (pids[i] > 0) {
+                    waitpid(pids[i], NULL, 0);
+                }
+            }
+            exit(0);
+        }
+
+        pid_t pid;
+        while ((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+            for (int i = 0; i < nprocs; i++) {
+                if (pids[i] == pid) {
+                    pids[i] = 0;
+                    fprintf(stderr, "Worker %d exited, starting another\n",
+                            (int)pid);
+                }
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    int opt;
+
+    /* Check command line args */
+    while ((opt = getopt(argc, argv, "b:B:r:u:w:c:f:Lq:H:n:SUM:P:T:l:t:o:")) !=
+           -1) {
+        switch (opt) {
+        case 'b':
+            opts.breaker_threshold = parse_num(argv[0], optarg);
+            break;
+        case 'B':
+            opts.breaker_cooldown = parse_num(argv[0], optarg);
+            break;
+        case 'r':
+            opts.header_timeout = parse_num(argv[0], optarg);
+            break;
+        case 'u':
+            opts.upstream_timeout = parse_num(argv[0], optarg);
+            break;
+        case 'w':
+            opts.write_timeout = parse_num(argv[0], optarg);
+            break;
+        case 'c':
+            opts.max_conns = parse_num(argv[0], optarg);
+            break;
+        case 'f':
+            opts.max_fetches = parse_num(argv[0], optarg);
+            break;
+        case 'L':
+            opts.lanes = true;
+            break;
+        case 'q':
+            opts.max_queued = parse_num(argv[0], optarg);
+            break;
+        case 'H':
+            opts.hit_reserve = parse_num(argv[0], optarg);
+            break;
+        case 'n':
+            opts.listeners = parse_num(argv[0], optarg);
+            opts.per_core = true;
+            break;
+        case 'S':
+            opts.partition = true;
+            break;
+        case 'U':
+            opts.uring = true;
+            break;
+        case 'M':
+            opts.coro_threads = parse_num(argv[0], optarg);
+            opts.coro = true;
+            break;
+        case 'P':
+            opts.processes = parse_num(argv[0], optarg);
+            opts.prefork = true;
+            break;
+        case 'T':
+            opts.hot_objects = parse_num(argv[0], optarg);
+            break;
+        case 'l':
+            opts.access_log = optarg;
+            break;
+        case 't':
+            opts.trace_rate = parse_num(argv[0], optarg);
+            break;
+        case 'o':
+            opts.trace_file = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || opts.breaker_threshold == 0) {
+        usage(argv[0]);
+    }
+    char *port = argv[optind];
+
+    init_stats();
+    Signal(SIGPIPE, SIG_IGN);
+    Signal(SIGUSR1, sigusr1_handler);
+
+    /* SIGUSR2 is left to upgrade_thread; every thread inherits the mask */
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = wake_handler; // no SA_RESTART, see drain
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGRTMIN, &action, NULL);
+
+    /* Remember how we were started, for upgrades to do the same */
+    ssize_t len = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+    exe_path[len > 0 ? len : 0] = '\0';
+    saved_argv = argv;
+
+    init_health(&health, opts.breaker_threshold, opts.breaker_cooldown);
+    if (!init_log(opts.access_log)) {
+        fprintf(stderr, "Failed to open access log: %s\n", opts.access_log);
+        exit(1);
+    }
+    if (!init_trace(opts.trace_file, opts.trace_rate)) {
+        fprintf(stderr, "Failed to open trace file: %s\n", opts.trace_file);
+        exit(1);
+    }
+    if (opts.uring && !uring_probe()) {
+        fprintf(stderr, "io_uring is not available, using blocking I/O\n");
+        opts.uring = false;
+    }
+
+    if (opts.prefork && opts.processes == 0) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        opts.processes = ncpus > 0 ? (int)ncpus : 1;
+    }
+    if (opts.prefork) {
+        // limits are for the whole proxy, split them between the workers
+        unsigned int n = (unsigned int)opts.processes;
+        opts.max_conns = (opts.max_conns + n - 1) / n;
+        opts.max_fetches = (opts.max_fetches + n - 1) / n;
+        opts.max_queued = (opts.max_queued + n - 1) / n;
+        opts.hit_reserve = (opts.hit_reserve + n - 1) / n;
+    }
+
+#ifdef CACHING
+    /* initialize cache, or take over the one of the binary we replace */
+    cache = adopt_cache(0, -1, MAX_CACHE_SIZE);
+    set_hot_objects(opts.hot_objects);
+#endif
+
+#ifdef THREAD
+    int ncpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (opts.per_core && opts.listeners == 0) {
+        opts.listeners = ncpus > 0 ? ncpus : 1;
+    }
+    // listeners are pinned only if every one, in every worker, gets a core
+    // of its own; otherwise they and their connections go anywhere
+    int nprocs = opts.prefork ? opts.processes : 1;
+    bool pin = opts.per_core && ncpus > 0 && opts.listeners * nprocs <= ncpus;
+    if (opts.coro) {
+        // a miss queued for a fetch slot would block its worker thread, and
+        // every connection on it, so misses are shed right away instead
+        opts.max_queued = 0;
+        if (opts.coro_threads == 0) {
+            opts.coro_threads = ncpus > 0 ? ncpus : 1;
+        }
+    }
+#else
+    opts.per_core = false;
+    opts.coro = false;
+#endif
+    if (opts.listeners == 0) {
+        usage(argv[0]);
+    }
+
+    /* Set up the listeners; limits are split evenly between them */
+    listener_t *listeners = Calloc(opts.listeners, sizeof(listener_t));
+    for (int i = 0; i < opts.listeners; i++) {
+        listener_t *listener = &listeners[i];
+        unsigned int n = (unsigned int)opts.listeners;
+        listener->cpu = -1;
+        listener->cache = cache;
+        init_admit(&listener->admit, (opts.max_conns + n - 1) / n,
+                   (opts.max_fetches + n - 1) / n);
+        if (opts.lanes) {
+            // a queued miss waits no longer than a slow web server would
+            init_lanes(&listener->admit, (opts.max_queued + n - 1) / n,
+                       (opts.hit_reserve + n - 1) / n, opts.upstream_timeout);
+        }
+
+        /* An upgrade hands over sockets that are listening already */
+        listener->listenfd = inherited_fd(ENV_LISTEN_FDS, i);
+#ifdef THREAD
+        if (opts.per_core) {
+            listener->cpu = pin ? i : -1;
+            if (listener->listenfd < 0) {
+                listener->listenfd = open_listenfd_reuseport(port);
+            }
+#ifdef CACHING
+            if (opts.partition) {
+                // the listeners split one cache's worth between them; as
+                // their connections run on the listener's core, keep each
+                // part's memory on that core's node, unless workers on
+                // other cores share it too
+                int node = listener->cpu >= 0 && !opts.prefork
+                               ? node_of_cpu(listener->cpu)
+                               : -1;
+                listener->cache = adopt_cache(i, node, MAX_CACHE_SIZE / n);
+            }
+#endif
+        } else if (listener->listenfd < 0) {
+            listener->listenfd = open_listenfd(port);
+        }
+#else
+        if (listener->listenfd < 0) {
+            listener->listenfd = open_listenfd(port);
+        }
+#endif
+        if (listener->listenfd < 0) {
+            fprintf(stderr, "Failed to listen on port: %s\n", port);
+            exit(1);
+        }
+    }
+    all_listeners = listeners;
+    printf("Proxy starts to listen on port: %s\n", port);
+    close_inherited(listeners);
+    notify_ready();
+
+    /* Workers inherit the listeners and the cache, the master stays behind */
+    if (opts.prefork) {
+        prefork(opts.processes, listeners);
+#ifdef THREAD
+        // each worker's listeners take the cores after the last worker's
+        for (int i = 0; i < opts.listeners; i++) {
+            if (listeners[i].cpu >= 0) {
+                listeners[i].cpu += worker_index * opts.listeners;
+            }
+        }
+#endif
+    }
+    start_log();
+    start_trace();
+
+#ifdef CACHING
+    /* Evicted blocks are freed in the background, once per cache */
+    for (int i = 0; i < opts.listeners; i++) {
+        int j = 0;
+        while (listeners[j].cache != listeners[i].cache) {
+            j++;
+        }
+        if (j == i) {
+            start_evictor(listeners[i].cache);
+        }
+    }
+#endif
+
+#ifdef THREAD
+    if (opts.coro) {
+        start_coros(opts.coro_threads);
+    }
+
+    /* Every per-core listener gets its own accept loop thread */
+    for (int i = 1; i < opts.listeners; i++) {
+        if (pthread_create(&listeners[i].tid, NULL, listener_thread,
+                           &listeners[i]) != 0) {
+            perror("Error creating listener thread");
+            exit(1);
+        }
+    }
+#endif
+    listeners[0].tid = pthread_self();
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, upgrade_thread, listeners) != 0) {
+        perror("Error creating upgrade thread");
+        exit(1);
+    }
+
+#ifdef THREAD
+    if (opts.per_core) {
+        listener_thread(&listeners[0]);
+    } else {
+        accept_loop(&listeners[0]);
+    }
+#else
+    accept_loop(&listeners[0]);
+#endif
+
+    /* Only reached when draining, and drain exits by itself */
+    while (1) {
+        pause();
+    }
     return -1; // never reaches here
 }
@@ -0,0 +1,194 @@
+/**
+ * @file proxy_admit.c
+ * @brief Admission control for the proxy
+ *
+ * Connections are limited in the accept loop: once the limit is reached the
+ * loop stops calling accept() until a connection finishes, so excess
+ * clients wait in the kernel's listen backlog instead of each getting a
+ * thread. Fetches are limited where a cache miss is about to go to a web
+ * server: past the limit the miss is refused on the spot, while cache hits
+ * are still answered.
+ *
+ * Priority lanes change the miss side: a miss that finds every fetch slot
+ * taken waits in a bounded queue for one instead of being refused, and
+ * misses (queued or fetching) are only admitted while they leave
+ * `hit_reserve` connections to cache hits, which need no slot at all.
+ *
+ * @author Taiming Liu <taimingl@andrew.cmu.edu>
+ */
+#include "proxy_admit.h"
+#include "proxy_stats.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+/**
+ * @brief Initializes admission state.
+ * @param[in] admit pointer to the admission state to be initialized.
+ * @param[in] max_conns connections served at once, 0 for no limit.
+ * @param[in] max_fetches fetches in flight at once, 0 for no limit.
+ *
+ */
+void init_admit(admit_t *admit, unsigned int max_conns,
+                unsigned int max_fetches) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+    admit->max_conns = max_conns;
+    admit->max_fetches = max_fetches;
+    admit->max_queued = 0;
+    admit->hit_reserve = 0;
+    admit->max_wait = 0;
+    admit->conns = 0;
+    admit->fetches = 0;
+    admit->queued = 0;
+    pthread_mutex_init(&admit->mutex, NULL);
+    pthread_cond_init(&admit->conn_done, NULL);
+    pthread_cond_init(&admit->fetch_done, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+/**
+ * @brief Enables priority lanes.
+ * @param[in] admit pointer to the admission state.
+ * @param[in] max_queued misses that may wait for a fetch slot at once.
+ * @param[in] hit_reserve connections that misses may never occupy.
+ * @param[in] max_wait ms a queued miss waits for a slot, 0 for no limit.
+ *
+ */
+void init_lanes(admit_t *admit, unsigned int max_queued,
+                unsigned int hit_reserve, long max_wait) {
+    admit->max_queued = max_queued;
+    admit->hit_reserve = hit_reserve;
+    admit->max_wait = max_wait;
+}
+
+/**
+ * @brief Waits for a free connection slot and claims it.
+ * @param[in] admit pointer to the admission state.
+ *
+ * Called by the accept loop before accept(), so that while the proxy is at
+ * its limit new clients queue up in the kernel.
+ */
+void acquire_conn(admit_t *admit) {
+    pthread_mutex_lock(&admit->mutex);
+    if (admit->max_conns > 0 && admit->conns >= admit->max_conns) {
+        stats_inc(STAT_ACCEPT_THROTTLED);
+        while (admit->conns >= admit->max_conns) {
+            pthread_cond_wait(&admit->conn_done, &admit->mutex);
+        }
+    }
+    admit->conns++;
+    pthread_mutex_unlock(&admit->mutex);
+}
+
+/**
+ * @brief Claims a connection slot if one is free, without waiting.
+ * @param[in] admit pointer to the admission state.
+ *
+ */
+bool try_acquire_conn(admit_t *admit) {
+    bool claimed = false;
+
+    pthread_mutex_lock(&admit->mutex);
+    if (admit->max_conns == 0 || admit->conns < admit->max_conns) {
+        admit->conns++;
+        claimed = true;
+    }
+    pthread_mutex_unlock(&admit->mutex);
+    return claimed;
+}
+
+/**
+ * @brief Gives back a connection slot.
+ * @param[in] admit pointer to the admission state.
+ *
+ */
+void release_conn(admit_t *admit) {
+    pthread_mutex_lock(&admit->mutex);
+    admit->conns--;
+    pthread_cond_signal(&admit->conn_done);
+    pthread_mutex_unlock(&admit->mutex);
+}
+
+/**
+ * @brief Private helper function to wait in the miss queue for a slot.
+ * @param[in] admit pointer to the admission state, with mutex held.
+ *
+ * Returns false if no slot freed up within max_wait.
+ */
+static bool wait_fetch(admit_t *admit) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += admit->max_wait / 1000;
+    deadline.tv_nsec += (admit->max_wait % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    admit->queued++;
+    stats_inc(STAT_MISS_QUEUED);
+    stats_add(STAT_MISSES_WAITING, 1);
+    int rc = 0;
+    while (admit->fetches >= admit->max_fetches && rc != ETIMEDOUT) {
+        if (admit->max_wait > 0) {
+            rc = pthread_cond_timedwait(&admit->fetch_done, &admit->mutex,
+                                        &deadline);
+        } else {
+            pthread_cond_wait(&admit->fetch_done, &admit->mutex);
+        }
+    }
+    admit->queued--;
+    stats_add(STAT_MISSES_WAITING, -1);
+    return admit->fetches < admit->max_fetches;
+}
+
+/**
+ * @brief Claims a fetch slot for a cache miss.
+ * @param[in] admit pointer to the admission state.
+ *
+ * Without lanes a miss that finds all slots taken is refused right away.
+ * With lanes it waits in the miss queue, unless the queue is full or the
+ * miss would eat into the connections reserved for hits. Returns false if
+ * the miss is shed, in which case nothing is claimed.
+ */
+bool acquire_fetch(admit_t *admit) {
+    bool admitted = true;
+
+    pthread_mutex_lock(&admit->mutex);
+    if (admit->max_conns > 0 && admit->hit_reserve > 0 &&
+        admit->fetches + admit->queued + admit->hit_reserve >=
+            admit->max_conns) {
+        admitted = false;
+    } else if (admit->max_fetches > 0 &&
+               admit->fetches >= admit->max_fetches) {
+        admitted = admit->queued < admit->max_queued && wait_fetch(admit);
+    }
+    if (admitted) {
+        admit->fetches++;
+    }
+    pthread_mutex_unlock(&admit->mutex);
+
+    if (admitted) {
+        stats_add(STAT_FETCHES_ACTIVE, 1);
+    } else {
+        stats_inc(STAT_SHED_MISS);
+    }
+    return admitted;
+}
+
+/**
+ * @brief Gives back a fetch slot.
+ * @param[in] admit pointer to the admission state.
+ *
+ */
+void release_fetch(admit_t *admit) {
+    pthread_mutex_lock(&admit->mutex);
+    admit->fetches--;
+    pthread_cond_signal(&admit->fetch_done);
+    pthread_mutex_unlock(&admit->mutex);
+    stats_add(STAT_FETCHES_ACTIVE, -1);
+}
@@ -0,0 +1,68 @@
+/**
+ * @file proxy_admit.h
+ * @brief Prototypes and definitions for proxy_admit.c
+ *
+ * Admission control for the proxy. The number of client connections being
+ * served and the number of fetches in flight to web servers are both
+ * capped, so that overload degrades into slower accepts and fast 503s for
+ * cache misses rather than unbounded thread growth.
+ *
+ * With priority lanes enabled, cache hits and misses are admitted
+ * separately: hits are never limited, while misses queue for a fetch slot
+ * and may never occupy the connections reserved for hits.
+ *
+ * @author Taiming Liu <taimingl@andrew.cmu.edu>
+ */
+#ifndef PROXY_ADMIT_H
+#define PROXY_ADMIT_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+/* Default limits (0 means unlimited) */
+#define ADMIT_DEF_MAX_CONNS 1024
+#define ADMIT_DEF_MAX_FETCHES 512
+
+/* Default priority lane settings */
+#define ADMIT_DEF_MAX_QUEUED 256
+#define ADMIT_DEF_HIT_RESERVE 64
+
+/* Admission state shared by the accept loop and all serving threads */
+typedef struct admit {
+    unsigned int max_conns;    /* connections served at once */
+    unsigned int max_fetches;  /* fetches to web servers in flight at once */
+    unsigned int max_queued;   /* misses waiting for a fetch slot (lanes) */
+    unsigned int hit_reserve;  /* connections misses may not occupy (lanes) */
+    long max_wait;             /* ms a queued miss waits, 0 for no limit */
+    unsigned int conns;        /* connections being served */
+    unsigned int fetches;      /* fetches in flight */
+    unsigned int queued;       /* misses waiting for a fetch slot */
+    pthread_mutex_t mutex;     /* protects the counts above */
+    pthread_cond_t conn_done;  /* signaled when a connection finishes */
+    pthread_cond_t fetch_done; /* signaled when a fetch finishes */
+} admit_t;
+
+/* Initializes admission state with the given limits, lanes disabled */
+void init_admit(admit_t *admit, unsigned int max_conns,
+                unsigned int max_fetches);
+
+/* Enables priority lanes for cache misses */
+void init_lanes(admit_t *admit, unsigned int max_queued,
+                unsigned int hit_reserve, long max_wait);
+
+/* Blocks until another connection may be accepted, then claims it */
+void acquire_conn(admit_t *admit);
+
+/* Claims a connection slot if one is free, returns false otherwise */
+bool try_acquire_conn(admit_t *admit);
+
+/* Gives back a connection claimed by acquire_conn */
+void release_conn(admit_t *admit);
+
+/* Claims a fetch slot for a miss, returns false if the miss is shed */
+bool acquire_fetch(admit_t *admit);
+
+/* Gives back a fetch slot claimed by acquire_fetch */
+void release_fetch(admit_t *admit);
+
+#endif /* PROXY_ADMIT_H */
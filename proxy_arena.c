@@ -0,0 +1,213 @@
+/**
+ * @file proxy_arena.c
+ * @brief Segregated-fit allocator over a fixed region
+ *
+ * Free chunks are kept in a list per power of two in size, so that an
+ * allocation looks only at chunks of about its size, and takes the first
+ * chunk of any larger class as it is. Every chunk notes in its header
+ * whether it and the chunk before it are free, and a free chunk's size is
+ * repeated in the header of the chunk after it; so a freed chunk merges
+ * with free neighbours on either side without a walk, and the region does
+ * not splinter as cache blocks of different sizes come and go. Caches of
+ * many thousands of blocks take no longer to allocate from than small ones.
+ *
+ * @author Taiming Liu <taimingl@andrew.cmu.edu>
+ */
+#include "proxy_arena.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Chunk sizes are multiples of this, which keeps payloads aligned */
+#define ARENA_ALIGN 16
+
+/* Flags in the low bits of a chunk's size */
+#define CHUNK_FREE 1UL      /* the chunk is free */
+#define CHUNK_PREV_FREE 2UL /* the chunk before it is free */
+#define CHUNK_FLAGS (CHUNK_FREE | CHUNK_PREV_FREE)
+
+/* Bytes of the header of an allocated chunk, before its payload */
+#define CHUNK_HEADER offsetof(arena_chunk_t, next)
+
+/* Smallest chunk, room for the links of a free one */
+#define CHUNK_MIN sizeof(arena_chunk_t)
+
+static size_t chunk_size(arena_chunk_t *chunk) {
+    return chunk->size & ~CHUNK_FLAGS;
+}
+
+/**
+ * @brief Private helper function returning the chunk after chunk, or NULL
+ * if it is the last in the arena.
+ */
+static arena_chunk_t *next_chunk(arena_t *arena, arena_chunk_t *chunk) {
+    char *next = (char *)chunk + chunk_size(chunk);
+    return next < arena->start + arena->size ? (arena_chunk_t *)next : NULL;
+}
+
+/**
+ * @brief Private helper function returning the free list of a size.
+ * @param[in] size bytes in a chunk, at least CHUNK_MIN.
+ *
+ */
+static unsigned int size_class(size_t size) {
+    return (unsigned int)(sizeof(unsigned long) * 8 - 1 -
+                          __builtin_clzl(size / CHUNK_MIN));
+}
+
+/**
+ * @brief Private helper function marking a chunk free and listing it.
+ * @param[in] arena pointer to the arena.
+ * @param[in] chunk chunk, whose CHUNK_PREV_FREE flag is already right.
+ * @param[in] size bytes in the chunk.
+ *
+ */
+static void insert_free(arena_t *arena, arena_chunk_t *chunk, size_t size) {
+    unsigned int k = size_class(size);
+    chunk->size = size | CHUNK_FREE | (chunk->size & CHUNK_PREV_FREE);
+    chunk->prev = NULL;
+    chunk->next = arena->free_lists[k];
+    if (chunk->next != NULL) {
+        chunk->next->prev = chunk;
+    }
+    arena->free_lists[k] = chunk;
+    arena->classes |= 1UL << k;
+
+    arena_chunk_t *next = next_chunk(arena, chunk);
+    if (next != NULL) {
+        next->size |= CHUNK_PREV_FREE;
+        next->prev_size = size;
+    }
+}
+
+/**
+ * @brief Private helper function taking a free chunk off its list.
+ * @param[in] arena pointer to the arena.
+ * @param[in] chunk free chunk.
+ *
+ * The chunk's flags are left as they are.
+ */
+static void remove_free(arena_t *arena, arena_chunk_t *chunk) {
+    unsigned int k = size_class(chunk_size(chunk));
+    if (chunk->prev != NULL) {
+        chunk->prev->next = chunk->next;
+    } else if ((arena->free_lists[k] = chunk->next) == NULL) {
+        arena->classes &= ~(1UL << k);
+    }
+    if (chunk->next != NULL) {
+        chunk->next->prev = chunk->prev;
+    }
+}
+
+/**
+ * @brief Initializes an arena over a region of memory.
+ * @param[in] arena pointer to the arena to be initialized.
+ * @param[in] start start of the region, aligned to ARENA_ALIGN.
+ * @param[in] size bytes in the region.
+ *
+ * Also used to wipe an arena, forgetting every allocation in it.
+ */
+void init_arena(arena_t *arena, void *start, size_t size) {
+    arena->start = start;
+    arena->size = size & ~(size_t)(ARENA_ALIGN - 1);
+    arena->used = 0;
+    arena->classes = 0;
+    for (int k = 0; k < ARENA_CLASSES; k++) {
+        arena->free_lists[k] = NULL;
+    }
+    arena_chunk_t *chunk = (arena_chunk_t *)arena->start;
+    chunk->size = 0;
+    insert_free(arena, chunk, arena->size);
+}
+
+/**
+ * @brief Allocates from a free chunk large enough.
+ * @param[in] arena pointer to the arena.
+ * @param[in] size bytes needed.
+ *
+ * The first chunk that fits in the list of its own size is taken, or else
+ * the first chunk of the next list with any. The rest of the chunk stays
+ * free, unless it is too small to be useful.
+ */
+void *arena_alloc(arena_t *arena, size_t size) {
+    size_t need = (CHUNK_HEADER + size + ARENA_ALIGN - 1) &
+                  ~(size_t)(ARENA_ALIGN - 1);
+    need = need < CHUNK_MIN ? CHUNK_MIN : need;
+    unsigned int k = size_class(need);
+
+    arena_chunk_t *chunk = arena->free_lists[k];
+    while (chunk != NULL && chunk_size(chunk) < need) {
+        chunk = chunk->next;
+    }
+    if (chunk == NULL) {
+        unsigned long larger = k + 1 < ARENA_CLASSES
+                                   ? arena->classes & (~0UL << (k + 1))
+                                   : 0;
+        if (larger == 0) {
+            return NULL;
+        }
+        chunk = arena->free_lists[__builtin_ctzl(larger)];
+    }
+    remove_free(arena, chunk);
+
+    size_t have = chunk_size(chunk);
+    if (have - need >= CHUNK_MIN) {
+        arena_chunk_t *rest = (arena_chunk_t *)((char *)chunk + need);
+        rest->size = 0;
+        insert_free(arena, rest, have - need);
+        have = need;
+    } else {
+        arena_chunk_t *next = next_chunk(arena, chunk);
+        if (next != NULL) {
+            next->size &= ~CHUNK_PREV_FREE;
+        }
+    }
+    chunk->size = have | (chunk->size & CHUNK_PREV_FREE);
+    arena->used += have;
+    return (char *)chunk + CHUNK_HEADER;
+}
+
+/**
+ * @brief Frees memory allocated from the arena.
+ * @param[in] arena pointer to the arena.
+ * @param[in] ptr pointer returned by arena_alloc.
+ *
+ */
+void arena_free(arena_t *arena, void *ptr) {
+    arena_chunk_t *chunk = (arena_chunk_t *)((char *)ptr - CHUNK_HEADER);
+    size_t size = chunk_size(chunk);
+    arena->used -= size;
+
+    // merge with the free neighbours
+    arena_chunk_t *next = next_chunk(arena, chunk);
+    if (next != NULL && (next->size & CHUNK_FREE)) {
+        remove_free(arena, next);
+        size += chunk_size(next);
+    }
+    if (chunk->size & CHUNK_PREV_FREE) {
+        chunk = (arena_chunk_t *)((char *)chunk - chunk->prev_size);
+        remove_free(arena, chunk);
+        size += chunk_size(chunk);
+    }
+    insert_free(arena, chunk, size);
+}
+
+/**
+ * @brief Returns the largest size arena_alloc could allocate right now.
+ * @param[in] arena pointer to the arena.
+ *
+ * Only the list of the largest chunks is walked.
+ */
+size_t arena_largest(arena_t *arena) {
+    if (arena->classes == 0) {
+        return 0;
+    }
+    size_t largest = 0;
+    unsigned int k = sizeof(unsigned long) * 8 - 1 -
+                     __builtin_clzl(arena->classes);
+    for (arena_chunk_t *chunk = arena->free_lists[k]; chunk != NULL;
+         chunk = chunk->next) {
+        largest = chunk_size(chunk) > largest ? chunk_size(chunk) : largest;
+    }
+    return largest - CHUNK_HEADER;
+}
@@ -0,0 +1,56 @@
+/**
+ * @file proxy_arena.h
+ * @brief Prototypes and definitions for proxy_arena.c
+ *
+ * A segregated-fit allocator over a fixed region of memory, so that the cache
+ * can keep its blocks in a mapping of its own, including one shared by
+ * pre-forked worker processes. The arena keeps no lock; its owner must
+ * serialize calls.
+ *
+ * @author Taiming Liu <taimingl@andrew.cmu.edu>
+ */
+#ifndef PROXY_ARENA_H
+#define PROXY_ARENA_H
+
+#include <stddef.h> /* size_t */
+
+/*
+ * Free lists, one for the chunks of each power of two in size; enough for
+ * any arena addressable
+ */
+#define ARENA_CLASSES 64
+
+/*
+ * Header in front of every chunk, allocated or free. Only size and
+ * prev_size make the header of an allocated chunk; its payload starts at
+ * next. The low bits of size are flags, see proxy_arena.c.
+ */
+typedef struct arena_chunk {
+    size_t size;              /* bytes in the chunk, header included */
+    size_t prev_size;         /* bytes in the chunk before, if that is free */
+    struct arena_chunk *next; /* next free chunk of its class, when free */
+    struct arena_chunk *prev; /* previous free chunk of its class */
+} arena_chunk_t;
+
+/* A region of memory and the free chunks in it */
+typedef struct arena {
+    char *start;
+    size_t size;
+    size_t used;              /* bytes in allocated chunks */
+    unsigned long classes;    /* bit k set if free_lists[k] has chunks */
+    arena_chunk_t *free_lists[ARENA_CLASSES]; /* free chunks by size */
+} arena_t;
+
+/* Makes all of [start, start + size) one free chunk */
+void init_arena(arena_t *arena, void *start, size_t size);
+
+/* Returns size bytes from the arena, or NULL if no free chunk fits */
+void *arena_alloc(arena_t *arena, size_t size);
+
+/* Returns memory from arena_alloc to the arena */
+void arena_free(arena_t *arena, void *ptr);
+
+/* Returns the largest size arena_alloc could allocate right now */
+size_t arena_largest(arena_t *arena);
+
+#endif /* PROXY_ARENA_H */
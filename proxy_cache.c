@@ -2,58 +2,796 @@
  * @file proxy_cache.c
  * @brief functions for the proxy server
  *
+ * Lookups run without a lock. A reader announces the epoch it starts in
+ * and walks the hash index; writers unlink blocks under the mutex, but a
+ * block is only freed once every reader that might have seen it is done.
+ * Instead of moving a block to the front of the ring, a hit only sets the
+ * block's reference bit and, if it was clear, pushes the block on a stack;
+ * the next writer moves the blocks on it to the front, in order of hits.
+ *
+ * A block holds only its key; the response is in a body of its own, which
+ * every key cached with the same bytes shares, as when several mirrors
+ * serve one file. Bodies are counted against the cache size once each.
+ *
+ * Optionally, each thread also keeps a small table of references to the
+ * blocks it hits most. A hit in the table reads the block without entering
+ * an epoch, so it writes no shared memory at all; instead the block's
+ * bucket's count of unlinks is checked before and after the copy, and a
+ * count that moved means the copy may be of freed memory and is dropped.
+ *
  * @author Taiming Liu <taimingl@andrew.cmu.edu>
  */
+#define _GNU_SOURCE /* memfd_create, MAP_FIXED_NOREPLACE, MFD_HUGETLB */
+
 #include "proxy_cache.h"
 #include "csapp.h"
+#include "proxy_probe.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/mempolicy.h> /* MPOL_PREFERRED */
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Offset of the arena in the cache's mapping, keeping it aligned */
+#define ARENA_OFFSET ((sizeof(cache_t) + 63) & ~(size_t)63)
+
+/* Bytes mapped for a cache, a whole number of huge pages */
+#define CACHE_MAP_SIZE                                                         \
+    ((ARENA_OFFSET + CACHE_ARENA_SIZE + CACHE_HUGE_PAGE - 1) &                 \
+     ~(size_t)(CACHE_HUGE_PAGE - 1))
+
+#ifndef MFD_HUGE_2MB
+#define MFD_HUGE_2MB (21U << 26) /* log2 of the page size, from linux/memfd.h */
+#endif
+
+/* Pages whose node report_cache asks for at a time */
+#define STATS_PAGES 64
+
+/* Caches a thread can hold reader slots in, one per listener at most */
+#define THREAD_READERS 4
+
+/* Reader slots of the calling thread, by cache */
+static __thread struct {
+    cache_t *cache;
+    cache_reader_t *slot;
+} thread_readers[THREAD_READERS];
+
+/* A thread's reference to a block it hits often */
+typedef struct hot_object {
+    cache_t *cache;        /* NULL when the entry is free */
+    const char *key;       /* in the block, as are the other pointers */
+    size_t key_size;
+    const char *value;
+    size_t size;
+    cache_id_t id;
+    unsigned long unlinks; /* count of the block's bucket when taken */
+    unsigned long resets;  /* resets of the cache when taken */
+    long long touched;     /* monotonic ns the block was last referenced */
+    unsigned int hits;     /* hits, halved every HOT_DECAY lookups */
+} hot_object_t;
+
+/* Lookups between halvings of the hot-object hit counts */
+#define HOT_DECAY 256
+
+/* Entries in each thread's hot-object table, 0 when tables are off */
+static unsigned int hot_objects;
+
+/* Hot-object table of the calling thread */
+static __thread hot_object_t hot_table[CACHE_HOT_MAX];
+static __thread unsigned int hot_lookups;
+
+/* Frees the slots of exiting threads */
+static pthread_key_t readers_key;
+static pthread_once_t readers_once = PTHREAD_ONCE_INIT;
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+/**
+ * @brief Private helper function hashing a key (MurmurHash3_x64_128).
+ *
+ * 128 bits make a collision between two URIs practically impossible, so
+ * that lookups compare the full key only to confirm a match.
+ */
+static cache_id_t hash_key(const char *key) {
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    size_t len = strlen(key);
+    uint64_t h1 = 0;
+    uint64_t h2 = 0;
+    size_t i = 0;
+    for (; i + 2 * sizeof(uint64_t) <= len; i += 2 * sizeof(uint64_t)) {
+        uint64_t k1, k2;
+        memcpy(&k1, key + i, sizeof(k1));
+        memcpy(&k2, key + i + sizeof(k1), sizeof(k2));
+        h1 ^= rotl64(k1 * c1, 31) * c2;
+        h1 = (rotl64(h1, 27) + h2) * 5 + 0x52dce729;
+        h2 ^= rotl64(k2 * c2, 33) * c1;
+        h2 = (rotl64(h2, 31) + h1) * 5 + 0x38495ab5;
+    }
+    size_t rest = len - i;
+    if (rest > sizeof(uint64_t)) {
+        uint64_t k2 = 0;
+        memcpy(&k2, key + i + sizeof(uint64_t), rest - sizeof(uint64_t));
+        h2 ^= rotl64(k2 * c2, 33) * c1;
+    }
+    if (rest > 0) {
+        uint64_t k1 = 0;
+        memcpy(&k1, key + i,
+               rest < sizeof(uint64_t) ? rest : sizeof(uint64_t));
+        h1 ^= rotl64(k1 * c1, 31) * c2;
+    }
+    h1 ^= len;
+    h2 ^= len;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+    return (cache_id_t){.lo = h1, .hi = h2};
+}
+
+/**
+ * @brief Private helper function comparing two key hashes.
+ */
+static bool same_id(cache_id_t a, cache_id_t b) {
+    return a.lo == b.lo && a.hi == b.hi;
+}
+
+/**
+ * @brief Private helper function hashing a response body (MurmurHash64A).
+ */
+static uint64_t hash_body(const char *data, size_t size) {
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    uint64_t hash = 0x9747b28cULL ^ (size * m);
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t)) {
+        uint64_t k;
+        memcpy(&k, data + i, sizeof(k));
+        k *= m;
+        k ^= k >> 47;
+        k *= m;
+        hash ^= k;
+        hash *= m;
+    }
+    if (i < size) {
+        uint64_t k = 0;
+        memcpy(&k, data + i, size - i);
+        hash ^= k;
+        hash *= m;
+    }
+    hash ^= hash >> 47;
+    hash *= m;
+    hash ^= hash >> 47;
+    return hash;
+}
+
+#ifdef CACHE_CLOCK
+/* A simulation keeps time of its own, see tools/cachesim.c */
+long long CACHE_CLOCK(void);
+#define now_ns CACHE_CLOCK
+#else
+/**
+ * @brief Private helper function returning the monotonic time in ns.
+ */
+static long long now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+#endif
+
+/**
+ * @brief Private helper function freeing the slot of a dead process.
+ * @param[in] reader slot to check.
+ *
+ * A worker process that died, or an old binary that exited after an
+ * upgrade, leaves its slots behind. Returns true if the slot's owner is
+ * gone, in which case the slot is free again.
+ */
+static bool reader_dead(cache_reader_t *reader) {
+    pid_t pid = __atomic_load_n(&reader->pid, __ATOMIC_ACQUIRE);
+    if (pid == 0) {
+        return true;
+    }
+    if (kill(pid, 0) == 0 || errno != ESRCH) {
+        return false;
+    }
+    // the next owner clears the epoch itself
+    __atomic_compare_exchange_n(&reader->pid, &pid, 0, false,
+                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    return true;
+}
+
+/**
+ * @brief Private helper function returning the oldest epoch a reader is in.
+ * @param[in] cache pointer to the cache.
+ * @param[in] before only readers in this epoch or before it matter.
+ *
+ * Returns ULONG_MAX if no reader is in an epoch up to before.
+ */
+static unsigned long oldest_reader(cache_t *cache, unsigned long before) {
+    unsigned long oldest = ULONG_MAX;
+    unsigned int n = __atomic_load_n(&cache->nreaders, __ATOMIC_ACQUIRE);
+    for (unsigned int i = 0; i < n; i++) {
+        cache_reader_t *reader = &cache->readers[i];
+        unsigned long epoch = __atomic_load_n(&reader->epoch, __ATOMIC_SEQ_CST);
+        if (epoch != 0 && epoch <= before && epoch < oldest &&
+            !reader_dead(reader)) {
+            oldest = epoch;
+        }
+    }
+    return oldest;
+}
+
+/**
+ * @brief Private helper function waiting until no reader can still see
+ * what was unlinked before the call.
+ * @param[in] cache pointer to the cache.
+ *
+ */
+static void synchronize_readers(cache_t *cache) {
+    unsigned long epoch =
+        __atomic_fetch_add(&cache->epoch, 1, __ATOMIC_SEQ_CST);
+    while (oldest_reader(cache, epoch) != ULONG_MAX) {
+        sched_yield();
+    }
+}
+
+/**
+ * @brief Private helper function releasing the slots of an exiting thread.
+ */
+static void release_readers(void *unused) {
+    for (int i = 0; i < THREAD_READERS; i++) {
+        cache_reader_t *reader = thread_readers[i].slot;
+        if (reader != NULL) {
+            __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+            __atomic_store_n(&reader->pid, 0, __ATOMIC_RELEASE);
+        }
+        thread_readers[i].cache = NULL;
+        thread_readers[i].slot = NULL;
+    }
+}
+
+static void make_readers_key(void) {
+    pthread_key_create(&readers_key, release_readers);
+}
+
+/**
+ * @brief Private helper function returning the calling thread's reader slot.
+ * @param[in] cache pointer to the cache.
+ *
+ * A thread claims a slot on its first lookup and keeps it until it exits.
+ * Returns NULL if no slot is to be had.
+ */
+static cache_reader_t *get_reader(cache_t *cache) {
+    int free_entry = -1;
+    for (int i = 0; i < THREAD_READERS; i++) {
+        if (thread_readers[i].cache == cache) {
+            return thread_readers[i].slot;
+        }
+        if (thread_readers[i].cache == NULL && free_entry < 0) {
+            free_entry = i;
+        }
+    }
+    if (free_entry < 0) {
+        return NULL;
+    }
+
+    // look for a free slot first, and only then for one of a dead process
+    pid_t self = getpid();
+    for (unsigned int i = 0; i < 2 * CACHE_READERS; i++) {
+        cache_reader_t *reader = &cache->readers[i % CACHE_READERS];
+        pid_t pid = 0;
+        bool taken = i < CACHE_READERS
+                         ? __atomic_load_n(&reader->pid, __ATOMIC_RELAXED) != 0
+                         : !reader_dead(reader);
+        if (taken ||
+            !__atomic_compare_exchange_n(&reader->pid, &pid, self, false,
+                                         __ATOMIC_ACQ_REL,
+                                         __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+        unsigned int slot = i % CACHE_READERS;
+        unsigned int n = __atomic_load_n(&cache->nreaders, __ATOMIC_ACQUIRE);
+        while (n <= slot && !__atomic_compare_exchange_n(
+                                &cache->nreaders, &n, slot + 1, false,
+                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        }
 
-/* Global lock to synchronize shared resource */
-static pthread_mutex_t mutex;
+        pthread_once(&readers_once, make_readers_key);
+        pthread_setspecific(readers_key, thread_readers);
+        thread_readers[free_entry].cache = cache;
+        thread_readers[free_entry].slot = reader;
+        return reader;
+    }
+    return NULL;
+}
 
 /**
- * @brief Initializes cache structure for web server to use.
- * @param[in] cache pointer to the cache struct to be initialized.
+ * @brief Private helper function emptying the cache and its arena.
+ * @param[in] cache pointer to the cache.
  *
+ * Readers may be in the middle of a lookup, and inserters in the middle
+ * of filling a block in, so the arena is only wiped once they have left
+ * it; those of dead processes are not waited for.
  */
-void init_cache(cache_t *cache) {
+static void reset_cache(cache_t *cache) {
     cache->cache_size = 0;
-    cache->head = NULL;
+    cache->nblocks = 0;
+    __atomic_store_n(&cache->head, NULL, __ATOMIC_RELEASE);
     cache->tail = NULL;
-    pthread_mutex_init(&mutex, NULL);
+    cache->retired = NULL;
+    cache->evict_pending = false;
+    for (size_t i = 0; i < CACHE_BUCKETS; i++) {
+        __atomic_store_n(&cache->buckets[i], NULL, __ATOMIC_RELEASE);
+        cache->bodies[i] = NULL;
+    }
+    synchronize_readers(cache);
+    // only now, as readers in the middle of a hit may still push on it
+    cache->touched = NULL;
+    init_arena(&cache->arena, (char *)cache + ARENA_OFFSET,
+               CACHE_ARENA_RATIO * cache->capacity);
+}
+
+/**
+ * @brief Private helper function mapping a memfd at a huge page boundary.
+ * @param[in] fd memfd to size and map, closed on failure.
+ * @param[in] size bytes to map.
+ *
+ * Huge pages, explicit or transparent, only back huge page aligned parts
+ * of a mapping, so a span with room to align in is reserved first, and
+ * the memfd mapped over it. Returns MAP_FAILED on failure.
+ */
+static cache_t *map_cache(int fd, size_t size) {
+    if (fd < 0) {
+        return MAP_FAILED;
+    }
+    size_t span_size = size + CACHE_HUGE_PAGE;
+    char *span = mmap(NULL, span_size, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (span == MAP_FAILED || ftruncate(fd, size) != 0) {
+        if (span != MAP_FAILED) {
+            munmap(span, span_size);
+        }
+        close(fd);
+        return MAP_FAILED;
+    }
+    char *addr = (char *)(((uintptr_t)span + CACHE_HUGE_PAGE - 1) &
+                          ~(uintptr_t)(CACHE_HUGE_PAGE - 1));
+    cache_t *cache = mmap(addr, size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_FIXED, fd, 0);
+    if (cache == MAP_FAILED) {
+        munmap(span, span_size);
+        close(fd);
+        return MAP_FAILED;
+    }
+    // give back the parts of the span outside the mapping
+    if (addr > span) {
+        munmap(span, addr - span);
+    }
+    if (addr + size < span + span_size) {
+        munmap(addr + size, span + span_size - (addr + size));
+    }
+    return cache;
+}
+
+/**
+ * @brief Maps and initializes a cache for web server to use.
+ * @param[in] node NUMA node to keep the cache's memory on, or -1.
+ *
+ * The cache lives in a memfd so that it outlives an upgrade: the fd is
+ * passed to the new binary, which maps it again with attach_cache. The
+ * lock is robust and process-shared, so that a worker dying while holding
+ * it cannot wedge the others (see lock_cache).
+ *
+ * Hits copy whole objects out of the arena, so it is backed by huge pages
+ * to spare the TLB: explicit ones if any are reserved, otherwise the
+ * kernel is asked for transparent ones, which it may or may not provide.
+ * The memory is bound to the node, before any of it is touched, so that
+ * the threads of that node serving from the cache read local memory.
+ * Returns NULL if the memory could not be mapped.
+ */
+cache_t *new_cache(int node) {
+    size_t map_size = CACHE_MAP_SIZE;
+    size_t page_size = CACHE_HUGE_PAGE;
+    bool thp = false;
+    int fd =
+        memfd_create("proxy-cache", MFD_CLOEXEC | MFD_HUGETLB | MFD_HUGE_2MB);
+    cache_t *cache = map_cache(fd, map_size);
+    if (cache == MAP_FAILED) {
+        page_size = (size_t)sysconf(_SC_PAGESIZE);
+        fd = memfd_create("proxy-cache", MFD_CLOEXEC);
+        cache = map_cache(fd, map_size);
+        if (cache == MAP_FAILED) {
+            return NULL;
+        }
+        thp = madvise(cache, map_size, MADV_HUGEPAGE) == 0;
+    }
+    if (node >= 0 && node < CACHE_MAX_NODES) {
+        // a policy on a shared mapping applies to the memfd itself
+        unsigned long nodes = 1UL << node;
+        if (syscall(SYS_mbind, cache, map_size, MPOL_PREFERRED, &nodes,
+                    CACHE_MAX_NODES, 0) != 0) {
+            node = -1; // no NUMA support, the memory goes anywhere
+        }
+    } else {
+        node = -1;
+    }
+
+    cache->magic = CACHE_MAGIC;
+    cache->version = CACHE_VERSION;
+    cache->addr = cache;
+    cache->fd = fd;
+    cache->map_size = map_size;
+    cache->page_size = page_size;
+    cache->thp = thp;
+    cache->node = node;
+    cache->resets = 0;
+    cache->capacity = MAX_CACHE_SIZE;
+    cache->epoch = 1; // 0 marks a reader outside any epoch
+    reset_cache(cache);
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&cache->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(&cache->evict, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+    cache->evict_pending = false;
+    return cache;
+}
+
+/**
+ * @brief Maps a cache handed over by the binary this one replaced.
+ * @param[in] fd memfd of the cache, inherited across exec.
+ *
+ * The old process keeps serving from the cache until it has drained, so
+ * the lock and blocks are used as they are. The cache must map at its old
+ * address, where its pointers point; if that is taken, or the layout is
+ * from another version, returns NULL and the caller starts afresh.
+ */
+cache_t *attach_cache(int fd) {
+    cache_t header;
+    if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        header.magic != CACHE_MAGIC || header.version != CACHE_VERSION ||
+        header.fd != fd || header.map_size != CACHE_MAP_SIZE) {
+        return NULL;
+    }
+    cache_t *cache =
+        mmap(header.addr, header.map_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+    if (cache == MAP_FAILED) {
+        return NULL;
+    }
+    if (cache != header.addr) {
+        // kernels before 4.17 take the address as a mere hint
+        munmap(cache, header.map_size);
+        return NULL;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return cache;
+}
+
+/**
+ * @brief Private helper function wiping the cache after its lock was
+ * taken over from a dead owner.
+ * @param[in] cache pointer to the cache.
+ *
+ */
+static void recover_cache(cache_t *cache) {
+    // before the wipe, so that hot-object tables drop what it frees
+    __atomic_store_n(&cache->resets, cache->resets + 1, __ATOMIC_RELEASE);
+    reset_cache(cache);
+    pthread_mutex_consistent(&cache->mutex);
+    fprintf(stderr, "Cache wiped: a worker died while updating it\n");
+}
+
+/**
+ * @brief Private helper function to take the cache lock.
+ * @param[in] cache pointer to the cache.
+ *
+ * If the previous owner died with the lock held, it may have been halfway
+ * through changing the index, the ring or the arena. Nothing in the cache
+ * can be trusted then, so it is wiped; the next requests simply miss.
+ * Time spent waiting for the lock goes to the HIST_CACHE_LOCK histogram.
+ */
+static void lock_cache(cache_t *cache) {
+    int rc = pthread_mutex_trylock(&cache->mutex);
+    if (rc == EBUSY) {
+        long long start = now_ns();
+        rc = pthread_mutex_lock(&cache->mutex);
+        stats_time(HIST_CACHE_LOCK, now_ns() - start);
+    }
+    if (rc == EOWNERDEAD) {
+        recover_cache(cache);
+    }
+}
+
+/**
+ * @brief Private helper function finding a block, for writers.
+ * @param[in] cache pointer to the cache, locked.
+ * @param[in] id hash of key.
+ * @param[in] key key of the block.
+ *
+ */
+static cache_block_t *find_block(cache_t *cache, cache_id_t id,
+                                 const char *key) {
+    cache_block_t *cb = cache->buckets[id.lo % CACHE_BUCKETS];
+    while (cb != NULL && (!same_id(cb->id, id) || strcmp(cb->key, key))) {
+        cb = cb->hnext;
+    }
+    return cb;
+}
+
+/**
+ * @brief Private helper function finding a body by its bytes.
+ * @param[in] cache pointer to the cache, locked.
+ * @param[in] hash hash of the bytes.
+ * @param[in] value the bytes.
+ * @param[in] size bytes in value.
+ *
+ * Bodies are compared byte by byte, so a hash collision costs a memcmp
+ * but never serves one response for another.
+ */
+static cache_body_t *find_body(cache_t *cache, uint64_t hash,
+                               const char *value, size_t size) {
+    cache_body_t *body = cache->bodies[hash % CACHE_BUCKETS];
+    while (body != NULL && (body->hash != hash || body->size != size ||
+                            memcmp(body + 1, value, size))) {
+        body = body->bnext;
+    }
+    return body;
+}
+
+/**
+ * @brief Private helper function dropping a reference to a body.
+ * @param[in] cache pointer to the cache, locked.
+ * @param[in] body body to drop, freed when no block refers to it any more.
+ *
+ */
+static void drop_body(cache_t *cache, cache_body_t *body) {
+    if (--body->refs > 0) {
+        return;
+    }
+    cache_body_t **link = &cache->bodies[body->hash % CACHE_BUCKETS];
+    while (*link != NULL && *link != body) {
+        link = &(*link)->bnext;
+    }
+    if (*link != NULL) { // a body being filled in is in no bucket yet
+        *link = body->bnext;
+    }
+    arena_free(&cache->arena, body);
 }
 
 /**
  * @brief Private helper function to remove one cache block from cache.
  * @param[in] cache pointer to the cache.
- * @param[in] cache_block cache block to be removed
+ * @param[in] curr_cb cache block to be removed
  *
+ * The block leaves the index and the ring, but its own links are left as
+ * they are for readers still on it; it is freed by reclaim_blocks later.
  */
 static void evict_one_cb(cache_t *cache, cache_block_t *curr_cb) {
-    cache->cache_size -= curr_cb->block_size;
-    if (cache->head == cache->tail) { // empty cache
-        cache->head = NULL;
-        cache->tail = NULL;
-    } else if (curr_cb == cache->head) { // removing head
-        cache->head = curr_cb->next;
-        curr_cb->next->prev = NULL;
-    } else if (curr_cb == cache->tail) { // removing tail
+    cache_block_t **link = &cache->buckets[curr_cb->id.lo % CACHE_BUCKETS];
+    while (*link != curr_cb) {
+        link = &(*link)->hnext;
+    }
+    __atomic_store_n(link, curr_cb->hnext, __ATOMIC_RELEASE);
+    // after the unlink, so that a lookup seeing the new count misses
+    unsigned long *unlinks = &cache->unlinks[curr_cb->id.lo % CACHE_BUCKETS];
+    __atomic_store_n(unlinks, *unlinks + 1, __ATOMIC_RELEASE);
+
+    if (curr_cb == cache->head) { // removing head
+        __atomic_store_n(&cache->head, curr_cb->next, __ATOMIC_RELEASE);
+    } else {
+        __atomic_store_n(&curr_cb->prev->next, curr_cb->next,
+                         __ATOMIC_RELEASE);
+    }
+    if (curr_cb == cache->tail) { // removing tail
         cache->tail = curr_cb->prev;
-        curr_cb->prev->next = NULL;
-    } else { // a block in the middle
-        curr_cb->prev->next = curr_cb->next;
+    } else {
         curr_cb->next->prev = curr_cb->prev;
     }
-    if (curr_cb->key) {
-        Free(curr_cb->key);
+    if (--curr_cb->body->linked == 0) { // no other key shares the body
+        cache->cache_size -= curr_cb->block_size;
+    }
+    cache->nblocks--;
+    cache->evictions++;
+    PROBE2(cache_evict, curr_cb->key, curr_cb->block_size);
+
+    curr_cb->retired = __atomic_fetch_add(&cache->epoch, 1, __ATOMIC_SEQ_CST);
+    curr_cb->rnext = cache->retired;
+    cache->retired = curr_cb;
+}
+
+/**
+ * @brief Private helper function moving a block of the ring to its head.
+ * @param[in] cache pointer to the cache, locked.
+ * @param[in] cb block to move, linked in.
+ *
+ */
+static void requeue_block(cache_t *cache, cache_block_t *cb) {
+    if (cb == cache->head) {
+        return;
+    }
+    __atomic_store_n(&cb->prev->next, cb->next, __ATOMIC_RELEASE);
+    if (cb == cache->tail) {
+        cache->tail = cb->prev;
+    } else {
+        cb->next->prev = cb->prev;
+    }
+    cb->prev = NULL;
+    cb->next = cache->head;
+    cache->head->prev = cb;
+    __atomic_store_n(&cache->head, cb, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Private helper function moving the blocks hit since the last
+ * write to the head of the ring.
+ * @param[in] cache pointer to the cache, locked.
+ *
+ * The stack holds the latest hit first, so it is turned around to move the
+ * latest hit last. Blocks unlinked since their hit are left out; they are
+ * not freed before this, see reclaim_blocks. Each block is on the stack at
+ * most once, for its first hit since it was last moved.
+ */
+static void requeue_touched(cache_t *cache) {
+    cache_block_t *cb = __atomic_exchange_n(&cache->touched, NULL,
+                                            __ATOMIC_ACQUIRE);
+    cache_block_t *oldest = NULL;
+    while (cb != NULL) {
+        cache_block_t *tnext = cb->tnext;
+        cb->tnext = oldest;
+        oldest = cb;
+        cb = tnext;
+    }
+    for (cb = oldest; cb != NULL;) {
+        cache_block_t *tnext = cb->tnext;
+        // cleared before the move, so that a hit meanwhile is not lost
+        __atomic_store_n(&cb->referenced, false, __ATOMIC_RELAXED);
+        if (cb->retired == 0) {
+            requeue_block(cache, cb);
+        }
+        cb = tnext;
+    }
+}
+
+/**
+ * @brief Private helper function freeing the unlinked blocks no reader can
+ * see any more.
+ * @param[in] cache pointer to the cache.
+ *
+ */
+static void reclaim_blocks(cache_t *cache) {
+    // blocks readers pushed before leaving their epoch must be off the stack
+    requeue_touched(cache);
+    unsigned long newest = 0;
+    for (cache_block_t *cb = cache->retired; cb != NULL; cb = cb->rnext) {
+        newest = cb->retired > newest ? cb->retired : newest;
+    }
+    // a reader in epoch e may hold blocks unlinked in e or later
+    unsigned long oldest = oldest_reader(cache, newest);
+    cache_block_t **link = &cache->retired;
+    while (*link != NULL) {
+        cache_block_t *cb = *link;
+        if (cb->retired < oldest) {
+            *link = cb->rnext;
+            drop_body(cache, cb->body);
+            arena_free(&cache->arena, cb);
+        } else {
+            link = &cb->rnext;
+        }
+    }
+}
+
+/**
+ * @brief Private helper function evicting the block used longest ago,
+ * roughly.
+ * @param[in] cache pointer to the cache, not empty.
+ *
+ * Blocks hit since the last write first go to the head of the ring, then
+ * the tail is evicted; both take O(1) per block. Blocks hit more than once
+ * between two writes are placed by their first hit, which is where this
+ * falls short of LRU.
+ */
+static void evict_lru(cache_t *cache) {
+    requeue_touched(cache);
+    evict_one_cb(cache, cache->tail);
+}
+
+/**
+ * @brief Private helper function telling if the arena is filled past a mark,
+ * or too fragmented to take any block.
+ * @param[in] cache pointer to the cache, locked.
+ * @param[in] percent watermark, in percent of the arena.
+ *
+ */
+static bool above_water(cache_t *cache, size_t percent) {
+    return cache->arena.used > cache->arena.size / 100 * percent ||
+           arena_largest(&cache->arena) < CACHE_ROOM;
+}
+
+/**
+ * @brief Private helper function running the evictor of a cache.
+ * @param[in] vargp pointer to the cache.
+ *
+ * Woken by inserts once the arena passes the high mark, it frees what
+ * readers have let go of. Readers are waited for with the lock dropped,
+ * so that inserts go on meanwhile. Only if the arena is still above the
+ * low mark with nothing left to free, as with many small blocks whose
+ * headers and keys outweigh their values, or too fragmented, does it
+ * evict blocks.
+ * Every process serving from a cache runs one; whichever is woken works.
+ */
+static void *evictor(void *vargp) {
+    cache_t *cache = (cache_t *)vargp;
+    pthread_detach(pthread_self());
+
+    lock_cache(cache);
+    while (1) {
+        while (!cache->evict_pending) {
+            if (pthread_cond_wait(&cache->evict, &cache->mutex) ==
+                EOWNERDEAD) {
+                recover_cache(cache);
+            }
+        }
+        cache->evict_pending = false;
+        while (above_water(cache, CACHE_LOW_WATER)) {
+            if (cache->retired == NULL) {
+                if (cache->tail == NULL) {
+                    break;
+                }
+                evict_lru(cache);
+            }
+            pthread_mutex_unlock(&cache->mutex);
+            synchronize_readers(cache);
+            lock_cache(cache);
+            reclaim_blocks(cache);
+        }
     }
-    if (curr_cb->value) {
-        Free(curr_cb->value);
+    return NULL;
+}
+
+/**
+ * @brief Starts the evictor of a cache in the calling process.
+ * @param[in] cache pointer to the cache.
+ *
+ */
+void start_evictor(cache_t *cache) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, evictor, cache) != 0) {
+        // inserts then free what they need themselves
+        perror("Error creating evictor thread");
     }
-    Free(curr_cb);
 }
 
 /**
@@ -62,127 +800,478 @@ static void evict_one_cb(cache_t *cache, cache_block_t *curr_cb) {
  *
  */
 void free_cache(cache_t *cache) {
-    pthread_mutex_lock(&mutex);
-    cache_block_t *prev = NULL;
-    cache_block_t *curr = cache->head;
-    while (curr) {
-        prev = curr;
-        curr = curr->next;
-        evict_one_cb(cache, prev);
+    // a new cache may be mapped at the same address, so the calling thread
+    // must not take its slot and hot objects here for ones there
+    for (int i = 0; i < THREAD_READERS; i++) {
+        if (thread_readers[i].cache == cache) {
+            thread_readers[i].cache = NULL;
+            thread_readers[i].slot = NULL;
+        }
     }
-    if (prev) {
-        evict_one_cb(cache, prev);
+    for (unsigned int i = 0; i < CACHE_HOT_MAX; i++) {
+        if (hot_table[i].cache == cache) {
+            hot_table[i].cache = NULL;
+        }
     }
-    Free(cache);
-    pthread_mutex_unlock(&mutex);
+
+    // the blocks live in the mapping, so unmapping it frees them all
+    int fd = cache->fd;
+    munmap(cache, cache->map_size);
+    close(fd);
+}
+
+/**
+ * @brief Empties a cache and sets the bytes it may hold.
+ * @param[in] cache pointer to the cache.
+ * @param[in] bytes capacity, kept between CACHE_MIN_SIZE and MAX_CACHE_SIZE.
+ *
+ * The arena shrinks with the capacity, so that the evictor keeps to the
+ * same watermarks as in a cache of MAX_CACHE_SIZE. Meant for a cache
+ * nothing is using yet, as in tools/cachesim; what it held is dropped.
+ */
+void set_cache_capacity(cache_t *cache, size_t bytes) {
+    if (bytes > MAX_CACHE_SIZE) {
+        bytes = MAX_CACHE_SIZE;
+    }
+    if (bytes < CACHE_MIN_SIZE) {
+        bytes = CACHE_MIN_SIZE;
+    }
+    lock_cache(cache);
+    // before the wipe, so that hot-object tables drop what it frees
+    __atomic_store_n(&cache->resets, cache->resets + 1, __ATOMIC_RELEASE);
+    cache->capacity = bytes;
+    reset_cache(cache);
+    pthread_mutex_unlock(&cache->mutex);
+}
+
+/**
+ * @brief Private helper function allocating from the arena.
+ * @param[in] cache pointer to the cache, locked.
+ * @param[in] size bytes needed.
+ *
+ * Evicted blocks are freed by the evictor, so the arena normally has
+ * room; if it does not, they are freed here, and more blocks evicted if
+ * need be. Returns NULL if size is more than the whole arena holds.
+ */
+static void *alloc_block(cache_t *cache, size_t size) {
+    void *ptr;
+    while ((ptr = arena_alloc(&cache->arena, size)) == NULL) {
+        // only when the evictor has fallen behind
+        if (cache->retired != NULL) {
+            // a reader stalled in a lookup pins everything unlinked since;
+            // evicting more would not help, so wait for it instead
+            synchronize_readers(cache);
+            reclaim_blocks(cache);
+        } else if (cache->tail != NULL) {
+            evict_lru(cache);
+        } else {
+            break;
+        }
+    }
+    return ptr;
+}
+
+/**
+ * @brief Private helper function returning how much linking a block to a
+ * body would add to the cache size.
+ * @param[in] body body of the block, or NULL for one yet to be made.
+ * @param[in] size bytes in the body.
+ *
+ */
+static size_t added_size(cache_body_t *body, size_t size) {
+    return body != NULL && body->linked > 0 ? 0 : size;
 }
 
 /**
- * @brief Insert a new block into cache with LRU eviction policy when not enough
- * space.
+ * @brief Insert a new block into cache with LRU eviction policy when not
+ * enough space.
  * @param[in] cache pointer to the cache.
  * @param[in] key string stored as key for the block
  * @param[in] value string stored as value for the block
  * @param[in] buff_size size of the block value
  *
- * LRU policy is enforced by removing the tail block from the cache, since newly
- * added blocks and most recently referenced blocks are moved to the front of
- * the cache.
+ * Nothing happens if the key is cached already, so that clients missing on
+ * the same URI at once leave a single copy behind. If the same bytes are
+ * cached under another key, the new block shares their body, and takes
+ * no room but its key. Otherwise blocks are evicted until the new body
+ * fits in the cache.
  */
 void insert_cache(cache_t *cache, char *key, char *value, size_t buff_size) {
-    pthread_mutex_lock(&mutex);
-    // evict from tail when full until with enough space
-    cache_block_t *cb_to_remove;
-    while (buff_size > (MAX_CACHE_SIZE - cache->cache_size)) {
-        cb_to_remove = cache->tail;
-        evict_one_cb(cache, cb_to_remove);
-    }
-
-    // create a cache block to be added
-    cache_block_t *cb_to_add = (cache_block_t *)Malloc(sizeof(cache_block_t));
-    char *cb_key = NULL;
-    char *cb_value = NULL;
-    cb_key = (char *)Malloc(strlen(key) + 1);
-    memcpy(cb_key, key, strlen(key) + 1);
-    cb_value = (char *)Malloc(buff_size);
-    memcpy(cb_value, value, buff_size);
-    cb_to_add->key = cb_key;
-    cb_to_add->value = cb_value;
-    cb_to_add->block_size = buff_size;
-    cb_to_add->next = NULL;
+    size_t key_size = strlen(key) + 1;
+    cache_id_t id = hash_key(key);
+    uint64_t body_hash = hash_body(value, buff_size);
+
+    lock_cache(cache);
+    if (find_block(cache, id, key) != NULL) {
+        pthread_mutex_unlock(&cache->mutex);
+        return;
+    }
+    cache_body_t *body = find_body(cache, body_hash, value, buff_size);
+    if (body != NULL) {
+        body->refs++; // so that evicting below cannot free it
+    }
+    // evict when full until with enough space
+    while (added_size(body, buff_size) > cache->capacity - cache->cache_size) {
+        evict_lru(cache);
+    }
+    cache_block_t *cb_to_add =
+        alloc_block(cache, sizeof(cache_block_t) + key_size);
+    bool new_body = false;
+    if (cb_to_add != NULL && body == NULL) {
+        body = alloc_block(cache, sizeof(cache_body_t) + buff_size);
+        if (body == NULL) {
+            arena_free(&cache->arena, cb_to_add);
+            cb_to_add = NULL;
+        } else {
+            body->refs = 1;
+            body->linked = 0;
+            new_body = true;
+        }
+    }
+    if (cb_to_add == NULL && body != NULL) {
+        drop_body(cache, body);
+    }
+    if (above_water(cache, CACHE_HIGH_WATER) && !cache->evict_pending) {
+        // every process's evictor waits here, and a dead one must not
+        // swallow the wake-up
+        cache->evict_pending = true;
+        pthread_cond_broadcast(&cache->evict);
+    }
+    unsigned long resets = cache->resets;
+    if (cb_to_add == NULL) {
+        pthread_mutex_unlock(&cache->mutex);
+        return; // larger than the whole arena
+    }
+
+    // fill the block in outside the lock, so that readers are not held up
+    // by the copy; nobody else can reach it until it is linked in. The
+    // copy is made in an epoch, like a lookup, so that a wipe meanwhile
+    // waits for it before the arena is reused; without a reader slot it
+    // is made under the lock instead
+    cache_reader_t *reader = get_reader(cache);
+    if (reader != NULL) {
+        __atomic_store_n(&reader->epoch,
+                         __atomic_load_n(&cache->epoch, __ATOMIC_SEQ_CST),
+                         __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&cache->mutex);
+    }
+    if (new_body) {
+        body->hash = body_hash;
+        body->size = buff_size;
+        memcpy(body + 1, value, buff_size);
+    }
+    cb_to_add->key = (char *)(cb_to_add + 1);
+    memcpy(cb_to_add->key, key, key_size);
+    cb_to_add->id = id;
     cb_to_add->prev = NULL;
 
-    /* add the new block as the head of cache */
-    if (cache->cache_size == 0) { // when cache is still empty
-        cache->head = cb_to_add;
-        cache->tail = cb_to_add;
-    } else {
-        cb_to_add->next = cache->head;
+    if (reader != NULL) {
+        __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+        lock_cache(cache);
+    }
+    if (cache->resets != resets) {
+        // the cache was wiped meanwhile, and the block with it
+        pthread_mutex_unlock(&cache->mutex);
+        return;
+    }
+    if (find_block(cache, id, key) != NULL) {
+        // another client cached the same response meanwhile
+        drop_body(cache, body);
+        arena_free(&cache->arena, cb_to_add);
+        pthread_mutex_unlock(&cache->mutex);
+        return;
+    }
+    if (new_body) {
+        // the same bytes may have been cached under another key meanwhile
+        cache_body_t *other = find_body(cache, body_hash, value, buff_size);
+        if (other != NULL) {
+            other->refs++;
+            drop_body(cache, body);
+            body = other;
+        } else {
+            cache_body_t **bucket = &cache->bodies[body_hash % CACHE_BUCKETS];
+            body->bnext = *bucket;
+            *bucket = body;
+        }
+    }
+    cb_to_add->body = body;
+    cb_to_add->value = (char *)(body + 1);
+    cb_to_add->block_size = body->size;
+    // evict again in case other blocks were added meanwhile
+    while (added_size(body, buff_size) > cache->capacity - cache->cache_size) {
+        evict_lru(cache);
+    }
+
+    /* publish the new block as the head of the ring and of its bucket */
+    // after the blocks hit before it, so that the ring is in order of use
+    requeue_touched(cache);
+    cb_to_add->referenced = false;
+    cb_to_add->retired = 0;
+    cache_block_t **bucket = &cache->buckets[id.lo % CACHE_BUCKETS];
+    cb_to_add->hnext = *bucket;
+    cb_to_add->next = cache->head;
+    if (cache->head != NULL) {
         cache->head->prev = cb_to_add;
-        cache->head = cb_to_add;
+    } else { // when cache is still empty
+        cache->tail = cb_to_add;
+    }
+    __atomic_store_n(&cache->head, cb_to_add, __ATOMIC_RELEASE);
+    __atomic_store_n(bucket, cb_to_add, __ATOMIC_RELEASE);
+    if (body->linked++ == 0) {
+        cache->cache_size += body->size;
     }
-    cache->cache_size += cb_to_add->block_size;
-    pthread_mutex_unlock(&mutex);
+    cache->nblocks++;
+    PROBE3(cache_insert, key, buff_size, body->linked > 1);
+    pthread_mutex_unlock(&cache->mutex);
 }
 
 /**
- * @brief Private helper function to move the current block to the front.
+ * @brief Reports the occupancy, evictions and placement of a cache.
  * @param[in] cache pointer to the cache.
- * @param[in] curr_cb cache block to be moved
+ * @param[in] index number to tell the cache apart by in the output.
+ * @param[in] out where the report goes.
  *
+ * Reads the counts without the lock, so they may be a little apart from
+ * each other. Counts the cache's pages on each node, of those touched so
+ * far, so that remote memory shows. Safe to call from a signal handler
+ * when writing to a file descriptor.
  */
-static void move_to_front(cache_t *cache, cache_block_t *curr_cb) {
-    if (curr_cb != cache->head) {
-        if (curr_cb == cache->tail) {
-            curr_cb->prev->next = NULL;
-            cache->tail = curr_cb->prev;
-        } else {
-            curr_cb->prev->next = curr_cb->next;
-            curr_cb->next->prev = curr_cb->prev;
+void report_cache(cache_t *cache, int index, stats_out_t *out) {
+    stats_printf(out, "cache%d_bytes %zu\n", index,
+                 __atomic_load_n(&cache->cache_size, __ATOMIC_RELAXED));
+    stats_printf(out, "cache%d_bytes_max %zu\n", index, cache->capacity);
+    stats_printf(out, "cache%d_blocks %lu\n", index,
+                 __atomic_load_n(&cache->nblocks, __ATOMIC_RELAXED));
+    stats_printf(out, "cache%d_evictions %lu\n", index,
+                 __atomic_load_n(&cache->evictions, __ATOMIC_RELAXED));
+    stats_printf(out, "cache%d_arena_used %zu\n", index,
+                 __atomic_load_n(&cache->arena.used, __ATOMIC_RELAXED));
+    stats_printf(out, "cache%d_page_size %zu\n", index, cache->page_size);
+    stats_printf(out, "cache%d_thp_advised %d\n", index, cache->thp ? 1 : 0);
+    stats_printf(out, "cache%d_node %d\n", index, cache->node);
+
+    unsigned long on_node[CACHE_MAX_NODES] = {0};
+    size_t npages = cache->map_size / cache->page_size;
+    for (size_t first = 0; first < npages; first += STATS_PAGES) {
+        void *pages[STATS_PAGES];
+        int status[STATS_PAGES];
+        size_t n = npages - first < STATS_PAGES ? npages - first : STATS_PAGES;
+        for (size_t i = 0; i < n; i++) {
+            pages[i] = (char *)cache + (first + i) * cache->page_size;
+        }
+        // with no target nodes, move_pages only reports where pages are
+        if (syscall(SYS_move_pages, 0, n, pages, NULL, status, 0) != 0) {
+            return;
+        }
+        for (size_t i = 0; i < n; i++) {
+            if (status[i] >= 0 && status[i] < CACHE_MAX_NODES) {
+                on_node[status[i]]++;
+            }
+        }
+    }
+    for (int node = 0; node < CACHE_MAX_NODES; node++) {
+        if (on_node[node] > 0) {
+            stats_printf(out, "cache%d_pages_node%d %lu\n", index, node,
+                         on_node[node]);
+        }
+    }
+}
+
+/**
+ * @brief Keeps references to up to n hot objects in each thread.
+ * @param[in] n entries in each thread's table, 0 to keep none.
+ *
+ * Call before any lookups, while the process has a single thread.
+ */
+void set_hot_objects(unsigned int n) {
+    hot_objects = n < CACHE_HOT_MAX ? n : CACHE_HOT_MAX;
+}
+
+/**
+ * @brief Private helper function looking a key up in the calling thread's
+ * hot-object table.
+ * @param[in] cache pointer to the cache.
+ * @param[in] id hash of key.
+ * @param[in] key key to look up.
+ * @param[in] value buffer to copy the value to.
+ *
+ * Only reads the cache: the block may be freed and its memory reused
+ * while it is copied, so the copy counts only if the bucket's unlinks and
+ * the cache's resets are the same after it as when the entry was taken.
+ * Returns 0 on a miss, and when the block's last use is due to be
+ * refreshed, which the shared lookup does.
+ */
+static size_t lookup_hot(cache_t *cache, cache_id_t id, const char *key,
+                         char *value) {
+    if (++hot_lookups % HOT_DECAY == 0) {
+        for (unsigned int i = 0; i < hot_objects; i++) {
+            hot_table[i].hits /= 2;
+        }
+    }
+
+    unsigned long *unlinks = &cache->unlinks[id.lo % CACHE_BUCKETS];
+    for (unsigned int i = 0; i < hot_objects; i++) {
+        hot_object_t *hot = &hot_table[i];
+        if (hot->cache != cache || !same_id(hot->id, id)) {
+            continue;
+        }
+        if (__atomic_load_n(unlinks, __ATOMIC_ACQUIRE) != hot->unlinks ||
+            __atomic_load_n(&cache->resets, __ATOMIC_ACQUIRE) !=
+                hot->resets) {
+            hot->cache = NULL; // the block may be gone
+            continue;
+        }
+        // bounded, in case the block's memory is being reused already
+        if (strncmp(hot->key, key, hot->key_size)) {
+            continue;
+        }
+        if (now_ns() - hot->touched >= CACHE_HOT_TOUCH_NS) {
+            return 0;
+        }
+        memcpy(value, hot->value, hot->size);
+        // the copy must be done before the counts are read again
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(unlinks, __ATOMIC_RELAXED) != hot->unlinks ||
+            __atomic_load_n(&cache->resets, __ATOMIC_RELAXED) !=
+                hot->resets) {
+            hot->cache = NULL;
+            return 0;
         }
-        curr_cb->next = cache->head;
-        cache->head->prev = curr_cb;
-        curr_cb->prev = NULL;
-        cache->head = curr_cb;
+        hot->hits++;
+        return hot->size;
     }
+    return 0;
 }
 
-static void print_cache(cache_t *cache) {
-    if (cache->cache_size > 0) {
-        cache_block_t *curr_cb = cache->head;
-        while (curr_cb) {
-            sio_printf("Cache key: %s, size: %zu\n", curr_cb->key,
-                       curr_cb->block_size);
-            curr_cb = curr_cb->next;
+/**
+ * @brief Private helper function pushing a block just hit on the stack the
+ * next writer moves to the head of the ring.
+ * @param[in] cache pointer to the cache.
+ * @param[in] cb block hit, whose reference bit the caller set.
+ *
+ * Done in the reader's epoch, so that the block is not freed before the
+ * writer has taken it off the stack again.
+ */
+static void push_touched(cache_t *cache, cache_block_t *cb) {
+    cb->tnext = __atomic_load_n(&cache->touched, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&cache->touched, &cb->tnext, cb,
+                                        false, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED)) {
+    }
+}
+
+/**
+ * @brief Private helper function putting a block found by the shared
+ * lookup in the calling thread's hot-object table.
+ * @param[in] cache pointer to the cache.
+ * @param[in] cb block found, still reachable by the caller.
+ * @param[in] unlinks count of cb's bucket read before the lookup.
+ * @param[in] resets resets of the cache read before the lookup.
+ * @param[in] now monotonic ns of the lookup.
+ *
+ * The counts must be from before the block was found: if it was unlinked
+ * after they were read, the entry is stale from the start, as it must be.
+ * A block new to the table takes the place of the entry hit least, so
+ * that the table settles on the objects the thread serves most.
+ */
+static void keep_hot(cache_t *cache, cache_block_t *cb, unsigned long unlinks,
+                     unsigned long resets, long long now) {
+    hot_object_t *slot = NULL;
+    unsigned int hits = 0;
+    for (unsigned int i = 0; i < hot_objects; i++) {
+        hot_object_t *hot = &hot_table[i];
+        if (hot->cache == cache && hot->key == cb->key) {
+            slot = hot; // taken again, as its last use was due
+            hits = hot->hits;
+            break;
+        }
+        if (slot == NULL || (slot->cache != NULL &&
+                             (hot->cache == NULL || hot->hits < slot->hits))) {
+            slot = hot;
         }
     }
+    if (slot != NULL) {
+        slot->cache = cache;
+        slot->key = cb->key;
+        slot->key_size = strlen(cb->key) + 1;
+        slot->value = cb->value;
+        slot->size = cb->block_size;
+        slot->id = cb->id;
+        slot->unlinks = unlinks;
+        slot->resets = resets;
+        slot->touched = now;
+        slot->hits = hits;
+    }
 }
 
 /**
- * @brief Iterate through cache to retrieve cached data if found in cache
+ * @brief Looks up a key in the cache and copies out its value if found
  * @param[in] cache pointer to the cache.
  * @param[in] search_key string value of key to search
  * @param[in] value string pointer to store cached data
  *
- * To maintain LRU policy, retrieved cache block will be moved to the start of
- * the linked list, so that LRU blocks will be pushed to the end of the list.
+ * Takes no lock and writes nothing shared but the reader's own slot and,
+ * on the first hit since the block was last moved to the head of the ring,
+ * its reference bit and the stack of hit blocks; a hit in the thread's
+ * hot-object table writes nothing shared at all.
+ * Threads that found no free slot fall back to taking the lock.
  */
 size_t retrieve_cache(cache_t *cache, char *search_key, char *value) {
-    pthread_mutex_lock(&mutex);
-    if (cache->cache_size > 0) {
-        cache_block_t *curr_cb = cache->head;
-        while (curr_cb) {
-            if (!strcmp(curr_cb->key, search_key)) {
-                memcpy(value, curr_cb->value, curr_cb->block_size);
-                move_to_front(cache, curr_cb);
-                print_cache(cache);
-                pthread_mutex_unlock(&mutex);
-                return curr_cb->block_size;
+    cache_id_t id = hash_key(search_key);
+    size_t size = 0; // not found
+    unsigned long unlinks = 0;
+    unsigned long resets = 0;
+    if (hot_objects > 0) {
+        if ((size = lookup_hot(cache, id, search_key, value)) > 0) {
+            PROBE3(cache_hit, search_key, size, 1);
+            return size;
+        }
+        unlinks = __atomic_load_n(&cache->unlinks[id.lo % CACHE_BUCKETS],
+                                  __ATOMIC_ACQUIRE);
+        resets = __atomic_load_n(&cache->resets, __ATOMIC_ACQUIRE);
+    }
+
+    cache_reader_t *reader = get_reader(cache);
+    if (reader != NULL) {
+        // the fence orders our epoch before the lookup, for the writers
+        __atomic_store_n(&reader->epoch,
+                         __atomic_load_n(&cache->epoch, __ATOMIC_SEQ_CST),
+                         __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    } else {
+        lock_cache(cache);
+    }
+
+    cache_block_t *curr_cb = __atomic_load_n(
+        &cache->buckets[id.lo % CACHE_BUCKETS], __ATOMIC_ACQUIRE);
+    while (curr_cb) {
+        if (same_id(curr_cb->id, id) && !strcmp(curr_cb->key, search_key)) {
+            memcpy(value, curr_cb->value, curr_cb->block_size);
+            size = curr_cb->block_size;
+            // written only when clear, so that hits on a hot block do not
+            // bounce its cache line between cores
+            if (!__atomic_load_n(&curr_cb->referenced, __ATOMIC_RELAXED) &&
+                !__atomic_exchange_n(&curr_cb->referenced, true,
+                                     __ATOMIC_RELAXED)) {
+                push_touched(cache, curr_cb);
+            }
+            if (hot_objects > 0) {
+                keep_hot(cache, curr_cb, unlinks, resets, now_ns());
             }
-            curr_cb = curr_cb->next;
+            break;
         }
+        curr_cb = __atomic_load_n(&curr_cb->hnext, __ATOMIC_ACQUIRE);
     }
 
-    pthread_mutex_unlock(&mutex);
-    return 0; // not found
+    if (reader != NULL) {
+        __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
+    } else {
+        pthread_mutex_unlock(&cache->mutex);
+    }
+    if (size > 0) {
+        PROBE3(cache_hit, search_key, size, 0);
+    } else {
+        PROBE1(cache_miss, search_key);
+    }
+    return size;
 }
@@ -1,47 +1,213 @@
 /**
- * @file proxy_cache.c
+ * @file proxy_cache.h
  * @brief Prototypes and definitions for proxy_cache.c
  *
- * This file contains a doubly linked list implementation to serve as
- * cache for the web server praoxy proxy.c
+ * The cache of the web proxy proxy.c: blocks found through a hash index
+ * whose readers are protected by epochs, and evicted from a ring put in
+ * order of use lazily.
  *
  * @author Taiming Liu <taimingl@andrew.cmu.edu>
  */
 
 #include "csapp.h"
+#include "proxy_arena.h"
+#include "proxy_stats.h"
 
+#include <pthread.h>
+#include <stdbool.h>
 #include <stddef.h> /* size_t */
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h> /* pid_t */
 
-/* Max cache and object sizes */
+/*
+ * Max cache and object sizes. A cache holds MAX_CACHE_SIZE bytes unless
+ * set_cache_capacity lowers it; builds wanting larger caches, such as
+ * tools/cachesim, define MAX_CACHE_SIZE themselves.
+ */
+#ifndef MAX_CACHE_SIZE
 #define MAX_CACHE_SIZE (1024 * 1024)
+#endif
 #define MAX_OBJECT_SIZE (100 * 1024)
 
-/* Node data structure as a single cache block */
+/*
+ * Arena holding the blocks, CACHE_ARENA_RATIO times the capacity of the
+ * cache, with room for keys and fragmentation; mappings are sized for
+ * the largest capacity
+ */
+#define CACHE_ARENA_RATIO 2
+#define CACHE_ARENA_SIZE (CACHE_ARENA_RATIO * MAX_CACHE_SIZE)
+
+/* Least capacity of a cache, enough for the largest object */
+#define CACHE_MIN_SIZE MAX_OBJECT_SIZE
+
+/*
+ * Huge page size the cache mapping is rounded up and aligned to, whether
+ * it gets explicit huge pages or only asks for transparent ones
+ */
+#define CACHE_HUGE_PAGE (2 * 1024 * 1024)
+
+/* NUMA nodes a cache can be placed on */
+#define CACHE_MAX_NODES 64
+
+/* Buckets of the hash index, a power of two */
+#define CACHE_BUCKETS 4096
+
+/* Reader slots; threads beyond this many look up under the lock */
+#define CACHE_READERS 1024
+
+/* Largest hot-object table a thread may keep, see set_hot_objects */
+#define CACHE_HOT_MAX 64
+
+/*
+ * A hot-object hit goes through the shared cache instead this often, in
+ * ns, so that the block's reference bit keeps up with it
+ */
+#define CACHE_HOT_TOUCH_NS 100000000
+
+/*
+ * Watermarks of the evictor, in percent of the arena. The arena is twice
+ * the capacity, so past the high mark much of it holds blocks that are
+ * evicted but not yet freed; the evictor frees them, and evicts more only
+ * if that does not bring the arena down to the low mark. It also keeps a
+ * free chunk of CACHE_ROOM bytes, the most any block can take, so that
+ * fragmentation does not make inserts evict either.
+ */
+#define CACHE_HIGH_WATER 75
+#define CACHE_LOW_WATER 60
+#define CACHE_ROOM (sizeof(cache_body_t) + MAX_OBJECT_SIZE)
+
+/*
+ * Identify a cache mapping handed over by an older binary on upgrade. Bump
+ * the version whenever cache_t, cache_block_t or the arena change layout,
+ * so that a new binary starts with an empty cache instead of misreading
+ * the old one.
+ */
+#define CACHE_MAGIC 0x70786361 /* "pxca" */
+#define CACHE_VERSION 12
+
+/* 128-bit hash identifying a key */
+typedef struct cache_id {
+    uint64_t lo; /* also picks the bucket */
+    uint64_t hi;
+} cache_id_t;
+
+/*
+ * A cached response body, which its bytes follow. Keys whose responses are
+ * the same bytes share one body, found through its hash; it is freed along
+ * with the last block referring to it. It never changes once filled in.
+ */
+typedef struct cache_body {
+    uint64_t hash;            /* hash of the bytes, picks the bucket */
+    size_t size;              /* bytes in the body */
+    unsigned int refs;        /* blocks referring to it, unlinked or not */
+    unsigned int linked;      /* blocks referring to it still linked in */
+    struct cache_body *bnext; /* next body in the same bucket */
+} cache_body_t;
+
+/*
+ * Node data structure as a single cache block, key follows it; value and
+ * block_size are those of its body, kept here for the readers.
+ * Once linked in, only the links and the reference bit ever change.
+ */
 typedef struct cache_block {
-    char *key;
+    /* what lookups read comes first, so that it spans few cache lines */
+    cache_id_t id;             /* hash of key, compared before the key */
+    struct cache_block *hnext; /* next block in the same bucket */
     char *value;
     size_t block_size;
-    struct cache_block *next;
+    bool referenced;           /* hit since last moved, on cache->touched */
+    char *key;                 /* full key, to rule out hash collisions */
+    cache_body_t *body;        /* body holding the value */
+    struct cache_block *next;  /* ring of all blocks, latest used first */
     struct cache_block *prev;
+    unsigned long retired;     /* epoch the block was unlinked in, or 0 */
+    struct cache_block *rnext; /* next block waiting to be freed */
+    struct cache_block *tnext; /* next block on cache->touched */
 } cache_block_t;
 
-/* Data structure for the entire available cache */
+/*
+ * A reader thread's slot. The thread stores the epoch it read in before
+ * looking anything up, and 0 when done; a block unlinked in an epoch is
+ * freed once no slot holds that epoch or an older one. An inserting
+ * thread holds an epoch the same way while it fills its block in. Slots
+ * are a cache line each, so that readers write only to lines of their own.
+ */
+typedef struct cache_reader {
+    pid_t pid;           /* process of the owning thread, 0 when free */
+    unsigned long epoch; /* epoch entered in, 0 when not reading */
+} __attribute__((aligned(64))) cache_reader_t;
+
+/*
+ * Data structure for the entire available cache. It sits at the start of
+ * its own shared mapping of a memfd, followed by the arena, so pre-forked
+ * workers share it and an upgraded binary can map it again. Blocks link
+ * with plain pointers, so every process maps it at the same address.
+ *
+ * cache_size counts each body once, however many keys share it, and the
+ * size limit applies to that.
+ *
+ * Lookups take no lock: they go through the hash index under the
+ * protection of an epoch (see cache_reader_t). Writers serialize on the
+ * mutex, and evict the tail of the ring, after moving the blocks hit since
+ * the last write to its head. Threads may keep references to hot blocks
+ * besides, which stay good for as long as nothing is unlinked from the
+ * block's bucket and the cache is not wiped.
+ */
 typedef struct cache {
+    unsigned int magic;   /* CACHE_MAGIC */
+    unsigned int version; /* CACHE_VERSION */
+    void *addr;           /* where the mapping must be */
+    int fd;               /* memfd, the same number in every process */
     size_t cache_size;
+    size_t capacity;         /* most cache_size may be */
+    unsigned long nblocks;   /* blocks linked in */
+    unsigned long evictions; /* blocks evicted, ever */
     cache_block_t *head;
     cache_block_t *tail;
+    cache_block_t *retired; /* unlinked blocks readers may still be using */
+    cache_block_t *touched; /* blocks hit since the last write, latest first */
+    unsigned long epoch;    /* advanced whenever a block is unlinked */
+    pthread_mutex_t mutex;  /* lock serializing the writers */
+    size_t map_size;        /* bytes mapped for the cache and its arena */
+    size_t page_size;       /* size of the pages backing the mapping */
+    bool thp;               /* transparent huge pages were asked for */
+    int node;               /* NUMA node preferred for the pages, or -1 */
+    unsigned long resets;   /* times the cache was wiped, see lock_cache */
+    arena_t arena;          /* storage for the blocks */
+    pthread_cond_t evict;   /* broadcast to wake the evictors */
+    bool evict_pending;     /* evictors woken, none started yet */
+    unsigned int nreaders;  /* reader slots ever claimed */
+    cache_reader_t readers[CACHE_READERS];
+    cache_block_t *buckets[CACHE_BUCKETS];
+    cache_body_t *bodies[CACHE_BUCKETS];  /* by hash, for writers only */
+    unsigned long unlinks[CACHE_BUCKETS]; /* blocks unlinked per bucket */
 } cache_t;
 
-/*  */
-void init_cache(cache_t *cache);
+/* Maps a new empty cache on NUMA node (-1 for any), shared with children */
+cache_t *new_cache(int node);
+
+/* Maps the cache in memfd fd again, or returns NULL if it cannot be used */
+cache_t *attach_cache(int fd);
 
 /*  */
 void free_cache(cache_t *cache);
 
+/* Starts a thread freeing and evicting blocks in the background */
+void start_evictor(cache_t *cache);
+
+/* Empties a cache and sets the bytes it may hold, up to MAX_CACHE_SIZE */
+void set_cache_capacity(cache_t *cache, size_t bytes);
+
 /*  */
 void insert_cache(cache_t *cache, char *key, char *value, size_t buff_size);
 
+/* Reports occupancy, evictions and placement of a cache, signal-safe */
+void report_cache(cache_t *cache, int index, stats_out_t *out);
+
+/* Keeps references to up to n hot objects per thread, 0 to keep none */
+void set_hot_objects(unsigned int n);
+
 /*  */
 size_t retrieve_cache(cache_t *cache, char *search_key, char *value);
@@ -0,0 +1,728 @@
+/**
+ * @file proxy_coro.c
+ * @brief Stackful coroutine scheduler for the proxy
+ *
+ * Each worker thread has a queue of freshly spawned coroutines, a queue of
+ * woken ones and an epoll instance. Spawned coroutines are handed out
+ * round-robin, and a worker that runs out of work steals fresh coroutines
+ * from the others before going to sleep. Once a coroutine has started it
+ * stays on its worker for good: its fds are registered with that worker's
+ * epoll, and code running in it may hold on to thread-local addresses
+ * (errno) across a yield.
+ *
+ * Stacks are mmap'd with a PROT_NONE guard page below them, so an overflow
+ * faults instead of corrupting a neighbour; untouched stack pages cost no
+ * memory.
+ *
+ * @author Taiming Liu <taimingl@andrew.cmu.edu>
+ */
+#define _GNU_SOURCE /* pthread_setaffinity_np */
+
+#include "proxy_coro.h"
+#include "proxy_stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+static worker_t *workers = NULL;
+static int nworkers = 0;
+static unsigned int next_worker = 0; /* round-robin spawn target */
+
+/* Coroutine running on this thread, NULL on the scheduler's own stack */
+static __thread coro_t *current = NULL;
+
+/**
+ * @brief Private helper function returning the monotonic time in ms.
+ */
+static long long now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * Timer heap: waiting coroutines with a timeout, ordered by deadline.
+ * Each coroutine remembers its index so that an I/O wakeup can take it out.
+ */
+static void timer_swap(worker_t *w, size_t i, size_t j) {
+    coro_t *tmp = w->timers[i];
+    w->timers[i] = w->timers[j];
+    w->timers[j] = tmp;
+    w->timers[i]->timer = i;
+    w->timers[j]->timer = j;
+}
+
+static void timer_sift(worker_t *w, size_t i) {
+    while (i > 0 &&
+           w->timers[(i - 1) / 2]->deadline > w->timers[i]->deadline) {
+        timer_swap(w, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    while (true) {
+        size_t min = i, left = 2 * i + 1, right = 2 * i + 2;
+        if (left < w->ntimers &&
+            w->timers[left]->deadline < w->timers[min]->deadline) {
+            min = left;
+        }
+        if (right < w->ntimers &&
+            w->timers[right]->deadline < w->timers[min]->deadline) {
+            min = right;
+        }
+        if (min == i) {
+            return;
+        }
+        timer_swap(w, i, min);
+        i = min;
+    }
+}
+
+static bool timer_add(worker_t *w, coro_t *co) {
+    if (w->ntimers == w->timers_cap) {
+        size_t cap = w->timers_cap > 0 ? 2 * w->timers_cap : 64;
+        coro_t **timers = realloc(w->timers, cap * sizeof(coro_t *));
+        if (timers == NULL) {
+            return false;
+        }
+        w->timers = timers;
+        w->timers_cap = cap;
+    }
+    co->timer = w->ntimers++;
+    w->timers[co->timer] = co;
+    timer_sift(w, co->timer);
+    return true;
+}
+
+static void timer_remove(worker_t *w, coro_t *co) {
+    size_t i = co->timer;
+    co->timer = CORO_NO_TIMER;
+    if (i != --w->ntimers) {
+        w->timers[i] = w->timers[w->ntimers];
+        w->timers[i]->timer = i;
+        timer_sift(w, i);
+    }
+}
+
+/**
+ * @brief Private helper function queueing a woken coroutine to be resumed.
+ */
+static void wake(worker_t *w, coro_t *co) {
+    if (co->timer != CORO_NO_TIMER) {
+        timer_remove(w, co);
+    }
+    co->state = CORO_READY;
+    co->next = NULL;
+    if (w->ready_tail != NULL) {
+        w->ready_tail->next = co;
+    } else {
+        w->ready_head = co;
+    }
+    w->ready_tail = co;
+}
+
+/**
+ * @brief Private helper function entered on a new coroutine's stack.
+ */
+static void coro_entry(void) {
+    coro_t *co = current;
+    co->fn(co->arg);
+    co->state = CORO_DONE;
+    setcontext(&co->owner->sched_ctx);
+}
+
+/**
+ * @brief Private helper function giving a coroutine its stack on first run.
+ *
+ * Returns false if no stack could be mapped.
+ */
+static bool start(worker_t *w, coro_t *co) {
+    size_t guard = (size_t)sysconf(_SC_PAGESIZE);
+    if (w->nstacks > 0) {
+        co->stack = w->stacks[--w->nstacks];
+    } else {
+        void *stack = mmap(NULL, guard + CORO_STACK_SIZE,
+                           PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (stack == MAP_FAILED) {
+            return false;
+        }
+        mprotect(stack, guard, PROT_NONE); // stacks grow down into it
+        co->stack = stack;
+    }
+
+    co->owner = w;
+    getcontext(&co->ctx);
+    co->ctx.uc_stack.ss_sp = co->stack + guard;
+    co->ctx.uc_stack.ss_size = CORO_STACK_SIZE;
+    co->ctx.uc_link = NULL;
+    makecontext(&co->ctx, coro_entry, 0);
+    return true;
+}
+
+/**
+ * @brief Private helper function releasing a finished coroutine.
+ */
+static void finish(worker_t *w, coro_t *co) {
+    if (w->nstacks < CORO_STACK_CACHE) {
+        w->stacks[w->nstacks++] = co->stack;
+    } else {
+        munmap(co->stack, (size_t)sysconf(_SC_PAGESIZE) + CORO_STACK_SIZE);
+    }
+    free(co);
+}
+
+/**
+ * @brief Private helper function resuming a coroutine until it parks or
+ * returns.
+ */
+static void run(worker_t *w, coro_t *co) {
+    if (co->owner == NULL && !start(w, co)) {
+        // out of memory: run it on the scheduler's stack, where its I/O
+        // fails instead of parking, so the client is turned away
+        fprintf(stderr, "coroutine stack allocation failed\n");
+        co->fn(co->arg);
+        free(co);
+        return;
+    }
+    current = co;
+    swapcontext(&w->sched_ctx, &co->ctx);
+    current = NULL;
+    if (co->state == CORO_DONE) {
+        finish(w, co);
+    }
+}
+
+/**
+ * @brief Private helper function popping a fresh coroutine off a worker.
+ */
+static coro_t *take_fresh(worker_t *w) {
+    pthread_mutex_lock(&w->mutex);
+    coro_t *co = w->fresh_head;
+    if (co != NULL) {
+        w->fresh_head = co->next;
+        if (w->fresh_head == NULL) {
+            w->fresh_tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&w->mutex);
+    return co;
+}
+
+/**
+ * @brief Private helper function taking a fresh coroutine from the first
+ * other worker that has one.
+ */
+static coro_t *steal_fresh(worker_t *w) {
+    int self = (int)(w - workers);
+    for (int i = 1; i < nworkers; i++) {
+        worker_t *victim = &workers[(self + i) % nworkers];
+        if (victim->fresh_head != NULL) { // racy peek, rechecked under lock
+            coro_t *co = take_fresh(victim);
+            if (co != NULL) {
+                return co;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Private helper function waiting for I/O and expired timeouts, and
+ * waking the coroutines concerned.
+ * @param[in] idle whether there is nothing to run, so the worker may sleep.
+ */
+static void poll_events(worker_t *w, bool idle) {
+    struct epoll_event events[CORO_MAX_EVENTS];
+    int timeout = 0;
+
+    if (idle) {
+        pthread_mutex_lock(&w->mutex);
+        w->sleeping = w->fresh_head == NULL;
+        pthread_mutex_unlock(&w->mutex);
+        if (w->sleeping) {
+            timeout = -1;
+            if (w->ntimers > 0) {
+                long long left = w->timers[0]->deadline - now_ms();
+                timeout = left > 0 ? (int)left : 0;
+            }
+        }
+    }
+
+    int n = epoll_wait(w->epfd, events, CORO_MAX_EVENTS, timeout);
+    if (w->sleeping) {
+        pthread_mutex_lock(&w->mutex);
+        w->sleeping = false;
+        pthread_mutex_unlock(&w->mutex);
+    }
+    for (int i = 0; i < n; i++) {
+        coro_t *co = events[i].data.ptr;
+        if (co == NULL) {
+            uint64_t count;
+            if (read(w->wakefd, &count, sizeof(count)) < 0) {
+                continue; // already drained
+            }
+        } else if (co->state == CORO_WAITING) {
+            wake(w, co);
+        }
+    }
+
+    long long now = now_ms();
+    while (w->ntimers > 0 && w->timers[0]->deadline <= now) {
+        coro_t *co = w->timers[0];
+        co->timed_out = true;
+        // so that a late event cannot wake it while it runs
+        epoll_ctl(w->epfd, EPOLL_CTL_DEL, co->wait_fd, NULL);
+        wake(w, co);
+    }
+}
+
+/**
+ * @brief Private helper function: the loop of a worker thread.
+ */
+static void *worker_main(void *vargp) {
+    worker_t *w = vargp;
+    cpu_set_t cpus;
+
+    pthread_detach(pthread_self());
+    CPU_ZERO(&cpus);
+    CPU_SET(w->cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+    while (1) {
+        while (w->ready_head != NULL) {
+            coro_t *co = w->ready_head;
+            w->ready_head = co->next;
+            if (w->ready_head == NULL) {
+                w->ready_tail = NULL;
+            }
+            run(w, co);
+        }
+
+        // start one new connection per round, so I/O keeps being polled
+        coro_t *co = take_fresh(w);
+        if (co == NULL) {
+            co = steal_fresh(w);
+        }
+        if (co != NULL) {
+            run(w, co);
+        }
+        poll_events(w, co == NULL && w->ready_head == NULL);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Starts the worker threads.
+ * @param[in] nthreads number of workers.
+ *
+ * Exits the proxy if a worker cannot be set up, like the other startup
+ * failures in main().
+ */
+void start_coros(int nthreads) {
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    workers = Calloc((size_t)nthreads, sizeof(worker_t));
+    nworkers = nthreads;
+    for (int i = 0; i < nthreads; i++) {
+        worker_t *w = &workers[i];
+        w->cpu = ncpus > 0 ? i % (int)ncpus : 0;
+        pthread_mutex_init(&w->mutex, NULL);
+        w->epfd = epoll_create1(EPOLL_CLOEXEC);
+        w->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+        if (w->epfd < 0 || w->wakefd < 0 ||
+            epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->wakefd, &ev) < 0) {
+            perror("coroutine worker setup failed");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < nthreads; i++) {
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, worker_main, &workers[i]) != 0) {
+            perror("Error creating coroutine worker");
+            exit(1);
+        }
+    }
+}
+
+/**
+ * @brief Queues fn(arg) to run as a coroutine on the next worker in turn.
+ *
+ */
+bool spawn_coro(coro_fn fn, void *arg) {
+    coro_t *co = calloc(1, sizeof(coro_t));
+    if (co == NULL) {
+        return false;
+    }
+    co->fn = fn;
+    co->arg = arg;
+    co->state = CORO_READY;
+    co->timer = CORO_NO_TIMER;
+
+    worker_t *w =
+        &workers[__atomic_fetch_add(&next_worker, 1, __ATOMIC_RELAXED) %
+                 (unsigned int)nworkers];
+    pthread_mutex_lock(&w->mutex);
+    if (w->fresh_tail != NULL) {
+        w->fresh_tail->next = co;
+    } else {
+        w->fresh_head = co;
+    }
+    w->fresh_tail = co;
+    bool sleeping = w->sleeping;
+    pthread_mutex_unlock(&w->mutex);
+
+    if (sleeping) {
+        uint64_t one = 1;
+        if (write(w->wakefd, &one, sizeof(one)) < 0) {
+            perror("coroutine wakeup");
+        }
+    }
+    return true;
+}
+
+bool in_coro(void) {
+    return current != NULL;
+}
+
+/**
+ * @brief Private helper function parking the running coroutine until fd is
+ * ready for events.
+ * @param[in] ms timeout in milliseconds, <= 0 for none.
+ *
+ * Returns -1 with errno EAGAIN if the timeout passed first, as a blocking
+ * socket with SO_RCVTIMEO/SO_SNDTIMEO would.
+ */
+static int coro_wait(int fd, uint32_t events, long ms) {
+    coro_t *co = current;
+    worker_t *w = co->owner;
+    struct epoll_event ev = {.events = events | EPOLLONESHOT, .data.ptr = co};
+
+    if (epoll_ctl(w->epfd, EPOLL_CTL_MOD, fd, &ev) < 0 &&
+        (errno != ENOENT || epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)) {
+        return -1;
+    }
+    co->wait_fd = fd;
+    co->timed_out = false;
+    co->state = CORO_WAITING;
+    if (ms > 0) {
+        co->deadline = now_ms() + ms;
+        if (!timer_add(w, co)) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    swapcontext(&co->ctx, &w->sched_ctx);
+
+    if (co->timed_out) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Private helper function reading a socket timeout set by setsockopt,
+ * in milliseconds (0 if none).
+ */
+static long sock_timeout(int fd, int which) {
+    struct timeval tv;
+    socklen_t len = sizeof(tv);
+    if (getsockopt(fd, SOL_SOCKET, which, &tv, &len) < 0) {
+        return 0;
+    }
+    return tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+}
+
+/**
+ * @brief Private helper function: read() that parks the coroutine instead
+ * of failing with EAGAIN.
+ */
+static ssize_t coro_read(int fd, void *buf, size_t n) {
+    while (true) {
+        ssize_t rc = read(fd, buf, n);
+        if (rc >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK) ||
+            current == NULL) {
+            return rc;
+        }
+        if (coro_wait(fd, EPOLLIN, sock_timeout(fd, SO_RCVTIMEO)) < 0) {
+            return -1;
+        }
+    }
+}
+
+/**
+ * @brief Private helper function: write() that parks the coroutine instead
+ * of failing with EAGAIN.
+ */
+static ssize_t coro_write(int fd, const void *buf, size_t n) {
+    while (true) {
+        ssize_t rc = write(fd, buf, n);
+        if (rc >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK) ||
+            current == NULL) {
+            return rc;
+        }
+        if (coro_wait(fd, EPOLLOUT, sock_timeout(fd, SO_SNDTIMEO)) < 0) {
+            return -1;
+        }
+    }
+}
+
+/*
+ * coro_readn - rio_readn on coro_read
+ */
+ssize_t coro_readn(int fd, void *usrbuf, size_t n) {
+    size_t nleft = n;
+    ssize_t nread;
+    char *bufp = usrbuf;
+
+    while (nleft > 0) {
+        if ((nread = coro_read(fd, bufp, nleft)) < 0) {
+            if (errno != EINTR) {
+                return -1; /* errno set by read() */
+            }
+
+            /* Interrupted by sig handler return, call read() again */
+            nread = 0;
+        } else if (nread == 0) {
+            break; /* EOF */
+        }
+        nleft -= (size_t)nread;
+        bufp += nread;
+    }
+    return (ssize_t)(n - nleft); /* Return >= 0 */
+}
+
+/*
+ * coro_writen - rio_writen on coro_write
+ */
+ssize_t coro_writen(int fd, const void *usrbuf, size_t n) {
+    size_t nleft = n;
+    ssize_t nwritten;
+    const char *bufp = usrbuf;
+
+    while (nleft > 0) {
+        if ((nwritten = coro_write(fd, bufp, nleft)) <= 0) {
+            if (errno != EINTR) {
+                return -1; /* errno set by write() */
+            }
+
+            /* Interrupted by sig handler return, call write() again */
+            nwritten = 0;
+        }
+        nleft -= (size_t)nwritten;
+        bufp += nwritten;
+    }
+    return (ssize_t)n;
+}
+
+/**
+ * @brief Private helper function bounding the next read of a socket by a
+ * deadline.
+ * @param[in] deadline monotonic time the read must be done by.
+ *
+ * Sets the receive timeout to the time left, so that a read blocking or
+ * parked on the socket gives up at the deadline. Returns false with errno
+ * EAGAIN if the deadline has passed already.
+ */
+static bool arm_deadline(int fd, const struct timespec *deadline) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long ms = (deadline->tv_sec - now.tv_sec) * 1000 +
+              (deadline->tv_nsec - now.tv_nsec) / 1000000;
+    if (ms <= 0) {
+        errno = EAGAIN;
+        return false;
+    }
+    struct timeval tv = {ms / 1000, (ms % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return true;
+}
+
+/*
+ * buffered_read - csapp's rio_read on coro_read
+ *
+ * Every refill is bounded by the deadline, if one is given.
+ */
+static ssize_t buffered_read(rio_t *rp, char *usrbuf, size_t n,
+                             const struct timespec *deadline) {
+    size_t cnt;
+
+    while (rp->rio_cnt <= 0) { /* Refill if buf is empty */
+        if (deadline != NULL && !arm_deadline(rp->rio_fd, deadline)) {
+            return -1;
+        }
+        rp->rio_cnt = coro_read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
+        if (rp->rio_cnt < 0) {
+            if (errno != EINTR) {
+                return -1; /* errno set by read() */
+            }
+
+            /* Interrupted by sig handler return, nothing to do */
+        } else if (rp->rio_cnt == 0) {
+            return 0; /* EOF */
+        } else {
+            rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
+        }
+    }
+
+    /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
+    cnt = n;
+    if ((size_t)rp->rio_cnt < n) {
+        cnt = (size_t)rp->rio_cnt;
+    }
+    memcpy(usrbuf, rp->rio_bufptr, cnt);
+    rp->rio_bufptr += cnt;
+    rp->rio_cnt -= cnt;
+    return (ssize_t)cnt;
+}
+
+/*
+ * coro_readlineb_until - rio_readlineb on coro_read, by a deadline
+ *
+ * With a deadline, the socket's receive timeout is re-armed with the time
+ * left before each read, so the line must be in by then however slowly it
+ * trickles in; otherwise fails with EAGAIN. A NULL deadline bounds each
+ * read by the socket's own timeout only.
+ */
+ssize_t coro_readlineb_until(rio_t *rp, void *usrbuf, size_t maxlen,
+                             const struct timespec *deadline) {
+    size_t n;
+    ssize_t rc;
+    char c, *bufp = usrbuf;
+
+    for (n = 1; n < maxlen; n++) {
+        if ((rc = buffered_read(rp, &c, 1, deadline)) == 1) {
+            *bufp++ = c;
+            if (c == '\n') {
+                n++;
+                break;
+            }
+        } else if (rc == 0) {
+            if (n == 1) {
+                return 0; /* EOF, no data read */
+            } else {
+                break; /* EOF, some data was read */
+            }
+        } else {
+            return -1; /* Error */
+        }
+    }
+    *bufp = 0;
+    return (ssize_t)(n - 1);
+}
+
+/*
+ * coro_readlineb - rio_readlineb on coro_read
+ */
+ssize_t coro_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
+    return coro_readlineb_until(rp, usrbuf, maxlen, NULL);
+}
+
+/**
+ * @brief Private helper function waiting for a non-blocking connect.
+ * @param[in] ms timeout in milliseconds, <= 0 for none.
+ *
+ * Parks the coroutine, or outside one polls. Returns true if the connect
+ * went through; otherwise errno is ETIMEDOUT if it ran out of time.
+ */
+static bool wait_connect(int fd, long ms) {
+    if (current != NULL) {
+        if (coro_wait(fd, EPOLLOUT, ms) < 0) {
+            if (errno == EAGAIN) {
+                errno = ETIMEDOUT;
+            }
+            return false;
+        }
+    } else {
+        struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+        int rc;
+        while ((rc = poll(&pfd, 1, ms > 0 ? (int)ms : -1)) < 0 &&
+               errno == EINTR) {
+        }
+        if (rc <= 0) {
+            if (rc == 0) {
+                errno = ETIMEDOUT;
+            }
+            return false;
+        }
+    }
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+        errno = err != 0 ? err : errno;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * coro_open_clientfd - open_clientfd with a non-blocking connect
+ *
+ * Each connect is given at most timeout milliseconds (none if <= 0), so
+ * that an origin dropping SYNs costs that rather than the kernel's minutes
+ * of retries. Inside a coroutine the connect parks the coroutine and the
+ * socket stays non-blocking; outside one it is polled for, and the socket
+ * made blocking again. Name resolution still blocks. Either way, the
+ * monotonic ns the name was resolved at is stored in *resolved, so that
+ * the two can be timed apart. Returns the same values as open_clientfd.
+ */
+int coro_open_clientfd(const char *hostname, const char *port, long timeout,
+                       long long *resolved) {
+    int clientfd = -1, rc;
+    struct addrinfo hints, *listp, *p;
+
+    /* Get a list of potential server addresses */
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM; /* Open a connection */
+    hints.ai_flags = AI_NUMERICSERV; /* ... using a numeric port arg. */
+    hints.ai_flags |= AI_ADDRCONFIG; /* Recommended for connections */
+    if ((rc = getaddrinfo(hostname, port, &hints, &listp)) != 0) {
+        fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", hostname, port,
+                gai_strerror(rc));
+        return -2;
+    }
+    *resolved = stats_clock();
+
+    /* Walk the list for one that we can successfully connect to */
+    int flags = SOCK_CLOEXEC | SOCK_NONBLOCK;
+    for (p = listp; p; p = p->ai_next) {
+        clientfd = socket(p->ai_family, p->ai_socktype | flags, p->ai_protocol);
+        if (clientfd < 0) {
+            continue; /* Socket failed, try the next */
+        }
+
+        /* Connect to the server, waiting for it to complete */
+        if (connect(clientfd, p->ai_addr, p->ai_addrlen) == 0 ||
+            (errno == EINPROGRESS && wait_connect(clientfd, timeout))) {
+            if (current == NULL) {
+                fcntl(clientfd, F_SETFL,
+                      fcntl(clientfd, F_GETFL) & ~O_NONBLOCK);
+            }
+            break; /* Success */
+        }
+
+        /* Connect failed, try another */
+        close(clientfd);
+    }
+
+    /* Clean up */
+    freeaddrinfo(listp);
+    if (!p) { /* All connects failed */
+        return -1;
+    } else { /* The last connect succeeded */
+        return clientfd;
+    }
+}
@@ -0,0 +1,106 @@
+/**
+ * @file proxy_coro.h
+ * @brief Prototypes and definitions for proxy_coro.c
+ *
+ * A user-space M:N scheduler running connections as stackful coroutines on
+ * a few worker threads, so that serve() and do_proxy() keep reading as
+ * straight-line blocking code without an OS thread per connection.
+ *
+ * The coro_* I/O functions are drop-in copies of their rio/csapp
+ * counterparts. Inside a coroutine, a socket that would block parks the
+ * coroutine until epoll reports it ready, honouring the socket's
+ * SO_RCVTIMEO/SO_SNDTIMEO as the wait timeout. Outside of one they behave
+ * exactly like the originals, so the same code serves both modes.
+ *
+ * @author Taiming Liu <taimingl@andrew.cmu.edu>
+ */
+#ifndef PROXY_CORO_H
+#define PROXY_CORO_H
+
+#include "csapp.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h> /* size_t */
+#include <time.h>
+#include <ucontext.h>
+
+/*
+ * Stack of each coroutine, not counting its guard page. serve() keeps its
+ * request and the cached response on the heap, leaving some 42 KB as the
+ * deepest use measured with -fstack-usage (request headers, then an error
+ * page); getaddrinfo takes some 14 KB more, the rest is left for the
+ * resolver's other paths and for signal handlers.
+ */
+#define CORO_STACK_SIZE (128 * 1024)
+
+/* Stacks of finished coroutines each worker keeps for reuse */
+#define CORO_STACK_CACHE 64
+
+/* Events taken from epoll per wait */
+#define CORO_MAX_EVENTS 64
+
+/* Marks a coroutine that is not in its worker's timer heap */
+#define CORO_NO_TIMER ((size_t)-1)
+
+typedef void (*coro_fn)(void *arg);
+
+typedef enum coro_state {
+    CORO_READY,   /* spawned, or woken and waiting to be resumed */
+    CORO_WAITING, /* parked until its fd is ready or its timeout passes */
+    CORO_DONE     /* returned, to be freed by its worker */
+} coro_state_t;
+
+/* A coroutine and what it is waiting for */
+typedef struct coro {
+    ucontext_t ctx;
+    coro_fn fn;
+    void *arg;
+    char *stack;          /* mapping with a guard page, NULL until started */
+    struct worker *owner; /* NULL until started, then never changes */
+    coro_state_t state;
+    int wait_fd;          /* fd the coroutine is parked on */
+    long long deadline;   /* monotonic ms when the wait times out */
+    size_t timer;         /* index in the owner's timer heap */
+    bool timed_out;       /* the last wait ended by timeout */
+    struct coro *next;    /* link in a run queue */
+} coro_t;
+
+/* A worker thread, its run queues and its epoll instance */
+typedef struct worker {
+    int cpu;    /* core the worker is pinned to */
+    int epfd;   /* epoll for the fds of its coroutines */
+    int wakefd; /* eventfd to wake it from epoll_wait */
+    ucontext_t sched_ctx;
+    pthread_mutex_t mutex; /* protects the fresh queue and sleeping */
+    coro_t *fresh_head;    /* spawned but not started, may be stolen */
+    coro_t *fresh_tail;
+    coro_t *ready_head; /* woken, only touched by the worker itself */
+    coro_t *ready_tail;
+    bool sleeping;   /* blocked in epoll_wait with nothing to run */
+    coro_t **timers; /* min-heap of waiting coroutines by deadline */
+    size_t ntimers;
+    size_t timers_cap;
+    char *stacks[CORO_STACK_CACHE]; /* stacks of finished coroutines */
+    unsigned int nstacks;
+} worker_t;
+
+/* Starts nthreads workers, pinned round-robin to the online cores */
+void start_coros(int nthreads);
+
+/* Queues fn(arg) to run as a coroutine, returns false on failure */
+bool spawn_coro(coro_fn fn, void *arg);
+
+/* Returns true when called from inside a coroutine */
+bool in_coro(void);
+
+/* Yielding versions of the csapp robust I/O and client helpers */
+ssize_t coro_readn(int fd, void *usrbuf, size_t n);
+ssize_t coro_writen(int fd, const void *usrbuf, size_t n);
+ssize_t coro_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t coro_readlineb_until(rio_t *rp, void *usrbuf, size_t maxlen,
+                             const struct timespec *deadline);
+int coro_open_clientfd(const char *hostname, const char *port, long timeout,
+                       long long *resolved);
+
+#endif /* PROXY_CORO_H */
@@ -0,0 +1,184 @@
+/**
+ * @file proxy_health.c
+ * @brief Per-origin circuit breaker for the proxy
+ *
+ * Origins are kept in a small open-addressing table keyed by "host:port".
+ * An origin only gets a slot after its first failure, and gives it up on
+ * its next success, so healthy servers cost nothing. When the table is
+ * full, the origin that has gone longest without news makes room, so that
+ * a flood of bogus hosts cannot leave real ones untracked.
+ *
+ * After `threshold` consecutive failures the breaker opens and requests
+ * are rejected for `cooldown` seconds. After that a single probe request
+ * is let through (half-open): its success closes the breaker again, its
+ * failure re-opens it for another cooldown.
+ *
+ * @author Taiming Liu <taimingl@andrew.cmu.edu>
+ */
+#include "proxy_health.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * @brief Initializes the health table.
+ * @param[in] health pointer to the health table to be initialized.
+ * @param[in] threshold consecutive failures before the breaker opens.
+ * @param[in] cooldown seconds an open breaker rejects requests.
+ *
+ */
+void init_health(health_t *health, unsigned int threshold,
+                 unsigned int cooldown) {
+    memset(health->origins, 0, sizeof(health->origins));
+    health->threshold = threshold;
+    health->cooldown = cooldown;
+    pthread_mutex_init(&health->mutex, NULL);
+}
+
+/**
+ * @brief Private helper function returning the slot an origin hashes to.
+ */
+static size_t home_slot(const char *key) {
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a
+    for (const char *c = key; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+    }
+    return hash % HEALTH_MAX_ORIGINS;
+}
+
+/**
+ * @brief Private helper function freeing the slot of an origin.
+ * @param[in] health pointer to the health table.
+ * @param[in] oh slot to free.
+ *
+ * Origins probed past the slot are shifted back into it, so that lookups,
+ * which stop at the first empty slot, still find them.
+ */
+static void remove_origin(health_t *health, origin_health_t *oh) {
+    size_t hole = (size_t)(oh - health->origins);
+    size_t next = hole;
+    health->origins[hole].key[0] = '\0';
+    while (1) {
+        next = (next + 1) % HEALTH_MAX_ORIGINS;
+        origin_health_t *moved = &health->origins[next];
+        if (moved->key[0] == '\0') {
+            return;
+        }
+        // an origin may move into the hole unless its home slot lies
+        // after the hole, up to where it sits
+        size_t home = home_slot(moved->key);
+        bool stays = hole < next ? hole < home && home <= next
+                                 : hole < home || home <= next;
+        if (!stays) {
+            health->origins[hole] = *moved;
+            moved->key[0] = '\0';
+            hole = next;
+        }
+    }
+}
+
+/**
+ * @brief Private helper function to find the slot of an origin.
+ * @param[in] health pointer to the health table.
+ * @param[in] key "host:port" of the origin.
+ * @param[in] create whether to claim a slot if origin is not found.
+ *
+ * A full table gives up the slot of the origin changed longest ago.
+ * Returns NULL if the origin is not tracked and create is false.
+ */
+static origin_health_t *find_origin(health_t *health, const char *key,
+                                    bool create) {
+    size_t home = home_slot(key);
+    origin_health_t *stalest = NULL;
+    for (size_t i = 0; i < HEALTH_MAX_ORIGINS; i++) {
+        origin_health_t *oh = &health->origins[(home + i) % HEALTH_MAX_ORIGINS];
+        if (oh->key[0] == '\0') {
+            if (!create) {
+                return NULL;
+            }
+            strncpy(oh->key, key, HEALTH_KEYLEN - 1);
+            oh->state = BREAKER_CLOSED;
+            oh->failures = 0;
+            clock_gettime(CLOCK_MONOTONIC, &oh->changed);
+            return oh;
+        }
+        if (!strncmp(oh->key, key, HEALTH_KEYLEN - 1)) {
+            return oh;
+        }
+        if (stalest == NULL ||
+            oh->changed.tv_sec < stalest->changed.tv_sec ||
+            (oh->changed.tv_sec == stalest->changed.tv_sec &&
+             oh->changed.tv_nsec < stalest->changed.tv_nsec)) {
+            stalest = oh;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    remove_origin(health, stalest);
+    return find_origin(health, key, true);
+}
+
+/**
+ * @brief Private helper function returning seconds elapsed since `then`.
+ */
+static time_t elapsed_since(const struct timespec *then) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec - then->tv_sec;
+}
+
+/**
+ * @brief Decides whether a request to the origin should be attempted.
+ * @param[in] health pointer to the health table.
+ * @param[in] origin "host:port" of the origin.
+ *
+ * An open breaker whose cooldown has passed turns half-open and lets the
+ * caller through as the probe. While a probe is outstanding, other requests
+ * are rejected; a probe that never reports back is replaced after another
+ * cooldown so the origin cannot get stuck half-open.
+ */
+bool check_origin(health_t *health, const char *origin) {
+    bool allowed = true;
+
+    pthread_mutex_lock(&health->mutex);
+    origin_health_t *oh = find_origin(health, origin, false);
+    if (oh != NULL && oh->state != BREAKER_CLOSED) {
+        if (elapsed_since(&oh->changed) >= (time_t)health->cooldown) {
+            oh->state = BREAKER_HALF_OPEN;
+            clock_gettime(CLOCK_MONOTONIC, &oh->changed);
+        } else {
+            allowed = false;
+        }
+    }
+    pthread_mutex_unlock(&health->mutex);
+    return allowed;
+}
+
+/**
+ * @brief Records the outcome of a request to the origin.
+ * @param[in] health pointer to the health table.
+ * @param[in] origin "host:port" of the origin.
+ * @param[in] success whether the origin produced a response.
+ *
+ */
+void report_origin(health_t *health, const char *origin, bool success) {
+    pthread_mutex_lock(&health->mutex);
+    origin_health_t *oh = find_origin(health, origin, !success);
+    if (oh != NULL) {
+        if (success) {
+            // closed with no failures, as an untracked origin is
+            remove_origin(health, oh);
+        } else {
+            oh->failures++;
+            if (oh->state == BREAKER_HALF_OPEN ||
+                oh->failures >= health->threshold) {
+                oh->state = BREAKER_OPEN;
+            }
+            clock_gettime(CLOCK_MONOTONIC, &oh->changed);
+        }
+    }
+    pthread_mutex_unlock(&health->mutex);
+}
@@ -0,0 +1,60 @@
+/**
+ * @file proxy_health.h
+ * @brief Prototypes and definitions for proxy_health.c
+ *
+ * Per-origin (host:port) health tracking with a circuit breaker, so that a
+ * dead web server is answered right away instead of tying up a thread in
+ * open_clientfd for every request sent to it.
+ *
+ * @author Taiming Liu <taimingl@andrew.cmu.edu>
+ */
+#ifndef PROXY_HEALTH_H
+#define PROXY_HEALTH_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h> /* size_t */
+#include <time.h>
+
+/* Max number of origins tracked, and max length of a host:port key */
+#define HEALTH_MAX_ORIGINS 256
+#define HEALTH_KEYLEN 272
+
+/* Default breaker settings */
+#define HEALTH_DEF_THRESHOLD 5
+#define HEALTH_DEF_COOLDOWN 10
+
+/* Circuit breaker state of a single origin */
+typedef enum breaker_state {
+    BREAKER_CLOSED,   /* healthy, requests go through */
+    BREAKER_OPEN,     /* failing, requests are rejected until cooldown */
+    BREAKER_HALF_OPEN /* cooldown over, a single probe is let through */
+} breaker_state_t;
+
+/* Health record of a single origin */
+typedef struct origin_health {
+    char key[HEALTH_KEYLEN]; /* "host:port", empty when slot is unused */
+    breaker_state_t state;
+    unsigned int failures;   /* consecutive failures */
+    struct timespec changed; /* last failure, open or probe */
+} origin_health_t;
+
+/* Health table for all origins the proxy has failed to reach */
+typedef struct health {
+    unsigned int threshold; /* consecutive failures that open a breaker */
+    unsigned int cooldown;  /* seconds an open breaker rejects requests */
+    pthread_mutex_t mutex;
+    origin_health_t origins[HEALTH_MAX_ORIGINS];
+} health_t;
+
+/* Initializes the health table with the given breaker settings */
+void init_health(health_t *health, unsigned int threshold,
+                 unsigned int cooldown);
+
+/* Returns false if requests to origin should be short-circuited */
+bool check_origin(health_t *health, const char *origin);
+
+/* Records the outcome of a request that check_origin let through */
+void report_origin(health_t *health, const char *origin, bool success);
+
+#endif /* PROXY_HEALTH_H */
@@ -0,0 +1,298 @@
+/**
+ * @file proxy_log.c
+ * @brief Access log written off the request path
+ *
+ * Each thread queues its records in a ring of its own, which only it
+ * writes records into and only the writer thread takes them out of, so
+ * queueing a record is a copy and a store, with no lock and no system
+ * call. Like the blocks of proxy_stats.c, rings are never freed: a thread
+ * that exits leaves its ring to the next thread that starts, so the list
+ * of rings only grows and the writer can walk it without a lock.
+ *
+ * The writer wakes up every LOG_INTERVAL, formats what the rings hold
+ * and writes it out in pieces of at most PIPE_BUF bytes, each of whole
+ * lines, so that pre-forked workers sharing the log never interleave
+ * within a line. Client addresses are logged as numbers; the proxy does
+ * no reverse lookups.
+ *
+ * @author Taiming Liu <taimingl@andrew.cmu.edu>
+ */
+#include "proxy_log.h"
+#include "proxy_stats.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Records a ring holds, a power of two */
+#define LOG_RING_SLOTS 256
+
+/* Time the writer sleeps when the rings are empty, in ns */
+#define LOG_INTERVAL 10000000
+
+/* Longest line a record makes: the URI may triple when escaped */
+#define LOG_LINE_MAX (3 * LOG_URI_LEN + 256)
+
+/* Records queued by one thread, or by threads that held the ring before */
+typedef struct log_ring {
+    log_record_t slots[LOG_RING_SLOTS];
+    unsigned long tail __attribute__((aligned(64))); /* written by owner */
+    unsigned long head __attribute__((aligned(64))); /* written by writer */
+    bool in_use;           /* a thread queues records in the ring */
+    struct log_ring *next; /* next ring, never changes once set */
+} log_ring_t;
+
+/* Every ring ever made, newest first */
+static log_ring_t *rings = NULL;
+
+/* Ring of the calling thread, NULL until it first logs something */
+static __thread log_ring_t *thread_ring;
+
+/* Hands the rings of exiting threads back */
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+/* Where the log goes */
+static int log_fd = STDOUT_FILENO;
+
+/* Set once the writer runs, records are dropped before */
+static bool logging = false;
+
+/* Keeps flush_log and the writer from taking the same records */
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Private helper function giving a ring back when its thread exits.
+ */
+static void release_ring(void *ring) {
+    __atomic_store_n(&((log_ring_t *)ring)->in_use, false, __ATOMIC_RELEASE);
+}
+
+static void make_ring_key(void) {
+    pthread_key_create(&ring_key, release_ring);
+}
+
+/**
+ * @brief Private helper function returning the calling thread's ring.
+ *
+ * A thread takes over a ring left by an exited thread if there is one,
+ * and only otherwise allocates one. Returns NULL if that fails.
+ */
+static log_ring_t *get_ring(void) {
+    if (thread_ring != NULL) {
+        return thread_ring;
+    }
+    log_ring_t *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    for (; ring != NULL; ring = ring->next) {
+        bool in_use = false;
+        if (__atomic_compare_exchange_n(&ring->in_use, &in_use, true, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (ring == NULL) {
+        void *mem;
+        if (posix_memalign(&mem, 64, sizeof(log_ring_t)) != 0) {
+            return NULL;
+        }
+        ring = mem;
+        ring->head = 0;
+        ring->tail = 0;
+        ring->in_use = true;
+        ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, false,
+                                            __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED)) {
+        }
+    }
+    pthread_once(&ring_once, make_ring_key);
+    pthread_setspecific(ring_key, ring);
+    thread_ring = ring;
+    return ring;
+}
+
+/**
+ * @brief Private helper function writing a buffer out in full.
+ *
+ * What cannot be written is dropped; the log is not worth retrying for.
+ */
+static void write_out(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(log_fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+}
+
+/**
+ * @brief Private helper function formatting a record as a line.
+ * @param[in] record the record.
+ * @param[out] line room for LOG_LINE_MAX bytes.
+ *
+ * Quotes, backslashes, spaces and unprintable bytes in the URI are
+ * written as %XX, so that the line splits on spaces. Returns the length
+ * of the line.
+ */
+static size_t format_record(const log_record_t *record, char *line) {
+    static const char *cache_names[] = {
+        [LOG_NONE] = "-",
+        [LOG_HIT] = "hit",
+        [LOG_MISS] = "miss",
+        [LOG_BYPASS] = "bypass",
+    };
+    char addr[INET_ADDRSTRLEN];
+    if (inet_ntop(AF_INET, &record->client.sin_addr, addr, sizeof(addr)) ==
+        NULL) {
+        strcpy(addr, "-");
+    }
+
+    char uri[3 * LOG_URI_LEN];
+    size_t len = 0;
+    for (const char *c = record->uri; *c != '\0'; c++) {
+        unsigned char ch = (unsigned char)*c;
+        if (ch <= ' ' || ch >= 0x7f || ch == '"' || ch == '\\') {
+            len += sprintf(uri + len, "%%%02X", ch);
+        } else {
+            uri[len++] = (char)ch;
+        }
+    }
+    uri[len] = '\0';
+
+    int n = snprintf(
+        line, LOG_LINE_MAX,
+        "time=%lld.%03lld client=%s:%u uri=\"%s\" status=%d bytes=%zu "
+        "cache=%s upstream_us=%lld total_us=%lld\n",
+        record->time_ns / 1000000000, record->time_ns / 1000000 % 1000, addr,
+        (unsigned int)ntohs(record->client.sin_port), uri, record->status,
+        record->bytes, cache_names[record->cache], record->upstream_ns / 1000,
+        record->total_ns / 1000);
+    return n < LOG_LINE_MAX ? (size_t)n : LOG_LINE_MAX - 1;
+}
+
+/**
+ * @brief Private helper function writing out what the rings hold.
+ *
+ * Returns false if they held nothing.
+ */
+static bool drain_rings(void) {
+    char buf[PIPE_BUF];
+    char line[LOG_LINE_MAX];
+    size_t len = 0;
+    bool drained = false;
+
+    pthread_mutex_lock(&drain_mutex);
+    log_ring_t *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    for (; ring != NULL; ring = ring->next) {
+        unsigned long head = ring->head;
+        unsigned long tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++) {
+            size_t n =
+                format_record(&ring->slots[head % LOG_RING_SLOTS], line);
+            // the slot may be reused once head moves past it
+            __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+            if (len + n > sizeof(buf)) {
+                write_out(buf, len);
+                len = 0;
+            }
+            memcpy(buf + len, line, n);
+            len += n;
+            drained = true;
+        }
+    }
+    write_out(buf, len);
+    pthread_mutex_unlock(&drain_mutex);
+    return drained;
+}
+
+/**
+ * @brief Private helper function running the writer thread.
+ */
+static void *log_writer(void *vargp) {
+    struct timespec interval = {0, LOG_INTERVAL};
+    pthread_detach(pthread_self());
+    while (1) {
+        if (!drain_rings()) {
+            nanosleep(&interval, NULL);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Opens the access log.
+ * @param[in] path file to append to, or NULL for stdout.
+ *
+ * Returns false if the file cannot be opened.
+ */
+bool init_log(const char *path) {
+    if (path == NULL) {
+        log_fd = STDOUT_FILENO;
+        return true;
+    }
+    log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    return log_fd >= 0;
+}
+
+/**
+ * @brief Starts the writer thread in the calling process.
+ *
+ */
+void start_log(void) {
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, log_writer, NULL) != 0) {
+        perror("Error creating log writer thread");
+        return;
+    }
+    __atomic_store_n(&logging, true, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Queues a record for the access log.
+ * @param[in] record the record; its time is set here.
+ *
+ * Only copies the record into the calling thread's ring. If the ring is
+ * full, the writer has fallen behind and the record is dropped.
+ */
+void log_access(const log_record_t *record) {
+    if (!__atomic_load_n(&logging, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    log_ring_t *ring = get_ring();
+    unsigned long tail = ring != NULL ? ring->tail : 0;
+    if (ring == NULL ||
+        tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+            LOG_RING_SLOTS) {
+        stats_inc(STAT_LOG_DROPPED);
+        return;
+    }
+
+    log_record_t *slot = &ring->slots[tail % LOG_RING_SLOTS];
+    struct timespec now;
+    *slot = *record;
+    clock_gettime(CLOCK_REALTIME, &now);
+    slot->time_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Writes out every record queued so far.
+ *
+ */
+void flush_log(void) {
+    if (__atomic_load_n(&logging, __ATOMIC_ACQUIRE)) {
+        drain_rings();
+    }
+}
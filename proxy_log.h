@@ -0,0 +1,55 @@
+/**
+ * @file proxy_log.h
+ * @brief Prototypes and definitions for proxy_log.c
+ *
+ * An access log with one line per request. The thread serving a request
+ * only copies a record into a ring of its own; a writer thread formats the
+ * records and writes them out in batches, so that a request never waits
+ * for the log file, a lock, or a name lookup. When a ring is full, records
+ * are dropped and counted rather than held up.
+ *
+ * @author Taiming Liu <taimingl@andrew.cmu.edu>
+ */
+#ifndef PROXY_LOG_H
+#define PROXY_LOG_H
+
+#include <netinet/in.h> /* struct sockaddr_in */
+#include <stdbool.h>
+#include <stddef.h> /* size_t */
+
+/* Bytes of a URI kept in a record, the rest is cut off */
+#define LOG_URI_LEN 192
+
+/* How a request went as far as the cache goes */
+typedef enum log_cache {
+    LOG_NONE,   /* never looked up: an error, or the status page */
+    LOG_HIT,    /* answered from the cache */
+    LOG_MISS,   /* fetched from the web server, and cached */
+    LOG_BYPASS, /* fetched from the web server, but could not be cached */
+} log_cache_t;
+
+/* What the access log says about one request */
+typedef struct log_record {
+    long long time_ns;         /* realtime ns it was logged at */
+    long long upstream_ns;     /* connecting to and relaying from the origin */
+    long long total_ns;        /* the whole request, from accepting it */
+    size_t bytes;              /* response bytes sent to the client */
+    struct sockaddr_in client; /* address of the client */
+    int status;                /* HTTP status of the response, 0 if none */
+    log_cache_t cache;         /* hit, miss or bypass */
+    char uri[LOG_URI_LEN];     /* requested URI, NUL-terminated */
+} log_record_t;
+
+/* Opens the access log at path, or uses stdout if path is NULL */
+bool init_log(const char *path);
+
+/* Starts the writer thread; records are dropped until it runs */
+void start_log(void);
+
+/* Queues a record for the access log, stamping it with the time */
+void log_access(const log_record_t *record);
+
+/* Writes out every queued record, before exiting */
+void flush_log(void);
+
+#endif /* PROXY_LOG_H */
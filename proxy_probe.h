@@ -0,0 +1,97 @@
+/**
+ * @file proxy_probe.h
+ * @brief USDT probes at the hot points of the proxy and its cache
+ *
+ * A probe is a nop in the code plus an ELF note telling perf, bpftrace or
+ * systemtap where the nop is and where to find the probe's arguments, in
+ * the format <sys/sdt.h> uses; that header is not installed everywhere the
+ * proxy is built, so the note is written out here. Until a tool attaches,
+ * a probe costs the nop and having its arguments at hand; attaching turns
+ * the nop into a breakpoint. Arguments are signed 64-bit: numbers, or
+ * pointers to strings such as cache keys. For example
+ *
+ *   bpftrace -e 'usdt:./proxy:proxy:cache_hit { @[str(arg0)] = count(); }'
+ *
+ * The probes, all under the provider "proxy":
+ *
+ *   request_start(fd)
+ *   request_end(fd, uri, status, bytes, ns)  ns: since it was accepted
+ *   cache_hit(key, size, hot)                hot: 1 if from the hot table
+ *   cache_miss(key)
+ *   cache_insert(key, size, shared)          shared: 1 if bytes were cached
+ *   cache_evict(key, size)
+ *   upstream_connect_start(host, port)
+ *   upstream_connect_end(host, port, fd)     fd: < 0 if connecting failed
+ *   upstream_first_byte(uri, bytes)          bytes: in the first chunk
+ *
+ * Build with -DNO_PROBES to leave them out altogether.
+ *
+ * @author Taiming Liu <taimingl@andrew.cmu.edu>
+ */
+#ifndef PROXY_PROBE_H
+#define PROXY_PROBE_H
+
+#include <stdint.h>
+
+#if !defined(NO_PROBES) && defined(__GNUC__) &&                                \
+    (defined(__x86_64__) || defined(__aarch64__))
+
+/* Operand for argument i; "-8@" in the note says signed 64-bit */
+#define PROBE_ARG(i, x) [_probe_a##i] "nor"((int64_t)(x))
+#define PROBE_FMT(i) "-8@%[_probe_a" #i "]"
+
+/* The nop, and a version 3 stapsdt note pointing at it. The note is
+ * relative to _.stapsdt.base, so tools can find the nop once the binary
+ * is relocated. */
+#define PROBE_ASM(name, args, ...)                                             \
+    __asm__ __volatile__(                                                      \
+        "990: nop\n"                                                           \
+        ".pushsection .note.stapsdt,\"?\",\"note\"\n"                          \
+        ".balign 4\n"                                                          \
+        ".4byte 992f-991f, 994f-993f, 3\n"                                     \
+        "991: .asciz \"stapsdt\"\n"                                            \
+        "992: .balign 4\n"                                                     \
+        "993: .8byte 990b\n"                                                   \
+        ".8byte _.stapsdt.base\n"                                              \
+        ".8byte 0\n"                                                           \
+        ".asciz \"proxy\"\n"                                                   \
+        ".asciz \"" #name "\"\n"                                               \
+        ".asciz \"" args "\"\n"                                                \
+        "994: .balign 4\n"                                                     \
+        ".popsection\n"                                                        \
+        ".ifndef _.stapsdt.base\n"                                             \
+        ".pushsection .stapsdt.base,\"aG\",\"progbits\","                      \
+        ".stapsdt.base,comdat\n"                                               \
+        ".weak _.stapsdt.base\n"                                               \
+        ".hidden _.stapsdt.base\n"                                             \
+        "_.stapsdt.base: .space 1\n"                                           \
+        ".size _.stapsdt.base, 1\n"                                            \
+        ".popsection\n"                                                        \
+        ".endif\n"                                                             \
+        :                                                                      \
+        : __VA_ARGS__)
+
+#define PROBE1(name, a0) PROBE_ASM(name, PROBE_FMT(0), PROBE_ARG(0, a0))
+#define PROBE2(name, a0, a1)                                                   \
+    PROBE_ASM(name, PROBE_FMT(0) " " PROBE_FMT(1), PROBE_ARG(0, a0),           \
+              PROBE_ARG(1, a1))
+#define PROBE3(name, a0, a1, a2)                                               \
+    PROBE_ASM(name, PROBE_FMT(0) " " PROBE_FMT(1) " " PROBE_FMT(2),            \
+              PROBE_ARG(0, a0), PROBE_ARG(1, a1), PROBE_ARG(2, a2))
+#define PROBE5(name, a0, a1, a2, a3, a4)                                       \
+    PROBE_ASM(name,                                                            \
+              PROBE_FMT(0) " " PROBE_FMT(1) " " PROBE_FMT(2) " " PROBE_FMT(3)  \
+                           " " PROBE_FMT(4),                                   \
+              PROBE_ARG(0, a0), PROBE_ARG(1, a1), PROBE_ARG(2, a2),            \
+              PROBE_ARG(3, a3), PROBE_ARG(4, a4))
+
+#else
+
+#define PROBE1(name, a0) ((void)0)
+#define PROBE2(name, a0, a1) ((void)0)
+#define PROBE3(name, a0, a1, a2) ((void)0)
+#define PROBE5(name, a0, a1, a2, a3, a4) ((void)0)
+
+#endif
+
+#endif /* PROXY_PROBE_H */
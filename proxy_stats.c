@@ -0,0 +1,300 @@
+/**
+ * @file proxy_stats.c
+ * @brief Event counters and latency histograms for the proxy
+ *
+ * Each thread counts into a block of its own, a few cache lines no other
+ * thread writes, so that counting on the hot path never bounces a line
+ * between cores. Reading a counter sums it over every block. Blocks are
+ * never freed: a thread that exits leaves its counts in its block, and a
+ * new thread takes the block over and counts on. The list of blocks thus
+ * only grows, and can be walked without a lock, even from a signal
+ * handler.
+ *
+ * @author Taiming Liu <taimingl@andrew.cmu.edu>
+ */
+#include "proxy_stats.h"
+#include "csapp.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Printable names of the counters, in stat_counter_t order */
+static const char *stat_names[NUM_STATS] = {
+    [STAT_TIMEOUT_HEADER] = "timeout_header",
+    [STAT_TIMEOUT_UPSTREAM] = "timeout_upstream",
+    [STAT_TIMEOUT_WRITE] = "timeout_write",
+    [STAT_CONNS_ACCEPTED] = "conns_accepted",
+    [STAT_ACCEPT_THROTTLED] = "accept_throttled",
+    [STAT_SHED_MISS] = "shed_miss",
+    [STAT_MISS_QUEUED] = "miss_queued",
+    [STAT_EARLY_HIT] = "early_hit",
+    [STAT_REQUESTS] = "requests",
+    [STAT_HITS] = "hits",
+    [STAT_MISSES] = "misses",
+    [STAT_BYPASS] = "bypass",
+    [STAT_BYTES_CACHE] = "bytes_cache",
+    [STAT_BYTES_ORIGIN] = "bytes_origin",
+    [STAT_LOG_DROPPED] = "log_dropped",
+    [STAT_TRACE_DROPPED] = "trace_dropped",
+    [STAT_CONNS_ACTIVE] = "conns_active",
+    [STAT_FETCHES_ACTIVE] = "fetches_active",
+    [STAT_MISSES_WAITING] = "misses_waiting",
+};
+
+/* Printable names of the histograms, in stat_hist_t order */
+static const char *hist_names[NUM_HISTS] = {
+    [HIST_HEADER] = "header",   [HIST_LOOKUP] = "lookup",
+    [HIST_CONNECT] = "connect", [HIST_ORIGIN] = "origin",
+    [HIST_TOTAL] = "total",     [HIST_CACHE_LOCK] = "cache_lock",
+};
+
+/* Counts of one thread, or of threads that held the block before it */
+typedef struct stats_block {
+    unsigned long counters[NUM_STATS];
+    unsigned long buckets[NUM_HISTS][STATS_HIST_BUCKETS];
+    unsigned long sums[NUM_HISTS]; /* total of the times, in us */
+    bool in_use;                   /* a thread counts into the block */
+    struct stats_block *next;      /* next block, never changes once set */
+} __attribute__((aligned(64))) stats_block_t;
+
+/* Block for the few counts made when no block could be allocated */
+static stats_block_t spare_block;
+
+/* Every block ever made, newest first */
+static stats_block_t *blocks = &spare_block;
+
+/* Block of the calling thread, NULL until it first counts something */
+static __thread stats_block_t *thread_block;
+
+/* Hands the blocks of exiting threads back */
+static pthread_key_t block_key;
+static pthread_once_t block_once = PTHREAD_ONCE_INIT;
+
+/* Monotonic ns the proxy started at */
+static long long start_ns;
+
+/**
+ * @brief Private helper function giving a block back when its thread exits.
+ */
+static void release_block(void *block) {
+    __atomic_store_n(&((stats_block_t *)block)->in_use, false,
+                     __ATOMIC_RELEASE);
+}
+
+static void make_block_key(void) {
+    pthread_key_create(&block_key, release_block);
+}
+
+/**
+ * @brief Private helper function returning the calling thread's block.
+ *
+ * A thread takes over a block left by an exited thread if there is one,
+ * and only otherwise allocates one.
+ */
+static stats_block_t *get_block(void) {
+    if (thread_block != NULL) {
+        return thread_block;
+    }
+    stats_block_t *block = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE);
+    for (; block != NULL; block = block->next) {
+        bool in_use = false;
+        if (block != &spare_block &&
+            __atomic_compare_exchange_n(&block->in_use, &in_use, true, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (block == NULL) {
+        void *mem;
+        if (posix_memalign(&mem, 64, sizeof(stats_block_t)) != 0) {
+            return &spare_block; // shared, so counts there may get lost
+        }
+        block = mem;
+        memset(block, 0, sizeof(*block));
+        block->in_use = true;
+        block->next = __atomic_load_n(&blocks, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&blocks, &block->next, block,
+                                            false, __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED)) {
+        }
+    }
+    pthread_once(&block_once, make_block_key);
+    pthread_setspecific(block_key, block);
+    thread_block = block;
+    return block;
+}
+
+/**
+ * @brief Private helper function adding to a count of the calling thread.
+ *
+ * Only the owning thread writes a block, so a plain load and store will
+ * do, without the locked instruction an atomic add would take; they are
+ * atomic only so that readers see whole values.
+ */
+static void add_count(unsigned long *count, unsigned long delta) {
+    __atomic_store_n(count, __atomic_load_n(count, __ATOMIC_RELAXED) + delta,
+                     __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Notes the time the proxy started at.
+ *
+ */
+void init_stats(void) {
+    start_ns = stats_clock();
+}
+
+/**
+ * @brief Adds one to a counter.
+ * @param[in] stat the counter to increment.
+ *
+ */
+void stats_inc(stat_counter_t stat) {
+    add_count(&get_block()->counters[stat], 1);
+}
+
+/**
+ * @brief Adds to a counter or gauge.
+ * @param[in] stat the counter to update.
+ * @param[in] delta amount to add, negative to decrease a gauge.
+ *
+ * A gauge may go up in one thread and down in another; the counts of
+ * either thread wrap around, but their sum is right.
+ */
+void stats_add(stat_counter_t stat, long delta) {
+    add_count(&get_block()->counters[stat], (unsigned long)delta);
+}
+
+/**
+ * @brief Returns the current value of a counter, summed over all threads.
+ * @param[in] stat the counter to read.
+ *
+ */
+unsigned long stats_get(stat_counter_t stat) {
+    unsigned long sum = 0;
+    stats_block_t *block = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE);
+    for (; block != NULL; block = block->next) {
+        sum += __atomic_load_n(&block->counters[stat], __ATOMIC_RELAXED);
+    }
+    return sum;
+}
+
+/**
+ * @brief Returns the monotonic time in ns.
+ *
+ */
+long long stats_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * @brief Adds a time to a histogram.
+ * @param[in] hist the histogram.
+ * @param[in] ns the time taken, in ns.
+ *
+ */
+void stats_time(stat_hist_t hist, long long ns) {
+    stats_block_t *block = get_block();
+    unsigned long long us = ns > 0 ? (unsigned long long)ns / 1000 : 0;
+    int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    if (bucket >= STATS_HIST_BUCKETS) {
+        bucket = STATS_HIST_BUCKETS - 1;
+    }
+    add_count(&block->buckets[hist][bucket], 1);
+    add_count(&block->sums[hist], us);
+}
+
+/**
+ * @brief Returns the total of a histogram's times added by the calling
+ *        thread, in us.
+ * @param[in] hist the histogram.
+ *
+ * Includes times of threads that held the thread's block before it;
+ * meant for the difference across a call, such as the time a request
+ * waited for locks.
+ */
+unsigned long stats_thread_sum(stat_hist_t hist) {
+    return __atomic_load_n(&get_block()->sums[hist], __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Writes a line to a report.
+ * @param[in] out where the report goes.
+ * @param[in] fmt printf format, limited to what sio_printf takes.
+ *
+ * Only uses sio when writing to a file descriptor, so that a report can
+ * be written from a signal handler.
+ */
+void stats_printf(stats_out_t *out, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    if (out->fd >= 0) {
+        sio_vdprintf(out->fd, fmt, ap);
+    } else if (out->len + 1 < out->size) {
+        int n = vsnprintf(out->buf + out->len, out->size - out->len, fmt, ap);
+        if (n > 0) {
+            out->len += (size_t)n < out->size - out->len
+                            ? (size_t)n
+                            : out->size - out->len - 1;
+        }
+    }
+    va_end(ap);
+}
+
+/**
+ * @brief Writes all counters and histograms to a report.
+ * @param[in] out where the report goes.
+ *
+ * Counters and gauges are "name value" lines. Each histogram gives its
+ * count, its total in us, and the count of every bucket that is not
+ * empty, as latency_<name>_us_lt_<bound>; bounds are in us. Safe to call
+ * from a signal handler when writing to a file descriptor.
+ */
+void report_stats(stats_out_t *out) {
+    unsigned long uptime_ms = (unsigned long)(stats_clock() - start_ns) /
+                              1000000;
+    stats_printf(out, "uptime_ms %lu\n", uptime_ms);
+    for (int i = 0; i < NUM_STATS; i++) {
+        stats_printf(out, "%s %lu\n", stat_names[i], stats_get(i));
+    }
+    stats_printf(out, "requests_per_sec %lu\n",
+                 uptime_ms > 0 ? stats_get(STAT_REQUESTS) * 1000 / uptime_ms
+                               : 0);
+
+    for (int h = 0; h < NUM_HISTS; h++) {
+        unsigned long buckets[STATS_HIST_BUCKETS] = {0};
+        unsigned long count = 0;
+        unsigned long sum = 0;
+        stats_block_t *block = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE);
+        for (; block != NULL; block = block->next) {
+            for (int b = 0; b < STATS_HIST_BUCKETS; b++) {
+                unsigned long n =
+                    __atomic_load_n(&block->buckets[h][b], __ATOMIC_RELAXED);
+                buckets[b] += n;
+                count += n;
+            }
+            sum += __atomic_load_n(&block->sums[h], __ATOMIC_RELAXED);
+        }
+        stats_printf(out, "latency_%s_count %lu\n", hist_names[h], count);
+        stats_printf(out, "latency_%s_sum_us %lu\n", hist_names[h], sum);
+        for (int b = 0; b < STATS_HIST_BUCKETS; b++) {
+            if (buckets[b] == 0) {
+                continue;
+            }
+            if (b == STATS_HIST_BUCKETS - 1) {
+                stats_printf(out, "latency_%s_us_lt_inf %lu\n", hist_names[h],
+                             buckets[b]);
+            } else {
+                stats_printf(out, "latency_%s_us_lt_%lu %lu\n", hist_names[h],
+                             1UL << b, buckets[b]);
+            }
+        }
+    }
+}
@@ -0,0 +1,93 @@
+/**
+ * @file proxy_stats.h
+ * @brief Prototypes and definitions for proxy_stats.c
+ *
+ * Process-wide event counters, gauges and latency histograms for the
+ * proxy. Counters only ever go up; gauges go up and down with the work in
+ * progress. Every thread updates counters of its own, so that counting
+ * adds no contention; a report sums them up.
+ *
+ * @author Taiming Liu <taimingl@andrew.cmu.edu>
+ */
+#ifndef PROXY_STATS_H
+#define PROXY_STATS_H
+
+#include <stdbool.h>
+#include <stddef.h> /* size_t */
+
+/* Buckets of a histogram: bucket i counts times under 2^i us, the last
+ * one everything longer */
+#define STATS_HIST_BUCKETS 26
+
+/* Counters and gauges kept by the proxy */
+typedef enum stat_counter {
+    STAT_TIMEOUT_HEADER,   /* client did not send its request in time */
+    STAT_TIMEOUT_UPSTREAM, /* web server did not respond in time */
+    STAT_TIMEOUT_WRITE,    /* client did not take the response in time */
+    STAT_CONNS_ACCEPTED,   /* client connections accepted */
+    STAT_ACCEPT_THROTTLED, /* times accepting paused at the connection limit */
+    STAT_SHED_MISS,        /* cache misses refused at the fetch limit */
+    STAT_MISS_QUEUED,      /* cache misses that waited for a fetch slot */
+    STAT_EARLY_HIT,        /* hits answered before reading request headers */
+    STAT_REQUESTS,         /* well-formed GET requests */
+    STAT_HITS,             /* requests answered from the cache */
+    STAT_MISSES,           /* requests not found in the cache */
+    STAT_BYPASS,           /* misses whose response could not be cached */
+    STAT_BYTES_CACHE,      /* response bytes sent from the cache */
+    STAT_BYTES_ORIGIN,     /* response bytes relayed from web servers */
+    STAT_LOG_DROPPED,      /* access log records dropped, the log was behind */
+    STAT_TRACE_DROPPED,    /* trace records dropped, the file was behind */
+    STAT_CONNS_ACTIVE,     /* gauge: connections being served */
+    STAT_FETCHES_ACTIVE,   /* gauge: fetches to web servers in flight */
+    STAT_MISSES_WAITING,   /* gauge: cache misses waiting for a fetch slot */
+    NUM_STATS
+} stat_counter_t;
+
+/* Latency histograms kept by the proxy */
+typedef enum stat_hist {
+    HIST_HEADER,     /* reading the request head */
+    HIST_LOOKUP,     /* looking the request up in the cache */
+    HIST_CONNECT,    /* connecting and sending the request to a web server */
+    HIST_ORIGIN,     /* relaying the response from a web server */
+    HIST_TOTAL,      /* the whole request, from its first byte */
+    HIST_CACHE_LOCK, /* waiting for the cache lock, when it was taken */
+    NUM_HISTS
+} stat_hist_t;
+
+/* Where a report goes: a file descriptor, or a buffer when fd is -1 */
+typedef struct stats_out {
+    int fd;      /* written with sio, so safe in a signal handler */
+    char *buf;   /* NUL-terminated, cut short if too small */
+    size_t size; /* bytes in buf */
+    size_t len;  /* bytes written to buf so far */
+} stats_out_t;
+
+/* Notes the time the proxy started, for rates */
+void init_stats(void);
+
+/* Adds one to a counter */
+void stats_inc(stat_counter_t stat);
+
+/* Adds delta (which may be negative, for gauges) to a counter */
+void stats_add(stat_counter_t stat, long delta);
+
+/* Returns the current value of a counter, summed over all threads */
+unsigned long stats_get(stat_counter_t stat);
+
+/* Returns the monotonic time in ns, to time things with */
+long long stats_clock(void);
+
+/* Adds a time in ns to a histogram */
+void stats_time(stat_hist_t hist, long long ns);
+
+/* Returns the total in us of the times the calling thread added */
+unsigned long stats_thread_sum(stat_hist_t hist);
+
+/* Writes a "name value" line to a report */
+void stats_printf(stats_out_t *out, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+/* Writes all counters and histograms to a report */
+void report_stats(stats_out_t *out);
+
+#endif /* PROXY_STATS_H */
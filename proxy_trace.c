@@ -0,0 +1,189 @@
+/**
+ * @file proxy_trace.c
+ * @brief Sampled per-request tracing into a binary file
+ *
+ * Records of finished requests are queued in one buffer under a mutex.
+ * Sampling keeps the traced requests few enough that the lock is seldom
+ * contended; a writer thread empties the buffer every TRACE_INTERVAL, and
+ * records that find it full are dropped. Each batch goes out in one write
+ * to a file opened for appending, so pre-forked workers can share it.
+ *
+ * @author Taiming Liu <taimingl@andrew.cmu.edu>
+ */
+#include "proxy_trace.h"
+#include "proxy_stats.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Records queued at most between two writes */
+#define TRACE_BUF_RECORDS 256
+
+/* Time between writes, in ns */
+#define TRACE_INTERVAL 100000000
+
+/* Trace file, -1 when not tracing */
+static int trace_fd = -1;
+
+/* One request in this many is traced */
+static unsigned int trace_rate = 0;
+
+/* Records waiting for the writer */
+static struct {
+    pthread_mutex_t mutex;
+    trace_record_t records[TRACE_BUF_RECORDS];
+    unsigned int count;
+} queue = {.mutex = PTHREAD_MUTEX_INITIALIZER};
+
+/**
+ * @brief Private helper function writing out the queued records.
+ *
+ * The records are copied out under the lock and written after, so that
+ * requests do not wait for the file.
+ */
+static void write_queue(void) {
+    static trace_record_t batch[TRACE_BUF_RECORDS];
+    static pthread_mutex_t batch_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+    pthread_mutex_lock(&batch_mutex);
+    pthread_mutex_lock(&queue.mutex);
+    unsigned int count = queue.count;
+    memcpy(batch, queue.records, count * sizeof(trace_record_t));
+    queue.count = 0;
+    pthread_mutex_unlock(&queue.mutex);
+
+    size_t len = count * sizeof(trace_record_t);
+    if (len > 0 && write(trace_fd, batch, len) != (ssize_t)len) {
+        perror("Error writing trace file");
+    }
+    pthread_mutex_unlock(&batch_mutex);
+}
+
+/**
+ * @brief Private helper function running the writer thread.
+ */
+static void *trace_writer(void *vargp) {
+    struct timespec interval = {0, TRACE_INTERVAL};
+    pthread_detach(pthread_self());
+    while (1) {
+        nanosleep(&interval, NULL);
+        write_queue();
+    }
+    return NULL;
+}
+
+/**
+ * @brief Opens the trace file.
+ * @param[in] path file to append records to.
+ * @param[in] rate trace one request in rate, or none if 0.
+ *
+ * A new or empty file gets a header first. Returns false if the file
+ * cannot be opened, or holds records of another version.
+ */
+bool init_trace(const char *path, unsigned int rate) {
+    if (rate == 0) {
+        return true;
+    }
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        return false;
+    }
+
+    trace_header_t header;
+    memset(&header, 0, sizeof(header));
+    if (st.st_size == 0) {
+        memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+        header.version = TRACE_VERSION;
+        header.record_size = sizeof(trace_record_t);
+        if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+            close(fd);
+            return false;
+        }
+    } else if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+               memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+               header.version != TRACE_VERSION ||
+               header.record_size != sizeof(trace_record_t)) {
+        close(fd);
+        return false;
+    }
+    trace_fd = fd;
+    trace_rate = rate;
+    return true;
+}
+
+/**
+ * @brief Starts the writer thread in the calling process.
+ *
+ */
+void start_trace(void) {
+    pthread_t tid;
+    if (trace_fd >= 0 &&
+        pthread_create(&tid, NULL, trace_writer, NULL) != 0) {
+        perror("Error creating trace writer thread");
+        trace_rate = 0;
+    }
+}
+
+/**
+ * @brief Tells whether to trace a request.
+ * @param[in] start_ns monotonic ns the request was accepted at.
+ *
+ * Hashes the time rather than counting requests, so that threads need
+ * share nothing to agree on a rate.
+ */
+bool trace_sampled(long long start_ns) {
+    if (trace_rate == 0) {
+        return false;
+    }
+    uint64_t hash = (uint64_t)start_ns * 0x9e3779b97f4a7c15ULL;
+    return (hash >> 32) % trace_rate == 0;
+}
+
+/**
+ * @brief Notes that a request reached a phase.
+ * @param[in] trace record of the request.
+ * @param[in] phase the phase.
+ * @param[in] now monotonic ns it was reached at.
+ *
+ * Does nothing if the request is not traced.
+ */
+void trace_mark(trace_record_t *trace, trace_phase_t phase, long long now) {
+    if (trace->start_ns != 0) {
+        trace->phase_ns[phase] = now - trace->start_ns;
+    }
+}
+
+/**
+ * @brief Queues the record of a finished request.
+ * @param[in] trace the record.
+ *
+ * Does nothing if the request is not traced.
+ */
+void trace_submit(const trace_record_t *trace) {
+    if (trace->start_ns == 0 || trace_fd < 0) {
+        return;
+    }
+    pthread_mutex_lock(&queue.mutex);
+    if (queue.count < TRACE_BUF_RECORDS) {
+        queue.records[queue.count++] = *trace;
+    } else {
+        stats_inc(STAT_TRACE_DROPPED);
+    }
+    pthread_mutex_unlock(&queue.mutex);
+}
+
+/**
+ * @brief Writes out every record queued so far.
+ *
+ */
+void flush_trace(void) {
+    if (trace_fd >= 0) {
+        write_queue();
+    }
+}
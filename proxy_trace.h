@@ -0,0 +1,82 @@
+/**
+ * @file proxy_trace.h
+ * @brief Prototypes and definitions for proxy_trace.c
+ *
+ * Sampled per-request tracing. A traced request notes when each phase of
+ * serving it ended, and the record is appended to a binary trace file for
+ * tools/tracestat to break down. Only one request in so many is traced,
+ * picked by the time it was accepted, so the cost stays bounded however
+ * busy the proxy gets.
+ *
+ * A trace file is a trace_header_t followed by trace_record_t records,
+ * in the byte order of the machine that wrote it.
+ *
+ * @author Taiming Liu <taimingl@andrew.cmu.edu>
+ */
+#ifndef PROXY_TRACE_H
+#define PROXY_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Start of every trace file, and the version of its records */
+#define TRACE_MAGIC "PXYTRACE"
+#define TRACE_VERSION 1
+
+/* Trace file used when none is named */
+#define TRACE_DEF_FILE "proxy.trace"
+
+/* Bytes of a URI kept in a record, the rest is cut off */
+#define TRACE_URI_LEN 48
+
+/* Points in serving a request, in the order they are reached */
+typedef enum trace_phase {
+    TRACE_HEADER,     /* request head read */
+    TRACE_LOOKUP,     /* cache looked up */
+    TRACE_RESOLVED,   /* name of the web server resolved */
+    TRACE_CONNECTED,  /* connected to the web server and request sent */
+    TRACE_FIRST_BYTE, /* first bytes of the response arrived */
+    TRACE_RELAYED,    /* whole response written to the client */
+    TRACE_CLOSED,     /* connection closed */
+    NUM_TRACE_PHASES
+} trace_phase_t;
+
+/* Header at the start of a trace file */
+typedef struct trace_header {
+    char magic[8];        /* TRACE_MAGIC, not NUL-terminated */
+    uint32_t version;     /* TRACE_VERSION */
+    uint32_t record_size; /* sizeof(trace_record_t) */
+} trace_header_t;
+
+/* One traced request, 128 bytes. A phase the request never reached, such
+ * as connecting for a hit, is left at 0. */
+typedef struct trace_record {
+    int64_t start_ns;                   /* monotonic ns it was accepted */
+    int64_t phase_ns[NUM_TRACE_PHASES]; /* ns after start each phase ended */
+    int64_t lock_us;                    /* us spent waiting for cache locks */
+    uint32_t bytes;                     /* response bytes sent */
+    uint16_t status;                    /* HTTP status, 0 if none sent */
+    uint8_t cache;                      /* a log_cache_t */
+    uint8_t pad;
+    char uri[TRACE_URI_LEN]; /* requested URI, cut short, NUL-padded */
+} trace_record_t;
+
+/* Opens the trace file and traces one request in rate, none if 0 */
+bool init_trace(const char *path, unsigned int rate);
+
+/* Starts the thread writing records out */
+void start_trace(void);
+
+/* Tells whether to trace a request accepted at start_ns */
+bool trace_sampled(long long start_ns);
+
+/* Notes that a traced request reached a phase at monotonic ns now */
+void trace_mark(trace_record_t *trace, trace_phase_t phase, long long now);
+
+/* Queues the record of a finished request for the trace file */
+void trace_submit(const trace_record_t *trace);
+
+/* Writes out every queued record, before exiting */
+void flush_trace(void);
+
+#endif /* PROXY_TRACE_H */
@@ -0,0 +1,717 @@
+/**
+ * @file proxy_uring.c
+ * @brief io_uring I/O engine for the proxy
+ *
+ * Each ring is used by one thread at a time: accept threads own theirs,
+ * connection threads borrow one from a pool for the duration of a cache
+ * miss. Every submission is waited for in full before the call returns, so
+ * a ring never has operations in flight while it sits in the pool.
+ *
+ * Timeouts are linked timeouts on the operation they guard; a request that
+ * times out completes with -ECANCELED, which is reported as EAGAIN to match
+ * what SO_RCVTIMEO and SO_SNDTIMEO make rio return. A request that had
+ * already moved some bytes completes with their count instead, so the
+ * relay reads give their timeouts a tag of their own to tell the two apart.
+ *
+ * Relay reads are recvs with MSG_WAITALL, so that like rio_readn a short
+ * read means the web server is done. The kernel only honours MSG_WAITALL
+ * there from 5.18, the release that added IORING_FEAT_LINKED_FILE, so
+ * uring_new refuses rings without that feature. Multishot accepts need
+ * 5.19, which no feature flag tells, so uring_probe arms one to find out.
+ *
+ * @author Taiming Liu <taimingl@andrew.cmu.edu>
+ */
+#define _GNU_SOURCE /* syscall, pipe2 */
+
+#include "proxy_uring.h"
+#include "csapp.h"
+#include "proxy_stats.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/* What a completion belongs to, stored in user_data */
+enum {
+    TAG_IN = 1, /* read or splice from the web server */
+    TAG_OUT,    /* write or splice to the client */
+    TAG_TIMEOUT,    /* timeout guarding anything but a read */
+    TAG_IN_TIMEOUT, /* timeout guarding a read from the web server */
+    TAG_CONNECT,
+    TAG_SEND,
+    TAG_ACCEPT,
+    TAG_CANCEL
+};
+
+/* Pool of idle rings for connection threads */
+static uring_t *pool = NULL;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int sys_setup(unsigned int entries, struct io_uring_params *params) {
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+                     unsigned int flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                        flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned int opcode, void *arg,
+                        unsigned int nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * @brief Private helper function releasing a (partially set up) ring.
+ */
+static void uring_free(uring_t *ring) {
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if (ring->ring_ptr != NULL) {
+        munmap(ring->ring_ptr, ring->ring_len);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    for (int i = 0; i < URING_NBUFS; i++) {
+        free(ring->bufs[i]);
+    }
+    if (ring->pipefd[0] >= 0) {
+        close(ring->pipefd[0]);
+        close(ring->pipefd[1]);
+    }
+    for (unsigned int i = 0; i < ring->stashed; i++) {
+        close(ring->stash[i]);
+    }
+    free(ring);
+}
+
+/**
+ * @brief Creates a ring, maps its queues and registers its buffers.
+ *
+ * Returns NULL if the kernel refuses any step; the caller then uses rio.
+ */
+uring_t *uring_new(void) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    uring_t *ring = calloc(1, sizeof(uring_t));
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->pipefd[0] = ring->pipefd[1] = -1;
+    if ((ring->fd = sys_setup(URING_ENTRIES, &params)) < 0 ||
+        !(params.features & IORING_FEAT_SINGLE_MMAP) ||
+        !(params.features & IORING_FEAT_NODROP) ||
+        !(params.features & IORING_FEAT_LINKED_FILE)) {
+        uring_free(ring);
+        return NULL;
+    }
+
+    // both queues share one mapping, the SQEs are mapped separately
+    size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_len = params.cq_off.cqes +
+                    params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_len = sq_len > cq_len ? sq_len : cq_len;
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    void *ptr = mmap(NULL, ring->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     ring->fd, IORING_OFF_SQ_RING);
+    if (ptr == MAP_FAILED) {
+        uring_free(ring);
+        return NULL;
+    }
+    ring->ring_ptr = ptr;
+    ptr = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED,
+               ring->fd, IORING_OFF_SQES);
+    if (ptr == MAP_FAILED) {
+        uring_free(ring);
+        return NULL;
+    }
+    ring->sqes = ptr;
+
+    char *base = ring->ring_ptr;
+    ring->sq_head = (unsigned int *)(base + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(base + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(base + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(base + params.sq_off.array);
+    ring->cq_head = (unsigned int *)(base + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(base + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+    ring->sq_local_tail = *ring->sq_tail;
+
+    struct iovec iov[URING_NBUFS];
+    for (int i = 0; i < URING_NBUFS; i++) {
+        if ((ring->bufs[i] = malloc(URING_BUFSIZE)) == NULL) {
+            uring_free(ring);
+            return NULL;
+        }
+        iov[i].iov_base = ring->bufs[i];
+        iov[i].iov_len = URING_BUFSIZE;
+    }
+    if (sys_register(ring->fd, IORING_REGISTER_BUFFERS, iov, URING_NBUFS) <
+        0) {
+        uring_free(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+/**
+ * @brief Takes an idle ring from the pool, or creates a new one.
+ */
+uring_t *uring_get(void) {
+    pthread_mutex_lock(&pool_mutex);
+    uring_t *ring = pool;
+    if (ring != NULL) {
+        pool = ring->next;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    return ring != NULL ? ring : uring_new();
+}
+
+/**
+ * @brief Returns a ring to the pool, or closes it if it is broken.
+ */
+void uring_put(uring_t *ring) {
+    if (ring->broken) {
+        // the kernel may still write into the buffers, so they are leaked
+        for (int i = 0; i < URING_NBUFS; i++) {
+            ring->bufs[i] = NULL;
+        }
+        uring_free(ring);
+        return;
+    }
+    pthread_mutex_lock(&pool_mutex);
+    ring->next = pool;
+    pool = ring;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+/**
+ * @brief Private helper function claiming the next submission queue entry.
+ *
+ * Callers queue at most a handful of entries before submitting them all,
+ * so the queue can never be full here.
+ */
+static struct io_uring_sqe *get_sqe(uring_t *ring, unsigned char opcode,
+                                    int fd, uint64_t tag) {
+    unsigned int index = ring->sq_local_tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    ring->sq_queued++;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = tag;
+    return sqe;
+}
+
+/**
+ * @brief Private helper function guarding an entry with a linked timeout.
+ * @param[in] sqe entry to guard, must be the last one queued.
+ * @param[out] ts storage for the timeout, must live until submission.
+ * @param[in] ms timeout in milliseconds, <= 0 for none.
+ * @param[in] tag tag of the timeout's own completion, -ETIME if it fired.
+ *
+ * Returns the number of entries added (and so completions to expect).
+ */
+static unsigned int link_timeout(uring_t *ring, struct io_uring_sqe *sqe,
+                                 struct __kernel_timespec *ts, long ms,
+                                 uint64_t tag) {
+    if (ms <= 0) {
+        return 0;
+    }
+    ts->tv_sec = ms / 1000;
+    ts->tv_nsec = (ms % 1000) * 1000000;
+    sqe->flags |= IOSQE_IO_LINK;
+    sqe = get_sqe(ring, IORING_OP_LINK_TIMEOUT, -1, tag);
+    sqe->addr = (uintptr_t)ts;
+    sqe->len = 1;
+    return 1;
+}
+
+/**
+ * @brief Private helper function submitting queued entries in one syscall,
+ * waiting until `wait_nr` completions are available.
+ */
+static int submit(uring_t *ring, unsigned int wait_nr) {
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned int flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+    while (ring->sq_queued > 0) {
+        int ret = sys_enter(ring->fd, ring->sq_queued, wait_nr, flags);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        ring->sq_queued -= (unsigned int)ret;
+    }
+    return 0;
+}
+
+/**
+ * @brief Private helper function popping one completion, waiting for it if
+ * none is available yet.
+ * @param[in] ring the ring.
+ * @param[out] cqe the completion.
+ * @param[in] interruptible return -1 with errno EINTR when a signal arrives,
+ * instead of waiting on.
+ */
+static int wait_cqe(uring_t *ring, struct io_uring_cqe *cqe,
+                    bool interruptible) {
+    while (true) {
+        unsigned int head = *ring->cq_head;
+        if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            *cqe = ring->cqes[head & *ring->cq_mask];
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            return 0;
+        }
+        if (sys_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+            (errno != EINTR || interruptible)) {
+            return -1;
+        }
+    }
+}
+
+/**
+ * @brief Private helper function reaping the nr completions still owed
+ * after a wait failed, so that the ring goes back to the pool with nothing
+ * in flight. If they cannot be reaped either, the ring is marked broken and
+ * uring_put closes it.
+ */
+static void drain(uring_t *ring, unsigned int nr) {
+    struct io_uring_cqe cqe;
+    while (nr > 0 && wait_cqe(ring, &cqe, false) == 0) {
+        nr--;
+    }
+    ring->broken = nr > 0;
+}
+
+/**
+ * @brief Private helper function turning a failed completion into an errno.
+ */
+static int cqe_errno(int res) {
+    return res == -ECANCELED ? EAGAIN : -res;
+}
+
+/**
+ * @brief Connects to a web server and sends it the request.
+ * @param[in] ring ring of the calling thread.
+ * @param[in] hostname host name of the web server.
+ * @param[in] port port of the web server.
+ * @param[in] request request to send once connected.
+ * @param[in] request_len length of the request.
+ * @param[in] timeout milliseconds allowed for connecting and sending.
+ * @param[out] resolved monotonic ns the name was resolved at.
+ *
+ * The connect is linked to the send, so both go out in a single
+ * submission. Like open_clientfd, each address is tried in turn.
+ *
+ * Returns the connected socket, -2 if the name could not be resolved, -1 if
+ * no address accepted the connection, or URING_ESEND if the request could
+ * not be sent.
+ */
+int uring_connect(uring_t *ring, const char *hostname, const char *port,
+                  const char *request, size_t request_len, long timeout,
+                  long long *resolved) {
+    struct addrinfo hints, *listp, *p;
+    int clientfd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if (getaddrinfo(hostname, port, &hints, &listp) != 0) {
+        return -2;
+    }
+    *resolved = stats_clock();
+
+    for (p = listp; p != NULL; p = p->ai_next) {
+        int fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+
+        struct __kernel_timespec connect_ts, send_ts;
+        struct io_uring_sqe *sqe;
+        unsigned int nr = 2;
+        sqe = get_sqe(ring, IORING_OP_CONNECT, fd, TAG_CONNECT);
+        sqe->addr = (uintptr_t)p->ai_addr;
+        sqe->off = p->ai_addrlen;
+        nr += link_timeout(ring, sqe, &connect_ts, timeout, TAG_TIMEOUT);
+        // only runs if the connect succeeded
+        ring->sqes[(ring->sq_local_tail - 1) & *ring->sq_mask].flags |=
+            IOSQE_IO_LINK;
+        sqe = get_sqe(ring, IORING_OP_SEND, fd, TAG_SEND);
+        sqe->addr = (uintptr_t)request;
+        sqe->len = (unsigned int)request_len;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        nr += link_timeout(ring, sqe, &send_ts, timeout, TAG_TIMEOUT);
+
+        int connect_res = -ECANCELED, send_res = -ECANCELED;
+        struct io_uring_cqe cqe;
+        if (submit(ring, nr) < 0) {
+            nr = 0;
+        }
+        unsigned int i;
+        for (i = 0; i < nr && wait_cqe(ring, &cqe, false) == 0; i++) {
+            if (cqe.user_data == TAG_CONNECT) {
+                connect_res = cqe.res;
+            } else if (cqe.user_data == TAG_SEND) {
+                send_res = cqe.res;
+            }
+        }
+        if (i < nr) {
+            drain(ring, nr - i); // they still use the address and request
+        }
+
+        if (connect_res < 0) {
+            close(fd);
+            continue;
+        }
+        if (send_res < 0 || (size_t)send_res != request_len) {
+            close(fd);
+            clientfd = URING_ESEND;
+            break;
+        }
+        clientfd = fd;
+        break;
+    }
+    freeaddrinfo(listp);
+    return clientfd;
+}
+
+/**
+ * @brief Private helper function opening the splice pipe on first use.
+ */
+static bool open_pipe(uring_t *ring) {
+    if (ring->pipefd[0] < 0 && pipe2(ring->pipefd, O_CLOEXEC) < 0) {
+        ring->pipefd[0] = ring->pipefd[1] = -1;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Private helper function queueing a splice of up to len bytes.
+ */
+static struct io_uring_sqe *prep_splice(uring_t *ring, int fd_in, int fd_out,
+                                        size_t len, uint64_t tag) {
+    struct io_uring_sqe *sqe = get_sqe(ring, IORING_OP_SPLICE, fd_out, tag);
+    sqe->splice_fd_in = fd_in;
+    sqe->splice_off_in = (uint64_t)-1;
+    sqe->off = (uint64_t)-1;
+    sqe->len = (unsigned int)len;
+    sqe->splice_flags = SPLICE_F_MOVE;
+    return sqe;
+}
+
+/**
+ * @brief Relays a response from the web server to the client.
+ * @param[in] ring ring of the calling thread.
+ * @param[in] srcfd socket of the web server.
+ * @param[in] dstfd socket of the client.
+ * @param[in] in_timeout milliseconds allowed for each read.
+ * @param[in] out_timeout milliseconds allowed for each write.
+ * @param[in] chunk called with every chunk read, see uring_chunk_fn.
+ * @param[in] arg passed to chunk.
+ * @param[out] result what was relayed and how it ended.
+ *
+ * The two registered buffers alternate: while one is written to the client
+ * the next chunk is read into the other, and both requests go out in one
+ * io_uring_enter. A chunk that does not fill its buffer is the last one, and
+ * chunk learns so before the client gets it, unless the read's timeout cut
+ * it short: that ends the relay with in_err EAGAIN, and the bytes are
+ * dropped, as the response is incomplete. Once chunk returns false and
+ * both buffers have drained, the rest is spliced through a pipe without
+ * touching user space.
+ */
+void uring_relay(uring_t *ring, int srcfd, int dstfd, long in_timeout,
+                 long out_timeout, uring_chunk_fn chunk, void *arg,
+                 uring_relay_result_t *result) {
+    size_t pending[URING_NBUFS] = {0}; // bytes of each buffer to write
+    size_t written = 0;                // bytes of the out buffer written
+    size_t piped = 0;                  // bytes in the pipe to write
+    int in_buf = 0, out_buf = 0;
+    bool want_chunks = true, splicing = false;
+
+    memset(result, 0, sizeof(*result));
+    while (result->in_err == 0 && result->out_err == 0) {
+        if (!want_chunks && !splicing && pending[0] == 0 && pending[1] == 0) {
+            splicing = open_pipe(ring);
+        }
+
+        bool do_in = !result->eof && (splicing || pending[in_buf] == 0);
+        bool do_out = splicing ? piped > 0 : pending[out_buf] > 0;
+        if (!do_in && !do_out) {
+            break; // web server is done and the client has it all
+        }
+
+        struct __kernel_timespec in_ts, out_ts;
+        struct io_uring_sqe *sqe;
+        unsigned int nr = 0;
+        if (do_in) {
+            if (splicing) {
+                sqe = prep_splice(ring, srcfd, ring->pipefd[1], URING_BUFSIZE,
+                                  TAG_IN);
+            } else {
+                sqe = get_sqe(ring, IORING_OP_RECV, srcfd, TAG_IN);
+                sqe->addr = (uintptr_t)ring->bufs[in_buf];
+                sqe->len = URING_BUFSIZE;
+                sqe->msg_flags = MSG_WAITALL;
+            }
+            nr += 1 + link_timeout(ring, sqe, &in_ts, in_timeout,
+                                   TAG_IN_TIMEOUT);
+        }
+        if (do_out) {
+            if (splicing) {
+                sqe = prep_splice(ring, ring->pipefd[0], dstfd, piped, TAG_OUT);
+            } else {
+                sqe = get_sqe(ring, IORING_OP_WRITE_FIXED, dstfd, TAG_OUT);
+                sqe->addr = (uintptr_t)(ring->bufs[out_buf] + written);
+                sqe->len = (unsigned int)(pending[out_buf] - written);
+                sqe->buf_index = (uint16_t)out_buf;
+            }
+            nr += 1 + link_timeout(ring, sqe, &out_ts, out_timeout,
+                                   TAG_TIMEOUT);
+        }
+
+        if (submit(ring, nr) < 0) {
+            result->in_err = errno;
+            break;
+        }
+        // a short read is only the end of the response if the timeout did
+        // not fire, so look at it once every completion is in
+        struct io_uring_cqe cqe;
+        int in_res = 0, out_res = 0;
+        bool in_timed_out = false;
+        unsigned int i;
+        for (i = 0; i < nr && wait_cqe(ring, &cqe, false) == 0; i++) {
+            if (cqe.user_data == TAG_IN) {
+                in_res = cqe.res;
+            } else if (cqe.user_data == TAG_IN_TIMEOUT) {
+                in_timed_out = cqe.res == -ETIME;
+            } else if (cqe.user_data == TAG_OUT) {
+                out_res = cqe.res;
+            }
+        }
+        if (i < nr) {
+            result->in_err = errno;
+            drain(ring, nr - i);
+            break;
+        }
+
+        if (do_in) {
+            if (in_res < 0) {
+                result->in_err = cqe_errno(in_res);
+            } else if (in_res == 0) {
+                result->eof = true;
+            } else if (splicing) {
+                result->received += (size_t)in_res;
+                piped += (size_t)in_res;
+            } else if (in_res < URING_BUFSIZE && in_timed_out) {
+                result->received += (size_t)in_res;
+                result->in_err = EAGAIN;
+            } else {
+                result->received += (size_t)in_res;
+                pending[in_buf] = (size_t)in_res;
+                result->eof = in_res < URING_BUFSIZE;
+                if (want_chunks) {
+                    want_chunks = chunk(arg, ring->bufs[in_buf],
+                                        (size_t)in_res, result->eof);
+                }
+                in_buf ^= 1;
+            }
+        }
+        if (do_out) {
+            if (out_res <= 0) {
+                result->out_err = out_res < 0 ? cqe_errno(out_res) : EPIPE;
+            } else if (splicing) {
+                piped -= (size_t)out_res;
+            } else if ((written += (size_t)out_res) == pending[out_buf]) {
+                pending[out_buf] = 0;
+                written = 0;
+                out_buf ^= 1;
+            }
+        }
+    }
+
+    // a pipe with bytes left in it cannot be reused for the next response
+    if (piped > 0) {
+        close(ring->pipefd[0]);
+        close(ring->pipefd[1]);
+        ring->pipefd[0] = ring->pipefd[1] = -1;
+    }
+}
+
+/**
+ * @brief Private helper function arming a multishot accept on listenfd.
+ */
+static int arm_accept(uring_t *ring, int listenfd) {
+    struct io_uring_sqe *sqe =
+        get_sqe(ring, IORING_OP_ACCEPT, listenfd, TAG_ACCEPT);
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    if (submit(ring, 0) < 0) {
+        return -1;
+    }
+    ring->accept_armed = true;
+    return 0;
+}
+
+/**
+ * @brief Returns the next connection on listenfd.
+ * @param[in] ring ring owned by the accept thread.
+ * @param[in] listenfd listening socket.
+ *
+ * A single multishot accept keeps producing connections until it is
+ * cancelled or fails, so most calls cost only the wait for a completion.
+ * The peer address is not collected; use getpeername if it is needed.
+ *
+ * Returns -1 with errno set on failure, like accept, including EINTR when
+ * a signal interrupts the wait.
+ */
+int uring_accept(uring_t *ring, int listenfd) {
+    if (ring->stashed > 0) {
+        int connfd = ring->stash[0];
+        ring->stashed--;
+        memmove(ring->stash, ring->stash + 1, ring->stashed * sizeof(int));
+        return connfd;
+    }
+    if (!ring->accept_armed && arm_accept(ring, listenfd) < 0) {
+        return -1;
+    }
+
+    struct io_uring_cqe cqe;
+    do {
+        if (wait_cqe(ring, &cqe, true) < 0) {
+            return -1;
+        }
+    } while (cqe.user_data != TAG_ACCEPT);
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+        ring->accept_armed = false; // re-armed by the next call
+    }
+    if (cqe.res < 0) {
+        errno = -cqe.res;
+        return -1;
+    }
+    return cqe.res;
+}
+
+/**
+ * @brief Stops the multishot accept.
+ * @param[in] ring ring owned by the accept thread.
+ *
+ * Called when the proxy stops taking connections, so that they wait in the
+ * listen backlog rather than being accepted by the kernel on our behalf.
+ * Connections accepted before the cancel took effect are kept and handed
+ * out by the next calls to uring_accept.
+ */
+void uring_accept_cancel(uring_t *ring) {
+    if (!ring->accept_armed) {
+        return;
+    }
+    struct io_uring_sqe *sqe =
+        get_sqe(ring, IORING_OP_ASYNC_CANCEL, -1, TAG_CANCEL);
+    sqe->addr = TAG_ACCEPT;
+    if (submit(ring, 0) < 0) {
+        return;
+    }
+
+    bool cancelled = false;
+    struct io_uring_cqe cqe;
+    while ((ring->accept_armed || !cancelled) &&
+           wait_cqe(ring, &cqe, false) == 0) {
+        if (cqe.user_data == TAG_CANCEL) {
+            cancelled = true;
+            continue;
+        }
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            ring->accept_armed = false;
+        }
+        if (cqe.res >= 0) {
+            if (ring->stashed < URING_STASH) {
+                ring->stash[ring->stashed++] = cqe.res;
+            } else {
+                close(cqe.res);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Private helper function checking that multishot accepts work.
+ * @param[in] ring a ring of no use to anything else.
+ *
+ * Kernels before 5.19 know IORING_OP_ACCEPT but fail a multishot one with
+ * EINVAL, posted while it is submitted. So one is armed on a scratch
+ * socket nobody connects to, and cancelled again if nothing came back.
+ */
+static bool probe_accept(uring_t *ring) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    bool ok = fd >= 0 &&
+              bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+              listen(fd, 1) == 0 && arm_accept(ring, fd) == 0;
+
+    if (ok && *ring->cq_head != __atomic_load_n(ring->cq_tail,
+                                                __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe cqe;
+        wait_cqe(ring, &cqe, false);
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            ring->accept_armed = false;
+        }
+        ok = false;
+    }
+    uring_accept_cancel(ring);
+    if (fd >= 0) {
+        close(fd);
+    }
+    return ok;
+}
+
+/**
+ * @brief Checks that a ring can be created and supports every opcode used,
+ * and multishot accepts.
+ */
+bool uring_probe(void) {
+    static const unsigned char needed[] = {
+        IORING_OP_RECV,         IORING_OP_WRITE_FIXED, IORING_OP_CONNECT,
+        IORING_OP_SEND,         IORING_OP_SPLICE,      IORING_OP_ACCEPT,
+        IORING_OP_LINK_TIMEOUT, IORING_OP_ASYNC_CANCEL};
+    size_t len = sizeof(struct io_uring_probe) +
+                 IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    uring_t *ring = uring_new();
+    bool ok = probe != NULL && ring != NULL &&
+              sys_register(ring->fd, IORING_REGISTER_PROBE, probe,
+                           IORING_OP_LAST) == 0;
+
+    for (size_t i = 0; ok && i < sizeof(needed); i++) {
+        ok = needed[i] <= probe->last_op &&
+             (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    ok = ok && probe_accept(ring);
+    free(probe);
+    if (ring != NULL) {
+        uring_free(ring);
+    }
+    return ok;
+}
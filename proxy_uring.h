@@ -0,0 +1,109 @@
+/**
+ * @file proxy_uring.h
+ * @brief Prototypes and definitions for proxy_uring.c
+ *
+ * An optional io_uring I/O engine for the proxy, talking to the kernel
+ * through the raw system calls (no liburing needed). It batches the
+ * syscalls of a cache miss: connecting and sending the request go out in
+ * one submission, and every round of the response relay submits the write
+ * of one chunk to the client (from a registered buffer) together with the
+ * read of the next one from the web server. Responses too large to cache
+ * are spliced through a pipe without being copied into user space. The
+ * accept loop uses multishot accept.
+ *
+ * Everything here returns failure when io_uring is unusable (old kernel,
+ * seccomp, io_uring_disabled), in which case the proxy keeps using rio.
+ *
+ * @author Taiming Liu <taimingl@andrew.cmu.edu>
+ */
+#ifndef PROXY_URING_H
+#define PROXY_URING_H
+
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h> /* size_t */
+#include <sys/socket.h>
+
+/* Ring size, and number and size of the registered relay buffers */
+#define URING_ENTRIES 16
+#define URING_NBUFS 2
+#define URING_BUFSIZE (32 * 1024)
+
+/* Connections a cancelled multishot accept may leave behind */
+#define URING_STASH 64
+
+/* uring_connect failed to send the request after connecting */
+#define URING_ESEND (-3)
+
+/* A ring, its registered buffers and a pipe for splicing */
+typedef struct uring {
+    int fd;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int sq_local_tail; /* tail including SQEs not yet submitted */
+    unsigned int sq_queued;     /* SQEs not yet submitted */
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *ring_ptr; /* SQ and CQ rings, mapped together */
+    size_t ring_len;
+    size_t sqes_len;
+    char *bufs[URING_NBUFS]; /* registered with the kernel */
+    int pipefd[2];           /* for splicing, -1 until first needed */
+    bool accept_armed;       /* multishot accept is in flight */
+    bool broken;             /* may have operations in flight, not pooled */
+    int stash[URING_STASH];  /* connections accepted while cancelling */
+    unsigned int stashed;    /* number of connections in stash */
+    struct uring *next;      /* link in the pool of idle rings */
+} uring_t;
+
+/*
+ * Called with each response chunk read through the relay buffers, before
+ * it is written to the client; last is set if the web server has finished
+ * its response. Returns false once the caller has no more use for the
+ * bytes, which lets the relay splice the rest of the response instead.
+ */
+typedef bool (*uring_chunk_fn)(void *arg, const char *buf, size_t len,
+                               bool last);
+
+/* Outcome of relaying a response from a web server to a client */
+typedef struct uring_relay_result {
+    size_t received; /* bytes read from the web server */
+    bool eof;        /* web server finished its response */
+    int in_err;      /* errno of a failed read, EAGAIN if it timed out */
+    int out_err;     /* errno of a failed write, EAGAIN if it timed out */
+} uring_relay_result_t;
+
+/* Checks that io_uring works here, returns false if it does not */
+bool uring_probe(void);
+
+/* Creates a ring with its own buffers, returns NULL on failure */
+uring_t *uring_new(void);
+
+/* Takes a ring from the pool of idle rings, creating one if needed */
+uring_t *uring_get(void);
+
+/* Returns a ring taken by uring_get to the pool */
+void uring_put(uring_t *ring);
+
+/* Connects to a web server and sends it the request in one submission */
+int uring_connect(uring_t *ring, const char *hostname, const char *port,
+                  const char *request, size_t request_len, long timeout,
+                  long long *resolved);
+
+/* Relays a response from srcfd to dstfd until EOF or an error */
+void uring_relay(uring_t *ring, int srcfd, int dstfd, long in_timeout,
+                 long out_timeout, uring_chunk_fn chunk, void *arg,
+                 uring_relay_result_t *result);
+
+/* Returns the next connection on listenfd, using multishot accept */
+int uring_accept(uring_t *ring, int listenfd);
+
+/* Stops the multishot accept, keeping connections it already took */
+void uring_accept_cancel(uring_t *ring);
+
+#endif /* PROXY_URING_H */
@@ -234,8 +234,11 @@ class HTTPStatus:
     entries = [(200, "ok", "OK"),
                (400, "bad_request", "Bad request"),
                (404, "not_found", "Not found"),
+               (408, "request_timeout", "Request timeout"),
                (501, "not_implemented", "Not implemented"),
+               (502, "bad_gateway", "Bad gateway"),
                (503, "bad_version", "HTTP version not supported"),
+               (504, "gateway_timeout", "Gateway timeout"),
                (666, "internal_error", "Internal error occurred"),
                (999, "invalid", "Invalid status code"),
                ]
@@ -474,7 +477,8 @@ class Server:
         return str(self.sequenceNumber)
 
     # Create header.  Return as list of lines
-    def buildHeader(self, tag, length, mimeType, id = "", uri = None):
+    # The sequence number is the next one, unless one is given
+    def buildHeader(self, tag, length, mimeType, id = "", uri = None, sequence = None):
         code = self.httpStatus.getCode(tag)
         descr = self.httpStatus.getDescription(tag)
     
@@ -487,10 +491,20 @@ class Server:
         lines.append("Content-type: %s\r\n" % mimeType)
         if id != "" and uri is not None:
             lines.append("Content-Identifier: %s-%s\r\n" % (self.id, uri))
-        lines.append("Sequence-Identifier: %s\r\n" % self.sequenceId())
+        if sequence is None:
+            sequence = self.sequenceId()
+        lines.append("Sequence-Identifier: %s\r\n" % sequence)
         lines.append("\r\n")
         return lines
 
+    # Length of the header sent ahead of file fname, of the given length,
+    # for request id.  The response is numbered as the given sequence number
+    def headerLength(self, fname, length, id, sequence):
+        extension = self.fileManager.getExtension(fname)
+        mimeType = self.mimeTypes[extension] if extension in self.mimeTypes else "application/unknown"
+        lines = self.buildHeader("ok", length, mimeType, id, fname, str(sequence))
+        return len("".join(lines))
+
     # Construct an HTML page giving error information
     def buildError(self, tag, reason):
         code = self.httpStatus.getCode(tag)
@@ -17,6 +17,10 @@ import subprocess
 import threading
 import datetime
 import signal
+import random
+import math
+import bisect
+import re
 
 import console
 import agents
@@ -82,12 +86,28 @@ class Driver:
     # Is there an active proxy?
     haveProxy = False
     proxyProcess = None
+    # Program last started, restarted when proxy is given only arguments
+    proxyPath = None
     getId = 0
 
 
     # Mapping from id to event.  Used to implement wait *
     activeEvents = {}
 
+    # Sizes of the files in a workload: log-normal around a median of 4KB,
+    # as web objects go, within these bounds
+    workloadMedian = 4096
+    workloadSigma = 1.5
+    workloadMinSize = 100
+    workloadMaxSize = 1000*1000
+    # Fetches a workload keeps going at once, unless told otherwise
+    workloadConcurrency = 10
+    # Failures a workload or replay reports one by one
+    workloadReportLimit = 5
+
+    # Record of the proxy's access log (option -l)
+    logPattern = re.compile(r'time=(\d+\.\d+) .*uri="([^"]*)" status=(\d+) bytes=(\d+)')
+
     def __init__(self):
         self.verbose = console.Option(False)
         self.strict = console.Option(0)
@@ -140,6 +160,8 @@ class Driver:
         self.console.addCommand("trace", self.doTrace,         "ID+",   "Trace histories of requests")
         self.console.addCommand("signal", self.doSignal,       "[SIGNO]", "Send signal number SIGNO to process.  Default = 13 (SIGPIPE)")
         self.console.addCommand("disrupt", self.doDisrupt,     "(request|response) [SID]", "Schedule disruption of request or response by client [or server SID]")
+        self.console.addCommand("workload", self.doWorkload,  "ID OBJECTS SKEW REQUESTS SID [CONC]", "Generate OBJECTS files of web-like sizes and fetch them REQUESTS times from server SID, picked by a Zipf law of SKEW, CONC at a time")
+        self.console.addCommand("replay", self.doReplay,      "ID LOG SID [SPEED]", "Replay the proxy access log LOG against server SID at its recorded pace, or SPEED times faster")
         self.console.addCommand("wait", self.doWait,          "* | ID+", "Wait until all or listed pending requests, fetches, and responses have completed")
 
 
@@ -460,6 +482,184 @@ class Driver:
             self.console.outMsg("Generated file '%s'" % path)
         return True
         
+    # Wait for fetches to complete and check them.  Expected maps request
+    # IDs to expected tags.  Return number of fetches that failed
+    def finishFetches(self, expected):
+        checkEvents = {}
+        for rid in expected.keys():
+            if rid in self.activeEvents:
+                checkEvents[rid] = self.activeEvents[rid]
+                del self.activeEvents[rid]
+        ms = int(self.timeout.getInteger() * self.stretch.getInteger()/100.0)
+        (pending, msg) = self.eventManager.waitActive(checkEvents, ms)
+        if len(pending) > 0:
+            self.console.errMsg("%d events still pending.  %s" % (len(pending), msg))
+        failed = 0
+        for rid in sorted(expected.keys()):
+            event = self.eventManager.findEvent(True, rid)
+            if event is not None and event.tag == expected[rid]:
+                # Keep response files from piling up
+                if event.path != "" and os.path.exists(event.path):
+                    os.remove(event.path)
+                continue
+            failed += 1
+            if failed <= self.workloadReportLimit:
+                tag = "none" if event is None else event.tag
+                reason = "" if event is None or event.text == "" else " (%s)" % event.text
+                self.console.errMsg("Request %s generated status '%s'.  Expecting '%s'%s" % (rid, tag, expected[rid], reason))
+        return failed
+
+    # Report how many fetches the proxy answered without the server
+    def reportOrigin(self, sid, count, fetches):
+        served = 100.0 * (fetches - count) / fetches if fetches > 0 else 0.0
+        self.console.outMsg("Server %s received %d requests.  %.1f%% of fetches served from cache" % (sid, count, served))
+
+    def doWorkload(self, args):
+        if len(args) < 5 or len(args) > 6:
+            self.console.errMsg("Workload command requires 5-6 arguments")
+            return False
+        (status, msg) = self.checkProxy()
+        if not status:
+            self.console.errMsg("Cannot execute workload. %s" % msg)
+            return False
+        prefix = args[0]
+        sid = args[4]
+        try:
+            objects = int(args[1])
+            skew = float(args[2])
+            requests = int(args[3])
+            concurrency = int(args[5]) if len(args) > 5 else self.workloadConcurrency
+        except:
+            self.console.errMsg("Invalid workload parameters")
+            return False
+        if objects < 1 or skew < 0 or requests < 0 or concurrency < 1:
+            self.console.errMsg("Invalid workload parameters")
+            return False
+        if sid not in self.servers:
+            self.console.errMsg("Invalid server name %s" % sid)
+            return False
+        # Seed with the ID, so that a workload is the same every run
+        rng = random.Random(prefix)
+        names = []
+        for i in range(objects):
+            size = int(rng.lognormvariate(math.log(self.workloadMedian), self.workloadSigma))
+            size = min(max(size, self.workloadMinSize), self.workloadMaxSize)
+            fname = "%s-%d.%s" % (prefix, i, "txt" if i % 2 == 0 else "bin")
+            if self.fileManager.generateFile(fname, size, linefeedPercent = self.linefeedPercent.getInteger()) == "":
+                return False
+            names.append(fname)
+        # Object i is fetched with weight 1/(i+1)^skew
+        cumulative = []
+        total = 0.0
+        for i in range(objects):
+            total += 1.0 / (i + 1) ** skew
+            cumulative.append(total)
+
+        server = self.servers[sid]
+        startCount = server.requestCount
+        fetched = set()
+        failed = 0
+        for start in range(0, requests, concurrency):
+            expected = {}
+            for n in range(start, min(start + concurrency, requests)):
+                i = min(bisect.bisect_left(cumulative, rng.uniform(0, total)), objects - 1)
+                fetched.add(i)
+                rid = "%s-r%d" % (prefix, n)
+                if self.doRequestOrFetch([rid, names[i], sid], True, False):
+                    expected[rid] = "ok"
+                else:
+                    failed += 1
+            failed += self.finishFetches(expected)
+        for fname in names:
+            self.fileManager.deleteFile(fname)
+        self.console.outMsg("Workload %s made %d fetches of %d distinct files.  %d failed" % (prefix, requests, len(fetched), failed))
+        self.reportOrigin(sid, server.requestCount - startCount, requests)
+        return failed == 0
+
+    def doReplay(self, args):
+        if len(args) < 3 or len(args) > 4:
+            self.console.errMsg("Replay command requires 3-4 arguments")
+            return False
+        (status, msg) = self.checkProxy()
+        if not status:
+            self.console.errMsg("Cannot execute replay. %s" % msg)
+            return False
+        prefix = args[0]
+        sid = args[2]
+        try:
+            speed = float(args[3]) if len(args) > 3 else 1.0
+        except:
+            speed = 0
+        if speed <= 0:
+            self.console.errMsg("Invalid replay speed '%s'" % args[3])
+            return False
+        if sid not in self.servers:
+            self.console.errMsg("Invalid server name %s" % sid)
+            return False
+        try:
+            logFile = open(args[1], 'r')
+            lines = logFile.readlines()
+            logFile.close()
+        except Exception as ex:
+            self.console.errMsg("Couldn't read log file %s (%s)" % (args[1], ex))
+            return False
+        # Threads write the log in batches, so records may be out of order
+        records = []
+        skipped = 0
+        for line in lines:
+            match = self.logPattern.search(line)
+            if match is None or match.group(3) not in ("200", "404"):
+                skipped += 1
+                continue
+            records.append((float(match.group(1)), match.group(2), match.group(3), int(match.group(4))))
+        records.sort(key = lambda r: r[0])
+        # Each URI gets a file, or none if it was missing.  The log counts
+        # the response header in its bytes, so the file is what is left of
+        # them after the header the server will send.  That header is
+        # taken at its longest, with the last request ID and sequence
+        # number of the replay, so that no response outgrows its record
+        server = self.servers[sid]
+        lastId = "%s-r%d" % (prefix, len(records) - 1)
+        lastSequence = server.sequenceNumber + len(records)
+        names = {}
+        expected = {}
+        generated = []
+        notFound = self.requestManager.httpStatus.getTag(404)
+        for (t, uri, status, bytes) in records:
+            if uri in names:
+                continue
+            fname = "%s-%d.bin" % (prefix, len(names))
+            if status == "200":
+                size = bytes - server.headerLength(fname, bytes, lastId, lastSequence)
+                if self.fileManager.generateFile(fname, max(size, 1), linefeedPercent = self.linefeedPercent.getInteger()) == "":
+                    return False
+                generated.append(fname)
+            names[uri] = fname
+
+        startCount = server.requestCount
+        scale = self.stretch.getInteger() / 100.0 / speed
+        startTime = time.time()
+        failed = 0
+        for n in range(len(records)):
+            (t, uri, status, bytes) = records[n]
+            wait = startTime + (t - records[0][0]) * scale - time.time()
+            if wait > 0:
+                time.sleep(wait)
+            rid = "%s-r%d" % (prefix, n)
+            fname = names[uri]
+            if self.doRequestOrFetch([rid, fname, sid], True, False):
+                expected[rid] = "ok" if fname in generated else notFound
+            else:
+                failed += 1
+        elapsed = time.time() - startTime
+        failed += self.finishFetches(expected)
+        for fname in generated:
+            self.fileManager.deleteFile(fname)
+        recorded = records[-1][0] - records[0][0] if len(records) > 0 else 0
+        self.console.outMsg("Replay %s made %d fetches of %d distinct files in %.2f seconds (%.2f recorded).  %d failed, %d log lines skipped" % (prefix, len(records), len(names), elapsed, recorded, failed, skipped))
+        self.reportOrigin(sid, server.requestCount - startCount, len(records))
+        return failed == 0
+
     def doDelete(self, args):
         ok = True
         for fname in args:
@@ -495,8 +695,17 @@ class Driver:
             self.monitors = []
         if len(args) < 1:
             return True
-        path = args[0]
-        options = args[1:]
+        if args[0][0] == '-':
+            # Same proxy, other arguments
+            if self.proxyPath is None:
+                self.console.errMsg("No proxy to restart")
+                return False
+            path = self.proxyPath
+            options = args
+        else:
+            path = args[0]
+            options = args[1:]
+        self.proxyPath = path
         port = None
         for t in range(self.portLimit):
             port = self.portManager.newPort()
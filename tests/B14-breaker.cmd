@@ -0,0 +1,29 @@
+# Cut off a web server that keeps failing, and probe it once cooled down
+proxy -b 2 -B 1
+generate r1.txt 1k
+generate r2.txt 1k
+generate r3.txt 1k
+serve s1
+# Two failures in a row open the breaker
+disrupt request s1
+fetch f1 r1.txt s1
+wait *
+check f1 502
+disrupt request s1
+fetch f2 r1.txt s1
+wait *
+check f2 502
+# While open, the proxy answers without contacting the server
+fetch f3 r1.txt s1
+wait *
+check f3 503
+# Once cooled down, one request goes through as the probe
+delay 2100
+fetch f4 r2.txt s1
+wait *
+check f4
+# The probe succeeded, so the breaker is closed again
+fetch f5 r3.txt s1
+wait *
+check f5
+quit
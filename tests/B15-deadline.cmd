@@ -0,0 +1,17 @@
+# Give up on a web server that takes the request but never answers
+proxy -u 500
+generate r1.txt 1k
+generate r2.txt 1k
+serve s1
+request r1 r1.txt s1
+wait *
+# The server holds its response past the proxy's deadline
+delay 1000
+respond r1
+wait *
+check r1 504
+# The server is still served afterwards
+fetch f2 r2.txt s1
+wait *
+check f2
+quit
@@ -0,0 +1,28 @@
+# Refuse cache misses beyond the fetch limit, but keep serving hits
+proxy -f 1
+generate r1.txt 1k
+generate r2.txt 1k
+generate r3.txt 1k
+serve s1
+fetch f1 r1.txt s1
+wait *
+check f1
+# r2 holds the only fetch slot
+request r2 r2.txt s1
+wait *
+# Another miss is shed
+fetch f3 r3.txt s1
+wait *
+check f3 503
+# A hit needs no fetch slot
+fetch f4 r1.txt s1
+wait *
+check f4
+respond r2
+wait *
+check r2
+# With the slot free again, misses go through
+fetch f5 r3.txt s1
+wait *
+check f5
+quit
@@ -0,0 +1,6 @@
+option timeout 20000
+option linefeed 0
+# Fetch files of web-like sizes with Zipf popularity, as real clients do
+serve s1
+workload zw 200 1.0 500 s1 10
+quit
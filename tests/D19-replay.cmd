@@ -0,0 +1,6 @@
+option timeout 20000
+option linefeed 0
+# Replay a recorded access log at its original pace, missing files included
+serve s1
+replay rp tests/D19-replay.log s1
+quit
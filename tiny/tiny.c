@@ -4,6 +4,14 @@
  *
  * Updated 04/2017 - Stanley Zhang <szz@andrew.cmu.edu>
  * Fixed some style issues, stop using csapp functions where not appropriate
+ *
+ * Tiny can also play a slow origin, for benchmarking the proxy against
+ * one on a single machine: responses can be held back before their first
+ * byte, paced to a rate in small writes, and stalled partway through, for
+ * all URIs or per URI prefix (see read_rules). A connection can also sit
+ * for a while before its request is read. While any of this is on, or
+ * with -f, each connection is served by a child process, so that clients
+ * wait out their delays side by side rather than one after another.
  */
 
 #include "csapp.h"
@@ -16,6 +24,8 @@
 #include <ctype.h>
 
 #include <fcntl.h>
+#include <signal.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <sys/types.h>
@@ -25,6 +35,7 @@
 
 #define HOSTLEN 256
 #define SERVLEN 8
+#define MAXRULES 64
 
 /* Typedef for convenience */
 typedef struct sockaddr SA;
@@ -38,6 +49,28 @@ typedef struct {
     char serv[SERVLEN];         // Client service (port)
 } client_info;
 
+/* How responses to some URIs are slowed down. */
+typedef struct {
+    char prefix[MAXLINE];       // URIs starting with this, "" for any
+    long delay_ms;              // Wait before the first byte of a response
+    long rate;                  // Bytes per second at most, 0 for no cap
+    size_t chunk;               // Bytes per paced write, 0 for 10 ms worth
+    long stall_ms;              // Pause once partway through a response
+    size_t stall_after;         // Bytes sent before the pause
+} shaping;
+
+/* Per-prefix rules in file order, then the one from the command line. */
+static shaping rules[MAXRULES + 1];
+static int nrules = 0;
+
+/* Wait after accepting a connection before reading its request. */
+static long accept_ms = 0;
+
+/* The rule of the response being sent, and how far it has got. */
+static const shaping *current = NULL;
+static long long started_ns;
+static size_t sent;
+
 /* URI parsing results. */
 typedef enum {
     PARSE_ERROR,
@@ -128,6 +161,92 @@ void get_filetype(char *filename, char *filetype) {
 }
 
 
+/*
+ * now_ns - monotonic time in nanoseconds
+ */
+long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * sleep_until - sleep until a monotonic time in nanoseconds
+ */
+void sleep_until(long long ns) {
+    struct timespec ts = { ns / 1000000000LL, ns % 1000000000LL };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0) {
+        /* Interrupted; keep sleeping */
+    }
+}
+
+/*
+ * find_rule - return the rule for a URI: the first whose prefix it starts
+ * with, or else the one from the command line.
+ */
+const shaping *find_rule(const char *uri) {
+    for (int i = 0; i < nrules; i++) {
+        if (strncmp(uri, rules[i].prefix, strlen(rules[i].prefix)) == 0) {
+            return &rules[i];
+        }
+    }
+    return &rules[nrules];
+}
+
+/*
+ * start_response - apply the rule for a URI to the response about to be
+ * sent, waiting out its delay before the first byte
+ */
+void start_response(const char *uri) {
+    current = find_rule(uri);
+    if (current->delay_ms > 0) {
+        sleep_until(now_ns() + current->delay_ms * 1000000LL);
+    }
+    started_ns = now_ns();
+    sent = 0;
+}
+
+/*
+ * send_response - write part of a response as the current rule allows
+ *
+ * With a rate, bytes go out in chunks, each once the time the rate allows
+ * for everything before it has passed; the stall, if any, comes once the
+ * first stall_after bytes of the response, headers included, are out.
+ * Returns -1 on error, as rio_writen does.
+ */
+ssize_t send_response(int fd, const char *buf, size_t n) {
+    if (current == NULL || (current->rate == 0 && current->stall_ms == 0)) {
+        return rio_writen(fd, buf, n);
+    }
+
+    size_t chunk = current->chunk;
+    if (chunk == 0) {
+        chunk = current->rate > 0 ? (size_t) current->rate / 100 + 1 : n;
+    }
+    size_t left = n;
+    while (left > 0) {
+        size_t len = left < chunk ? left : chunk;
+        bool stalls = current->stall_ms > 0 && sent <= current->stall_after
+                && sent + len > current->stall_after;
+        if (stalls && sent < current->stall_after) {
+            len = current->stall_after - sent; /* Stop at the stall */
+        } else if (stalls) {
+            sleep_until(now_ns() + current->stall_ms * 1000000LL);
+            started_ns += current->stall_ms * 1000000LL;
+        }
+        if (current->rate > 0) {
+            sleep_until(started_ns + (long long) (sent * 1e9 / current->rate));
+        }
+        if (rio_writen(fd, buf, len) < 0) {
+            return -1;
+        }
+        buf += len;
+        left -= len;
+        sent += len;
+    }
+    return n;
+}
+
 /*
  * serve_static - copy a file back to the client
  */
@@ -154,7 +273,7 @@ void serve_static(int fd, char *filename, int filesize) {
 
     printf("Response headers:\n%s", buf);
 
-    if (rio_writen(fd, buf, buflen) < 0) {
+    if (send_response(fd, buf, buflen) < 0) {
         fprintf(stderr, "Error writing static response headers to client\n");
         return;
     }
@@ -175,7 +294,7 @@ void serve_static(int fd, char *filename, int filesize) {
     }
     close(srcfd);
 
-    if (rio_writen(fd, srcp, filesize) < 0) {
+    if (send_response(fd, srcp, filesize) < 0) {
         fprintf(stderr, "Error writing static file \"%s\" to client\n",
                 filename);
         // Fall through to cleanup
@@ -204,7 +323,7 @@ void serve_dynamic(int fd, char *filename, char *cgiargs) {
     }
 
     /* Write first part of HTTP response */
-    if (rio_writen(fd, buf, buflen) < 0) {
+    if (send_response(fd, buf, buflen) < 0) {
         fprintf(stderr, "Error writing dynamic response headers to client\n");
         return;
     }
@@ -272,13 +391,13 @@ void clienterror(int fd, const char *errnum, const char *shortmsg,
     }
 
     /* Write the headers */
-    if (rio_writen(fd, buf, buflen) < 0) {
+    if (send_response(fd, buf, buflen) < 0) {
         fprintf(stderr, "Error writing error response headers to client\n");
         return;
     }
 
     /* Write the body */
-    if (rio_writen(fd, body, bodylen) < 0) {
+    if (send_response(fd, body, bodylen) < 0) {
         fprintf(stderr, "Error writing error response body to client\n");
         return;
     }
@@ -338,6 +457,10 @@ void serve(client_info *client) {
         fprintf(stderr, "getnameinfo failed: %s\n", gai_strerror(res));
     }
 
+    if (accept_ms > 0) {
+        sleep_until(now_ns() + accept_ms * 1000000LL);
+    }
+
     rio_t rio;
     rio_readinitb(&rio, client->connfd);
 
@@ -375,6 +498,9 @@ void serve(client_info *client) {
         return;
     }
 
+    /* Slow the response down as the rules say; CGI output is not paced */
+    start_response(uri);
+
     /* Parse URI from GET request */
     char filename[MAXLINE], cgiargs[MAXLINE];
     parse_result result = parse_uri(uri, filename, cgiargs);
@@ -409,18 +535,166 @@ void serve(client_info *client) {
     }
 }
 
+/*
+ * parse_setting - set one field of a rule from "name=value"
+ *
+ * Names are delay (ms), rate (bytes/s), chunk (bytes) and stall
+ * (ms@bytes). Returns false if the setting is not one of these.
+ */
+bool parse_setting(shaping *rule, const char *setting) {
+    char name[MAXLINE];
+    long value;
+    char *end;
+
+    const char *eq = strchr(setting, '=');
+    if (eq == NULL || eq == setting || eq - setting >= MAXLINE) {
+        return false;
+    }
+    snprintf(name, sizeof(name), "%.*s", (int) (eq - setting), setting);
+    value = strtol(eq + 1, &end, 10);
+    if (end == eq + 1 || value < 0) {
+        return false;
+    }
+
+    if (strcmp(name, "delay") == 0 && *end == '\0') {
+        rule->delay_ms = value;
+    } else if (strcmp(name, "rate") == 0 && *end == '\0') {
+        rule->rate = value;
+    } else if (strcmp(name, "chunk") == 0 && *end == '\0') {
+        rule->chunk = value;
+    } else if (strcmp(name, "stall") == 0 && *end == '@') {
+        rule->stall_ms = value;
+        rule->stall_after = strtoul(end + 1, &end, 10);
+        return *end == '\0';
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/*
+ * read_rules - read per-prefix rules from a file
+ *
+ * Each line is a URI prefix followed by settings, as in
+ *
+ *     /cgi-bin/ delay=200
+ *     /big      delay=50 rate=1000000 chunk=1460 stall=500@65536
+ *
+ * The first rule whose prefix a URI starts with applies to it, and URIs
+ * no rule matches get the settings from the command line. Blank lines
+ * and lines starting with # are skipped. Exits on any error.
+ */
+void read_rules(const char *path) {
+    char line[MAXLINE];
+    int lineno = 0;
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        perror(path);
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lineno++;
+        char *save;
+        char *tok = strtok_r(line, " \t\r\n", &save);
+        if (tok == NULL || tok[0] == '#') {
+            continue;
+        }
+        if (nrules == MAXRULES) {
+            fprintf(stderr, "%s: more than %d rules\n", path, MAXRULES);
+            exit(1);
+        }
+
+        shaping *rule = &rules[nrules++];
+        snprintf(rule->prefix, sizeof(rule->prefix), "%s", tok);
+        while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+            if (!parse_setting(rule, tok)) {
+                fprintf(stderr, "%s:%d: bad setting \"%s\"\n",
+                        path, lineno, tok);
+                exit(1);
+            }
+        }
+    }
+    fclose(fp);
+}
+
+/*
+ * usage - print how to run tiny, and exit
+ */
+void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-d <ms>] [-r <bytes/s>] [-k <bytes>] "
+            "[-s <ms>@<bytes>]\n"
+            "          [-a <ms>] [-c <rules file>] [-f] <port>\n"
+            "  -d  delay before the first byte of each response\n"
+            "  -r  cap on each response's rate\n"
+            "  -k  bytes per paced write (default 10 ms worth)\n"
+            "  -s  pause once, after that many bytes of a response\n"
+            "  -a  wait after accepting a connection\n"
+            "  -c  per-URI-prefix settings, see read_rules in tiny.c\n"
+            "  -f  serve each connection in a child process, even at full"
+            " speed\n",
+            prog);
+    exit(1);
+}
+
 int main(int argc, char **argv) {
     int listenfd;
+    const char *rules_path = NULL;
+    bool forking = false;
+    char setting[MAXLINE];
+    int opt;
+
+    /* The command line's settings go in the rule after the file's */
+    shaping global;
+    memset(&global, 0, sizeof(global));
+    while ((opt = getopt(argc, argv, "d:r:k:s:a:c:fh")) != -1) {
+        const char *name = NULL;
+        switch (opt) {
+        case 'd': name = "delay"; break;
+        case 'r': name = "rate"; break;
+        case 'k': name = "chunk"; break;
+        case 's': name = "stall"; break;
+        case 'a':
+            accept_ms = atol(optarg);
+            break;
+        case 'c':
+            rules_path = optarg;
+            break;
+        case 'f':
+            forking = true;
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+        }
+        if (name != NULL) {
+            snprintf(setting, sizeof(setting), "%s=%s", name, optarg);
+            if (!parse_setting(&global, setting)) {
+                usage(argv[0]);
+            }
+        }
+    }
 
     /* Check command line args */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
-        exit(1);
+    if (argc - optind != 1) {
+        usage(argv[0]);
+    }
+    if (rules_path != NULL) {
+        read_rules(rules_path);
     }
+    rules[nrules] = global;
 
-    listenfd = open_listenfd(argv[1]);
+    /* Serve connections side by side if any of them may be slowed down */
+    forking = forking || accept_ms > 0 || nrules > 0 || global.delay_ms > 0
+            || global.rate > 0 || global.stall_ms > 0;
+    if (forking) {
+        signal(SIGCHLD, SIG_IGN);   /* Reap children automatically */
+    }
+
+    listenfd = open_listenfd(argv[optind]);
     if (listenfd < 0) {
-        fprintf(stderr, "Failed to listen on port: %s\n", argv[1]);
+        fprintf(stderr, "Failed to listen on port: %s\n", argv[optind]);
         exit(1);
     }
 
@@ -441,7 +715,24 @@ int main(int argc, char **argv) {
         }
 
         /* Connection is established; serve client */
-        serve(client);
+        if (!forking) {
+            serve(client);
+            close(client->connfd);
+            continue;
+        }
+
+        pid_t pid = fork();
+        if (pid == 0) { /* Child */
+            /* serve_dynamic waits for its own child */
+            signal(SIGCHLD, SIG_DFL);
+            close(listenfd);
+            serve(client);
+            close(client->connfd);
+            exit(0);
+        }
+        if (pid < 0) {
+            perror("fork");
+        }
         close(client->connfd);
     }
 }
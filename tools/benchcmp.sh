@@ -0,0 +1,168 @@
+#!/usr/bin/env bash
+#
+# benchcmp.sh - Compare the performance of ./proxy against ./proxy-ref
+#
+# Runs the same load profiles through each proxy in turn, with one tiny
+# as the origin for both, and prints their throughput, latency and peak
+# memory side by side. Each run is preceded by a second of warm-up load,
+# so that the hit-heavy profiles measure warm caches. Exits with status 1
+# if ./proxy does worse than ./proxy-ref by more than the threshold on
+# any profile: lower throughput, or higher p99 latency.
+#
+# usage: benchcmp.sh [-d <secs>] [-T <percent>] [profile]...
+#
+
+cd "$(dirname "$0")" || exit 1
+
+PROXY=../proxy
+REF=../proxy-ref
+TINY=../tiny/tiny
+LOADGEN=./loadgen
+WORK=bench-compare
+
+DURATION=10
+THRESHOLD=15
+
+PORT=$(../port-for-user.pl | cut -d' ' -f2)
+PROXY_PORT=$PORT
+ORIGIN_PORT=$((PORT + 1))
+
+# Per profile: objects, their sizes, the rest of the loadgen options, and
+# how tiny slows its responses down. The slow origin answers after 20 ms;
+# the slow link also sends no more than 1 MB/s per response. tiny serves
+# each connection in a child process in every profile (-f), so that the
+# proxy's misses reach it side by side, as they would a real origin.
+PROFILES="hit-heavy miss-heavy large-object high-concurrency slow-origin
+  slow-link"
+declare -A OBJECTS=(
+  [hit-heavy]=100 [miss-heavy]=5000 [large-object]=20
+  [high-concurrency]=200 [slow-origin]=1000 [slow-link]=500)
+declare -A SIZES=(
+  [hit-heavy]=1024-16384 [miss-heavy]=8192-65536
+  [large-object]=131072-1048576 [high-concurrency]=1024-16384
+  [slow-origin]=1024-16384 [slow-link]=8192-262144)
+declare -A ARGS=(
+  [hit-heavy]="-c 16 -z 1.2" [miss-heavy]="-c 16"
+  [large-object]="-c 8" [high-concurrency]="-c 256 -z 0.99"
+  [slow-origin]="-c 32" [slow-link]="-c 32 -z 0.99")
+declare -A ORIGIN=(
+  [slow-origin]="-d 20" [slow-link]="-d 40 -r 1000000")
+
+usage() {
+  echo "usage: $0 [-d <secs>] [-T <percent>] [profile]..."
+  echo "  profiles: $PROFILES"
+  exit 2
+}
+
+while getopts "d:T:" opt; do
+  case $opt in
+    d) DURATION=$OPTARG ;;
+    T) THRESHOLD=$OPTARG ;;
+    *) usage ;;
+  esac
+done
+shift $((OPTIND - 1))
+selected=${*:-$PROFILES}
+for profile in $selected; do
+  [ -n "${OBJECTS[$profile]}" ] || usage
+done
+for prog in $PROXY $REF $TINY $LOADGEN; do
+  if [ ! -x $prog ]; then
+    echo "$prog not found, build it first" >&2
+    exit 2
+  fi
+done
+
+# wait_port - wait up to 5 s for something to listen on a port
+wait_port() {
+  for _ in $(seq 50); do
+    if (exec 3<>/dev/tcp/localhost/$1) 2>/dev/null; then
+      return 0
+    fi
+    sleep 0.1
+  done
+  return 1
+}
+
+# stop - kill a process started in the background and reap it quietly
+stop() {
+  kill $1 2>/dev/null
+  wait $1 2>/dev/null
+}
+
+# peak_rss - peak resident memory of a process and its children, in MB
+peak_rss() {
+  local kb=0
+  for pid in $1 $(pgrep -P $1); do
+    kb=$((kb + $(awk '/^VmHWM/ { print $2 }' /proc/$pid/status)))
+  done
+  awk -v kb=$kb 'BEGIN { printf "%.1f", kb / 1024 }'
+}
+
+# make_objects - fill a profile's directory with what the origin serves
+make_objects() {
+  local dir=$WORK/$1
+  mkdir -p $dir
+  $LOADGEN -w $dir -n ${OBJECTS[$1]} -s ${SIZES[$1]} >/dev/null || exit 2
+}
+
+# run_proxy - run a profile through a proxy, printing
+# "req/s p50_us p99_us max_us rss_mb errors"
+run_proxy() {
+  local proxy=$1 profile=$2
+  local load="$LOADGEN -n ${OBJECTS[$profile]} ${ARGS[$profile]}"
+  local targets="localhost:$PROXY_PORT localhost:$ORIGIN_PORT"
+
+  $proxy $PROXY_PORT >/dev/null 2>&1 &
+  local pid=$!
+  if ! wait_port $PROXY_PORT; then
+    echo "$proxy did not start" >&2
+    stop $pid
+    exit 2
+  fi
+  $load -d 1 $targets >/dev/null
+  local out
+  out=$($load -d $DURATION $targets)
+  local rss
+  rss=$(peak_rss $pid)
+  stop $pid
+
+  echo "$out" | awk -v rss=$rss '
+    /^requests/ { rps = $3; gsub(/[(),]|\/s/, "", rps); errors = $(NF - 1) }
+    /^ *mean_us/ { getline; p50 = $2; p99 = $4; max = $7 }
+    END { print rps + 0, p50 + 0, p99 + 0, max + 0, rss, errors + 0 }'
+}
+
+printf "%-16s %-9s %10s %10s %10s %10s %8s %7s\n" profile proxy req/s \
+  p50_us p99_us max_us rss_mb errors
+status=0
+for profile in $selected; do
+  make_objects $profile
+  (cd $WORK/$profile && exec ../../$TINY -f ${ORIGIN[$profile]} $ORIGIN_PORT) \
+    >/dev/null 2>&1 &
+  tiny=$!
+  if ! wait_port $ORIGIN_PORT; then
+    echo "tiny did not start" >&2
+    exit 2
+  fi
+  mine=$(run_proxy $PROXY $profile)
+  ref=$(run_proxy $REF $profile)
+  stop $tiny
+
+  echo "$mine $ref" | awk -v profile=$profile -v threshold=$THRESHOLD '
+    function change(new, old) {
+      return old > 0 ? 100 * (new - old) / old : 0
+    }
+    {
+      fmt = "%-16s %-9s %10.1f %10.1f %10.1f %10.1f %8.1f %7d\n"
+      printf fmt, profile, "proxy", $1, $2, $3, $4, $5, $6
+      printf fmt, "", "proxy-ref", $7, $8, $9, $10, $11, $12
+      rps = change($1, $7)
+      p99 = change($3, $9)
+      regressed = rps < -threshold || p99 > threshold
+      printf "%-16s %-9s %+9.1f%% %10s %+9.1f%% %10s %8s %7s\n", "", \
+        "change", rps, "", p99, "", "", regressed ? "WORSE" : "ok"
+      exit regressed
+    }' || status=1
+done
+exit $status
@@ -0,0 +1,378 @@
+/**
+ * @file cachebench.c
+ * @brief Measures the cache of proxy_cache.c on its own, without sockets
+ *
+ * Links proxy_cache.c as the proxy does and runs a mix of lookups and
+ * inserts on one cache from many threads at once. Before the run, a set
+ * of resident keys is inserted; during it, each operation is
+ *
+ *   - with the insert ratio, an insert of a key never seen before, which
+ *     makes the cache evict;
+ *   - otherwise a lookup, for a resident key with the hit ratio and for a
+ *     key that was never inserted otherwise. A resident key that misses,
+ *     having been evicted, is inserted again, as the proxy does.
+ *
+ * So the hit ratio is what was asked for as long as the resident keys fit
+ * in the cache and the inserts do not push them out; the ratio reached is
+ * reported alongside. Every object has bytes of its own, so that no two
+ * share a body. The report gives operations per second, latency
+ * percentiles of hits, misses and inserts, and the time threads spent
+ * waiting for the cache lock.
+ *
+ * usage: cachebench [-t <threads>] [-d <secs>] [-k <keys>]
+ *                   [-s <bytes>[-<max bytes>]] [-h <hit %>] [-i <insert %>]
+ *                   [-z <skew>] [-H <hot objects>]
+ *
+ * @author Taiming Liu <taimingl@andrew.cmu.edu>
+ */
+#include "hist.h"
+#include "proxy_cache.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEF_THREADS 4
+#define DEF_SECONDS 5
+#define DEF_KEYS 64
+#define DEF_SIZES "1024-16384"
+#define DEF_HIT_PCT 90
+#define DEF_INSERT_PCT 1
+
+/* Longest key the benchmark makes */
+#define KEY_LEN 64
+
+/* What an operation turned out to be */
+typedef enum op {
+    OP_HIT,
+    OP_MISS,
+    OP_INSERT,
+    NUM_OPS
+} op_t;
+
+static const char *op_names[NUM_OPS] = {
+    [OP_HIT] = "hit",
+    [OP_MISS] = "miss",
+    [OP_INSERT] = "insert",
+};
+
+/* A thread of the benchmark */
+typedef struct worker {
+    pthread_t tid;
+    unsigned int index;
+    uint64_t rng;           /* xorshift state */
+    unsigned long resident; /* lookups of resident keys */
+    unsigned long lock_us;  /* time spent waiting for the cache lock */
+    hist_t hists[NUM_OPS];
+} worker_t;
+
+static struct {
+    unsigned int threads;
+    unsigned int seconds;
+    unsigned int keys;
+    const char *sizes;
+    double hit_pct;
+    double insert_pct;
+    double skew;
+    unsigned int hot_objects;
+} opts = {DEF_THREADS, DEF_SECONDS,    DEF_KEYS, DEF_SIZES,
+          DEF_HIT_PCT, DEF_INSERT_PCT, 0,        0};
+
+static cache_t *cache;
+
+/* Smallest and largest object */
+static size_t min_size;
+static size_t max_size;
+
+/* Size of each resident object */
+static size_t *key_sizes;
+
+/* Chance of picking each resident key or one before it */
+static double *popularity;
+
+/* Monotonic ns the run ends at */
+static long long run_end;
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-t <threads>] [-d <secs>] [-k <keys>]\n"
+            "          [-s <bytes>[-<max bytes>]] [-h <hit %%>] "
+            "[-i <insert %%>]\n"
+            "          [-z <skew>] [-H <hot objects>]\n",
+            prog);
+    exit(1);
+}
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * @brief Returns a random number, by xorshift64*.
+ */
+static uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+/**
+ * @brief Returns a random number in [0, 1).
+ */
+static double next_uniform(uint64_t *state) {
+    return (next_random(state) >> 11) * (1.0 / (1ULL << 53));
+}
+
+/**
+ * @brief Returns a random object size, spread evenly on a log scale.
+ */
+static size_t pick_size(uint64_t *rng) {
+    double scale = pow((double)max_size / min_size, next_uniform(rng));
+    return (size_t)(min_size * scale);
+}
+
+/**
+ * @brief Picks a resident key by a Zipf law, uniformly if the skew is 0.
+ */
+static unsigned int pick_key(uint64_t *rng) {
+    double u = next_uniform(rng);
+    unsigned int low = 0;
+    unsigned int high = opts.keys - 1;
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (popularity[mid] <= u) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/**
+ * @brief Makes an object's bytes, which start with its key so that they
+ * differ from those of any other object.
+ */
+static void fill_value(char *value, const char *key, size_t size) {
+    size_t len = strlen(key);
+    memcpy(value, key, len < size ? len : size);
+}
+
+/**
+ * @brief Inserts a key, timing it.
+ */
+static void time_insert(worker_t *worker, char *key, char *value,
+                        size_t size) {
+    fill_value(value, key, size);
+    long long start = now_ns();
+    insert_cache(cache, key, value, size);
+    hist_record(&worker->hists[OP_INSERT], now_ns() - start);
+}
+
+/**
+ * @brief Runs operations until the end of the run.
+ */
+static void *run_worker(void *vargp) {
+    worker_t *worker = vargp;
+    char key[KEY_LEN];
+    unsigned long inserted = 0;
+    char *value = malloc(MAX_OBJECT_SIZE);
+    if (value == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    memset(value, 'a' + worker->index % 26, MAX_OBJECT_SIZE);
+    while (now_ns() < run_end) {
+        double u = next_uniform(&worker->rng) * 100;
+        if (u < opts.insert_pct) {
+            snprintf(key, sizeof(key), "http://bench.local/new%u-%lu",
+                     worker->index, inserted++);
+            time_insert(worker, key, value, pick_size(&worker->rng));
+            continue;
+        }
+
+        unsigned int k = 0;
+        bool resident = u - opts.insert_pct <
+                        opts.hit_pct * (100 - opts.insert_pct) / 100;
+        if (resident) {
+            k = pick_key(&worker->rng);
+            snprintf(key, sizeof(key), "http://bench.local/obj%u", k);
+            worker->resident++;
+        } else {
+            snprintf(key, sizeof(key), "http://bench.local/absent%lu",
+                     (unsigned long)next_random(&worker->rng));
+        }
+        long long start = now_ns();
+        size_t size = retrieve_cache(cache, key, value);
+        long long ns = now_ns() - start;
+        hist_record(&worker->hists[size > 0 ? OP_HIT : OP_MISS], ns);
+        if (size == 0 && resident) {
+            time_insert(worker, key, value, key_sizes[k]);
+        }
+    }
+    worker->lock_us = stats_thread_sum(HIST_CACHE_LOCK);
+    free(value);
+    return NULL;
+}
+
+/**
+ * @brief Makes the resident keys and inserts them.
+ */
+static void init_keys(void) {
+    static char value[MAX_OBJECT_SIZE];
+    char key[KEY_LEN];
+    uint64_t rng = 0x9e3779b97f4a7c15ULL;
+    key_sizes = malloc(opts.keys * sizeof(size_t));
+    popularity = malloc(opts.keys * sizeof(double));
+    if (key_sizes == NULL || popularity == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    double sum = 0;
+    memset(value, 'a', sizeof(value));
+    for (unsigned int i = 0; i < opts.keys; i++) {
+        sum += 1 / pow(i + 1, opts.skew);
+        popularity[i] = sum;
+        key_sizes[i] = pick_size(&rng);
+        snprintf(key, sizeof(key), "http://bench.local/obj%u", i);
+        fill_value(value, key, key_sizes[i]);
+        insert_cache(cache, key, value, key_sizes[i]);
+    }
+    for (unsigned int i = 0; i < opts.keys; i++) {
+        popularity[i] /= sum;
+    }
+}
+
+/**
+ * @brief Prints what the threads measured.
+ */
+static void print_report(worker_t *workers, double elapsed) {
+    static hist_t hists[NUM_OPS];
+    unsigned long resident = 0;
+    unsigned long lock_us = 0;
+    for (unsigned int i = 0; i < opts.threads; i++) {
+        for (int op = 0; op < NUM_OPS; op++) {
+            hist_merge(&hists[op], &workers[i].hists[op]);
+        }
+        resident += workers[i].resident;
+        lock_us += workers[i].lock_us;
+    }
+    unsigned long hits = hists[OP_HIT].total;
+    unsigned long lookups = hits + hists[OP_MISS].total;
+    unsigned long ops = lookups + hists[OP_INSERT].total;
+
+    printf("%u threads, %u keys of %zu-%zu bytes, %.0f%% of lookups for "
+           "them, %.0f%% inserts, skew %.2f, %u hot objects, %.1f s\n",
+           opts.threads, opts.keys, min_size, max_size, opts.hit_pct,
+           opts.insert_pct, opts.skew, opts.hot_objects, elapsed);
+    printf("ops        %lu (%.0f/s)\n", ops, ops / elapsed);
+    printf("hits       %lu, %.1f%% of lookups, %.1f%% of resident key "
+           "lookups\n",
+           hits, lookups > 0 ? 100.0 * hits / lookups : 0,
+           resident > 0 ? 100.0 * hits / resident : 0);
+    printf("evictions  %lu\n", cache->evictions);
+    printf("lock wait  %lu us, %.2f%% of thread time\n", lock_us,
+           lock_us / (elapsed * 1e4 * opts.threads));
+    printf("%-6s %10s %9s %9s %9s %9s %9s %9s\n", "op", "count", "mean_ns",
+           "p50_ns", "p90_ns", "p99_ns", "p99.9_ns", "max_ns");
+    for (int op = 0; op < NUM_OPS; op++) {
+        const hist_t *hist = &hists[op];
+        printf("%-6s %10lu %9.0f %9lld %9lld %9lld %9lld %9lld\n",
+               op_names[op], hist->total, hist_mean(hist),
+               hist_percentile(hist, 50), hist_percentile(hist, 90),
+               hist_percentile(hist, 99), hist_percentile(hist, 99.9),
+               hist->max);
+    }
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "t:d:k:s:h:i:z:H:")) != -1) {
+        switch (opt) {
+        case 't':
+            opts.threads = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            opts.seconds = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'k':
+            opts.keys = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            opts.sizes = optarg;
+            break;
+        case 'h':
+            opts.hit_pct = strtod(optarg, NULL);
+            break;
+        case 'i':
+            opts.insert_pct = strtod(optarg, NULL);
+            break;
+        case 'z':
+            opts.skew = strtod(optarg, NULL);
+            break;
+        case 'H':
+            opts.hot_objects = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    char *end;
+    min_size = strtoul(opts.sizes, &end, 10);
+    max_size = *end == '-' ? strtoul(end + 1, NULL, 10) : min_size;
+    if (optind != argc || opts.threads == 0 || opts.seconds == 0 ||
+        opts.keys == 0 || min_size == 0 || max_size < min_size ||
+        max_size > MAX_OBJECT_SIZE || opts.hit_pct < 0 ||
+        opts.hit_pct > 100 || opts.insert_pct < 0 || opts.insert_pct > 100 ||
+        opts.skew < 0) {
+        usage(argv[0]);
+    }
+
+    init_stats();
+    if ((cache = new_cache(-1)) == NULL) {
+        fprintf(stderr, "Error mapping the cache\n");
+        exit(1);
+    }
+    start_evictor(cache);
+    set_hot_objects(opts.hot_objects);
+    init_keys();
+
+    worker_t *workers = calloc(opts.threads, sizeof(worker_t));
+    if (workers == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    long long start = now_ns();
+    run_end = start + opts.seconds * 1000000000LL;
+    for (unsigned int i = 0; i < opts.threads; i++) {
+        workers[i].index = i;
+        workers[i].rng = (uint64_t)start ^ ((i + 1) * 0x9e3779b97f4a7c15ULL);
+        if (pthread_create(&workers[i].tid, NULL, run_worker, &workers[i]) !=
+            0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (unsigned int i = 0; i < opts.threads; i++) {
+        pthread_join(workers[i].tid, NULL);
+    }
+    print_report(workers, (now_ns() - start) / 1e9);
+
+    free(workers);
+    free(key_sizes);
+    free(popularity);
+    return 0;
+}
@@ -0,0 +1,569 @@
+/**
+ * @file cachesim.c
+ * @brief Replays a request trace through caches of many sizes, offline
+ *
+ * Answers how large the cache should be, and whether another policy would
+ * serve a workload better, from a trace of what clients asked for. The
+ * trace is either an access log of the proxy (proxy -l), or lines of
+ *
+ *   [<seconds>] <key> <bytes>
+ *
+ * as other logs are easily turned into. Requests are replayed in order of
+ * time, one after the other, through a cache of each size given, under
+ * each policy given:
+ *
+ *   - proxy: proxy_cache.c itself, built with a MAX_CACHE_SIZE large enough
+ *     for any size asked for, and with its clock driven by the trace, so
+ *     that runs do not depend on how fast the machine replays them;
+ *   - lru: exact least recently used, every hit moving its object first;
+ *   - fifo: objects evicted in the order they came in, hits or not.
+ *
+ * Every policy caches what the proxy does, objects under MAX_OBJECT_SIZE,
+ * and counts only their bytes against the size. No evictor thread runs,
+ * so runs are repeatable; inserts free and evict what they need. For each
+ * size and policy, the hit ratio, the byte hit ratio (bytes served from
+ * the cache over bytes asked for), evictions and the replay speed are
+ * printed, one line each, so that the curves plot straight from them.
+ *
+ * lru and fifo replay tens of millions of requests a second, proxy over a
+ * million at high hit ratios, at any size. Its hits cost a copy, but every
+ * miss copies and hashes the whole object, so at low hit ratios on large
+ * objects it falls to tens of thousands a second.
+ *
+ * usage: cachesim [-s <size>[,<size>]...] [-p <policy>[,<policy>]...]
+ *                 [-r <req/s>] [trace]
+ *
+ * @author Taiming Liu <taimingl@andrew.cmu.edu>
+ */
+#include "proxy_cache.h"
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEF_SIZES "512K,1M,2M,4M,8M,16M,32M,64M"
+#define DEF_POLICIES "proxy,lru,fifo"
+#define DEF_RATE 1000
+
+/* Most sizes one run simulates */
+#define MAX_SIZES 64
+
+/* Marks the end of a list of objects */
+#define NONE UINT_MAX
+
+/* A request of the trace */
+typedef struct request {
+    long long time_ns; /* since the first request */
+    unsigned int seq;  /* position in the trace, orders requests at once */
+    unsigned int key;  /* index into keys */
+    size_t size;       /* bytes of the response */
+} request_t;
+
+/* What replaying the trace through one cache came to */
+typedef struct result {
+    unsigned long hits;
+    unsigned long long hit_bytes;
+    unsigned long evictions;
+    double seconds;
+} result_t;
+
+/* A way of picking what to evict */
+typedef struct policy {
+    const char *name;
+    void (*run)(size_t capacity, result_t *result);
+} policy_t;
+
+static void run_proxy(size_t capacity, result_t *result);
+static void run_lru(size_t capacity, result_t *result);
+static void run_fifo(size_t capacity, result_t *result);
+
+static const policy_t policies[] = {
+    {"proxy", run_proxy},
+    {"lru", run_lru},
+    {"fifo", run_fifo},
+};
+
+#define NUM_POLICIES (sizeof(policies) / sizeof(policies[0]))
+
+/* The trace, in order of time once loaded */
+static request_t *requests;
+static size_t nrequests;
+
+/* Distinct keys of the trace, interned through an open-addressed index */
+static char **keys;
+static unsigned int nkeys;
+static unsigned int *key_index; /* key + 1, 0 when free */
+static size_t index_size;       /* a power of two */
+
+/* Time as proxy_cache.c sees it while replaying */
+static long long sim_now;
+
+/* Response bytes inserted into the cache, whatever a request asks for */
+static char value[MAX_OBJECT_SIZE];
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-s <size>[,<size>]...] [-p <policy>[,<policy>]...]\n"
+            "          [-r <req/s>] [trace]\n"
+            "  sizes take K, M or G; policies: proxy lru fifo\n",
+            prog);
+    exit(1);
+}
+
+/**
+ * @brief Returns the time of the request being replayed, for
+ * proxy_cache.c, which is built with CACHE_CLOCK=sim_clock_ns.
+ */
+long long sim_clock_ns(void) {
+    return sim_now;
+}
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void *xrealloc(void *ptr, size_t size) {
+    if ((ptr = realloc(ptr, size)) == NULL) {
+        perror("realloc");
+        exit(1);
+    }
+    return ptr;
+}
+
+/**
+ * @brief Returns the FNV-1a hash of a key.
+ */
+static uint64_t hash_key(const char *key, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)key[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/**
+ * @brief Returns the index of a key, adding it if it is new.
+ * @param[in] key the key, not terminated.
+ * @param[in] len its length.
+ *
+ * The index is kept at most half full, doubling as keys come.
+ */
+static unsigned int intern_key(const char *key, size_t len) {
+    if (2 * (nkeys + 1) > index_size) {
+        size_t old_size = index_size;
+        unsigned int *old = key_index;
+        index_size = old_size > 0 ? 2 * old_size : 1024;
+        if ((key_index = calloc(index_size, sizeof(unsigned int))) == NULL) {
+            perror("calloc");
+            exit(1);
+        }
+        for (size_t i = 0; i < old_size; i++) {
+            if (old[i] != 0) {
+                const char *k = keys[old[i] - 1];
+                size_t slot = hash_key(k, strlen(k)) & (index_size - 1);
+                while (key_index[slot] != 0) {
+                    slot = (slot + 1) & (index_size - 1);
+                }
+                key_index[slot] = old[i];
+            }
+        }
+        free(old);
+        keys = xrealloc(keys, index_size / 2 * sizeof(char *));
+    }
+
+    size_t slot = hash_key(key, len) & (index_size - 1);
+    for (; key_index[slot] != 0; slot = (slot + 1) & (index_size - 1)) {
+        const char *k = keys[key_index[slot] - 1];
+        if (strncmp(k, key, len) == 0 && k[len] == '\0') {
+            return key_index[slot] - 1;
+        }
+    }
+    char *copy = xrealloc(NULL, len + 1);
+    memcpy(copy, key, len);
+    copy[len] = '\0';
+    keys[nkeys] = copy;
+    key_index[slot] = ++nkeys;
+    return nkeys - 1;
+}
+
+/**
+ * @brief Parses a line of the trace into a request.
+ * @param[in] line the line.
+ * @param[out] request the request; its time is in seconds for now.
+ * @param[out] timed whether the line has a time.
+ *
+ * Proxy access log lines are told apart by their uri field; every status
+ * counts, since the proxy caches whatever it gets whole. Returns false
+ * for lines that are blank, comments, or not understood.
+ */
+static bool parse_line(char *line, request_t *request, bool *timed) {
+    const char *key;
+    size_t len;
+    double seconds = 0;
+    char *uri = strstr(line, " uri=\"");
+    if (uri != NULL) {
+        char *bytes = strstr(line, " bytes=");
+        key = uri + strlen(" uri=\"");
+        char *end = strchr(key, '"');
+        if (strncmp(line, "time=", 5) != 0 || end == NULL || bytes == NULL) {
+            return false;
+        }
+        seconds = strtod(line + 5, NULL);
+        len = (size_t)(end - key);
+        request->size = strtoul(bytes + strlen(" bytes="), NULL, 10);
+        *timed = true;
+    } else {
+        char *fields[3];
+        int n = 0;
+        char *save;
+        for (char *tok = strtok_r(line, " \t\r\n", &save);
+             tok != NULL && n < 3; tok = strtok_r(NULL, " \t\r\n", &save)) {
+            fields[n++] = tok;
+        }
+        if (n < 2 || fields[0][0] == '#') {
+            return false;
+        }
+        if (n == 3) {
+            seconds = strtod(fields[0], NULL);
+        }
+        key = fields[n - 2];
+        len = strlen(key);
+        request->size = strtoul(fields[n - 1], NULL, 10);
+        *timed = n == 3;
+    }
+    request->time_ns = (long long)(seconds * 1e9);
+    request->key = intern_key(key, len);
+    return true;
+}
+
+static int compare_requests(const void *a, const void *b) {
+    const request_t *x = a, *y = b;
+    if (x->time_ns != y->time_ns) {
+        return x->time_ns < y->time_ns ? -1 : 1;
+    }
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/**
+ * @brief Reads the trace and puts it in order of time.
+ * @param[in] file the trace.
+ * @param[in] rate requests per second assumed if any line has no time.
+ *
+ * Log lines are written as requests finish, so they are sorted by when
+ * they were logged, ties kept in file order. Times start at one second,
+ * as the proxy's monotonic clock would, rather than at 0.
+ */
+static void load_trace(FILE *file, double rate) {
+    char *line = NULL;
+    size_t line_size = 0;
+    size_t cap = 0;
+    bool all_timed = true;
+    while (getline(&line, &line_size, file) != -1) {
+        if (nrequests == cap) {
+            cap = cap > 0 ? 2 * cap : 4096;
+            requests = xrealloc(requests, cap * sizeof(request_t));
+        }
+        request_t *request = &requests[nrequests];
+        bool timed;
+        if (parse_line(line, request, &timed)) {
+            request->seq = (unsigned int)nrequests++;
+            all_timed = all_timed && timed;
+        }
+    }
+    free(line);
+
+    if (all_timed) {
+        qsort(requests, nrequests, sizeof(request_t), compare_requests);
+    }
+    long long first = nrequests > 0 ? requests[0].time_ns : 0;
+    for (size_t i = 0; i < nrequests; i++) {
+        requests[i].time_ns =
+            1000000000LL + (all_timed ? requests[i].time_ns - first
+                                      : (long long)(i * 1e9 / rate));
+    }
+}
+
+/**
+ * @brief Prints what the trace holds, and the most any cache could hit:
+ * everything but the first request for each object it may cache.
+ */
+static void print_trace_summary(void) {
+    bool *seen = calloc(nkeys > 0 ? nkeys : 1, sizeof(bool));
+    if (seen == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    unsigned long long bytes = 0, large_bytes = 0, max_hit_bytes = 0;
+    unsigned long large = 0, max_hits = 0;
+    for (size_t i = 0; i < nrequests; i++) {
+        const request_t *request = &requests[i];
+        bytes += request->size;
+        if (request->size >= MAX_OBJECT_SIZE) {
+            large++;
+            large_bytes += request->size;
+        } else if (seen[request->key]) {
+            max_hits++;
+            max_hit_bytes += request->size;
+        } else {
+            seen[request->key] = true;
+        }
+    }
+    free(seen);
+
+    double span = nrequests > 0
+                      ? (requests[nrequests - 1].time_ns -
+                         requests[0].time_ns) / 1e9
+                      : 0;
+    double n = nrequests > 0 ? nrequests : 1;
+    double b = bytes > 0 ? bytes : 1;
+    printf("# %zu requests over %.1f s, %u objects, %.1f MB\n", nrequests,
+           span, nkeys, bytes / 1e6);
+    printf("# %.2f%% of requests, %.2f%% of bytes, too large to cache\n",
+           100 * large / n, 100 * large_bytes / b);
+    printf("# an unbounded cache would hit %.2f%%, %.2f%% of bytes\n",
+           100 * max_hits / n, 100 * max_hit_bytes / b);
+}
+
+/**
+ * @brief Replays the trace through proxy_cache.c.
+ * @param[in] capacity bytes the cache may hold.
+ * @param[out] result what came of it.
+ *
+ * A miss inserts the object as the proxy would after fetching it; every
+ * object gets bytes of its own, so that no two share a body.
+ */
+static void run_proxy(size_t capacity, result_t *result) {
+    cache_t *cache = new_cache(-1);
+    if (cache == NULL) {
+        fprintf(stderr, "Error mapping the cache\n");
+        exit(1);
+    }
+    set_cache_capacity(cache, capacity);
+
+    for (size_t i = 0; i < nrequests; i++) {
+        const request_t *request = &requests[i];
+        char *key = keys[request->key];
+        sim_now = request->time_ns;
+        if (retrieve_cache(cache, key, value) > 0) {
+            result->hits++;
+            result->hit_bytes += request->size;
+        } else if (request->size > 0 && request->size < MAX_OBJECT_SIZE) {
+            memcpy(value, &request->key, sizeof(request->key));
+            insert_cache(cache, key, value, request->size);
+        }
+    }
+    result->evictions = cache->evictions;
+    free_cache(cache);
+}
+
+/**
+ * @brief Replays the trace through a list of objects, evicting from its
+ * tail.
+ * @param[in] capacity bytes the cache may hold.
+ * @param[out] result what came of it.
+ * @param[in] move_on_hit whether a hit moves the object to the head.
+ *
+ */
+static void run_list(size_t capacity, result_t *result, bool move_on_hit) {
+    size_t *cached = calloc(nkeys, sizeof(size_t)); /* 0 when not cached */
+    unsigned int *prev = malloc(nkeys * sizeof(unsigned int));
+    unsigned int *next = malloc(nkeys * sizeof(unsigned int));
+    if (nkeys > 0 && (cached == NULL || prev == NULL || next == NULL)) {
+        perror("malloc");
+        exit(1);
+    }
+    unsigned int head = NONE, tail = NONE;
+    size_t used = 0;
+
+    for (size_t i = 0; i < nrequests; i++) {
+        const request_t *request = &requests[i];
+        unsigned int key = request->key;
+        bool hit = cached[key] > 0;
+        if (hit) {
+            result->hits++;
+            result->hit_bytes += request->size;
+        }
+        if (hit ? !move_on_hit || key == head
+                : request->size == 0 || request->size >= MAX_OBJECT_SIZE) {
+            continue;
+        }
+
+        if (hit) {
+            // unlink it, to link it back in at the head
+            next[prev[key]] = next[key];
+            if (key == tail) {
+                tail = prev[key];
+            } else {
+                prev[next[key]] = prev[key];
+            }
+        } else {
+            while (used + request->size > capacity) {
+                unsigned int lru = tail;
+                tail = prev[lru];
+                if (tail == NONE) {
+                    head = NONE;
+                } else {
+                    next[tail] = NONE;
+                }
+                used -= cached[lru];
+                cached[lru] = 0;
+                result->evictions++;
+            }
+            cached[key] = request->size;
+            used += request->size;
+        }
+        prev[key] = NONE;
+        next[key] = head;
+        if (head != NONE) {
+            prev[head] = key;
+        } else {
+            tail = key;
+        }
+        head = key;
+    }
+    free(cached);
+    free(prev);
+    free(next);
+}
+
+static void run_lru(size_t capacity, result_t *result) {
+    run_list(capacity, result, true);
+}
+
+static void run_fifo(size_t capacity, result_t *result) {
+    run_list(capacity, result, false);
+}
+
+/**
+ * @brief Parses a size such as 512K or 64M.
+ *
+ * Returns 0 if it is not one.
+ */
+static size_t parse_size(const char *str) {
+    char *end;
+    unsigned long long size = strtoull(str, &end, 10);
+    switch (*end) {
+    case 'G':
+        size *= 1024;
+        /* fall through */
+    case 'M':
+        size *= 1024;
+        /* fall through */
+    case 'K':
+        size *= 1024;
+        end++;
+        break;
+    default:
+        break;
+    }
+    return *end == '\0' && end != str ? (size_t)size : 0;
+}
+
+int main(int argc, char **argv) {
+    char sizes_arg[] = DEF_SIZES;
+    char policies_arg[] = DEF_POLICIES;
+    char *sizes_list = sizes_arg;
+    char *policies_list = policies_arg;
+    double rate = DEF_RATE;
+    int opt;
+    while ((opt = getopt(argc, argv, "s:p:r:")) != -1) {
+        switch (opt) {
+        case 's':
+            sizes_list = optarg;
+            break;
+        case 'p':
+            policies_list = optarg;
+            break;
+        case 'r':
+            rate = strtod(optarg, NULL);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind > 1 || rate <= 0) {
+        usage(argv[0]);
+    }
+
+    size_t sizes[MAX_SIZES];
+    unsigned int nsizes = 0;
+    char *save;
+    for (char *tok = strtok_r(sizes_list, ",", &save); tok != NULL;
+         tok = strtok_r(NULL, ",", &save)) {
+        size_t size = parse_size(tok);
+        if (nsizes == MAX_SIZES || size == 0) {
+            usage(argv[0]);
+        }
+        if (size < CACHE_MIN_SIZE || size > MAX_CACHE_SIZE) {
+            fprintf(stderr, "%s: sizes must be from %zuK to %zuM\n", argv[0],
+                    (size_t)CACHE_MIN_SIZE / 1024,
+                    (size_t)MAX_CACHE_SIZE / (1024 * 1024));
+            exit(1);
+        }
+        sizes[nsizes++] = size;
+    }
+    const policy_t *selected[NUM_POLICIES];
+    unsigned int nselected = 0;
+    for (char *tok = strtok_r(policies_list, ",", &save); tok != NULL;
+         tok = strtok_r(NULL, ",", &save)) {
+        unsigned int p = 0;
+        while (p < NUM_POLICIES && strcmp(tok, policies[p].name) != 0) {
+            p++;
+        }
+        if (p == NUM_POLICIES || nselected == NUM_POLICIES) {
+            usage(argv[0]);
+        }
+        selected[nselected++] = &policies[p];
+    }
+
+    FILE *file = stdin;
+    if (optind < argc && (file = fopen(argv[optind], "r")) == NULL) {
+        perror(argv[optind]);
+        exit(1);
+    }
+    load_trace(file, rate);
+    if (file != stdin) {
+        fclose(file);
+    }
+    if (nrequests == 0) {
+        fprintf(stderr, "%s: no requests in the trace\n", argv[0]);
+        exit(1);
+    }
+    init_stats();
+    print_trace_summary();
+
+    printf("%10s %-6s %8s %13s %10s %8s\n", "size_kb", "policy", "hit_pct",
+           "byte_hit_pct", "evictions", "mreq_s");
+    unsigned long long bytes = 0;
+    for (size_t i = 0; i < nrequests; i++) {
+        bytes += requests[i].size;
+    }
+    for (unsigned int s = 0; s < nsizes; s++) {
+        for (unsigned int p = 0; p < nselected; p++) {
+            result_t result = {0, 0, 0, 0};
+            long long start = now_ns();
+            selected[p]->run(sizes[s], &result);
+            result.seconds = (now_ns() - start) / 1e9;
+            printf("%10zu %-6s %8.2f %13.2f %10lu %8.2f\n", sizes[s] / 1024,
+                   selected[p]->name, 100.0 * result.hits / nrequests,
+                   bytes > 0 ? 100.0 * result.hit_bytes / bytes : 0,
+                   result.evictions, nrequests / result.seconds / 1e6);
+            fflush(stdout);
+        }
+    }
+
+    for (unsigned int i = 0; i < nkeys; i++) {
+        free(keys[i]);
+    }
+    free(keys);
+    free(key_index);
+    free(requests);
+    return 0;
+}
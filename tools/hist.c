@@ -0,0 +1,95 @@
+/**
+ * @file hist.c
+ * @brief Log-linear latency histograms for the benchmark tools
+ *
+ * @author Taiming Liu <taimingl@andrew.cmu.edu>
+ */
+#include "hist.h"
+
+#include <math.h>
+#include <stdint.h>
+
+/**
+ * @brief Private helper function returning the bucket of a latency.
+ */
+static int hist_index(long long ns) {
+    uint64_t v = ns > 0 ? (uint64_t)ns : 0;
+    if (v < HIST_SUB_COUNT) {
+        return (int)v;
+    }
+    // shift v so that it falls in [HIST_SUB_HALF, HIST_SUB_COUNT)
+    int shift = 63 - __builtin_clzll(v) - (HIST_SUB_BITS - 1);
+    return (shift + 1) * HIST_SUB_HALF + (int)(v >> shift) - HIST_SUB_HALF;
+}
+
+/**
+ * @brief Private helper function returning the highest latency falling
+ * in a bucket.
+ */
+static long long hist_value(int index) {
+    if (index < HIST_SUB_COUNT) {
+        return index;
+    }
+    int shift = index / HIST_SUB_HALF - 1;
+    uint64_t low = (uint64_t)(index % HIST_SUB_HALF + HIST_SUB_HALF) << shift;
+    return (long long)(low + ((uint64_t)1 << shift) - 1);
+}
+
+/**
+ * @brief Adds a latency to a histogram.
+ * @param[in] hist the histogram.
+ * @param[in] ns the latency, in ns.
+ */
+void hist_record(hist_t *hist, long long ns) {
+    hist->counts[hist_index(ns)]++;
+    hist->total++;
+    hist->sum += ns;
+    if (ns > hist->max) {
+        hist->max = ns;
+    }
+}
+
+/**
+ * @brief Adds the latencies of one histogram to another.
+ *
+ */
+void hist_merge(hist_t *into, const hist_t *from) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    into->sum += from->sum;
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+/**
+ * @brief Returns the pct-th percentile of a histogram, by nearest rank.
+ *
+ * Reports the highest latency of the bucket the rank falls in, so that
+ * the percentile is never understated.
+ */
+long long hist_percentile(const hist_t *hist, double pct) {
+    unsigned long rank = (unsigned long)ceil(pct / 100 * hist->total);
+    unsigned long seen = 0;
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= rank) {
+            long long value = hist_value(i);
+            return value < hist->max ? value : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+/**
+ * @brief Returns the mean latency of a histogram, 0 if it has none.
+ *
+ */
+double hist_mean(const hist_t *hist) {
+    return hist->total > 0 ? hist->sum / hist->total : 0;
+}
@@ -0,0 +1,41 @@
+/**
+ * @file hist.h
+ * @brief Prototypes and definitions for hist.c
+ *
+ * Log-linear latency histograms for the benchmark tools, laid out as in
+ * HdrHistogram: exact below 128 ns, and within 1/64 of the value above,
+ * over the whole range of a long long. Each thread records into one of
+ * its own, and the histograms are merged for the report.
+ *
+ * @author Taiming Liu <taimingl@andrew.cmu.edu>
+ */
+#ifndef HIST_H
+#define HIST_H
+
+/* Buckets: 128 exact ones, then 64 per power of two */
+#define HIST_SUB_BITS 7
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_SUB_HALF (HIST_SUB_COUNT / 2)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 2) * HIST_SUB_HALF)
+
+/* Latencies of some operations, in ns */
+typedef struct hist {
+    unsigned long counts[HIST_BUCKETS];
+    unsigned long total;
+    double sum;
+    long long max;
+} hist_t;
+
+/* Adds a latency in ns */
+void hist_record(hist_t *hist, long long ns);
+
+/* Adds the latencies of another histogram */
+void hist_merge(hist_t *into, const hist_t *from);
+
+/* Returns the pct-th percentile, never understated */
+long long hist_percentile(const hist_t *hist, double pct);
+
+/* Returns the mean latency, 0 if there are none */
+double hist_mean(const hist_t *hist);
+
+#endif /* HIST_H */
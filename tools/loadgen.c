@@ -0,0 +1,462 @@
+/**
+ * @file loadgen.c
+ * @brief Drives the proxy with HTTP load and measures its latency
+ *
+ * Each connection is a thread making one request at a time through the
+ * proxy, on a new connection each time as the proxy closes them. In the
+ * default closed loop, a thread sends its next request as soon as the
+ * last one is answered, which measures how fast the proxy can go but lets
+ * a slow proxy slow the load down. With -r, the loop is open: requests
+ * are scheduled at a fixed rate whatever the proxy does, and latency is
+ * taken from when a request was due rather than when it went out, so time
+ * spent waiting for a free connection counts against the proxy instead of
+ * being left out (coordinated omission).
+ *
+ * Objects are named /obj<i> on the origin, or <prefix><i> with -u, and
+ * picked by a Zipf law of the given skew, 0 making every object equally
+ * popular. With -w, the tool instead writes such objects into a
+ * directory, for tiny to serve.
+ *
+ * Latencies go into the log-linear histograms of hist.c, so that the
+ * percentiles reported are within 1/64 of the true ones.
+ *
+ * usage: loadgen [-c <conns>] [-r <rate>] [-d <secs>] [-n <objects>]
+ *                [-z <skew>] [-u <prefix>] <proxy host:port>
+ *                <origin host:port>
+ *        loadgen -w <dir> [-n <objects>] [-s <bytes>[-<max bytes>]]
+ *
+ * @author Taiming Liu <taimingl@andrew.cmu.edu>
+ */
+#include "hist.h"
+
+#include <errno.h>
+#include <math.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEF_CONNS 8
+#define DEF_SECONDS 10
+#define DEF_OBJECTS 1000
+#define DEF_SIZE 8192
+#define DEF_PREFIX "/obj"
+
+/* Time a request may take before it counts as an error, in s */
+#define REQUEST_TIMEOUT 10
+
+/* A connection, run by a thread of its own */
+typedef struct conn {
+    pthread_t tid;
+    uint64_t rng;        /* xorshift state */
+    unsigned long ok;    /* requests answered 2xx */
+    unsigned long other; /* requests answered otherwise */
+    unsigned long errors;
+    unsigned long long bytes;
+    hist_t hist;
+} conn_t;
+
+static struct {
+    unsigned int conns;
+    double rate; /* requests per second, 0 for a closed loop */
+    unsigned int seconds;
+    unsigned int objects;
+    double skew;
+    const char *prefix; /* path of an object, less its number */
+    const char *origin;
+} opts = {DEF_CONNS, 0, DEF_SECONDS, DEF_OBJECTS, 0, DEF_PREFIX, NULL};
+
+/* Address of the proxy */
+static struct addrinfo *proxy_addr;
+
+/* Chance of picking each object or one before it */
+static double *popularity;
+
+/* Monotonic ns the run starts and ends at */
+static long long run_start;
+static long long run_end;
+
+/* Requests scheduled so far in an open loop */
+static unsigned long scheduled = 0;
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-c <conns>] [-r <rate>] [-d <secs>] [-n <objects>]\n"
+            "          [-z <skew>] [-u <prefix>] <proxy host:port>\n"
+            "          <origin host:port>\n"
+            "       %s -w <dir> [-n <objects>] [-s <bytes>[-<max bytes>]]\n",
+            prog, prog);
+    exit(1);
+}
+
+static long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * @brief Returns a random number, by xorshift64*.
+ */
+static uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+/**
+ * @brief Returns a random number in [0, 1).
+ */
+static double next_uniform(uint64_t *state) {
+    return (next_random(state) >> 11) * (1.0 / (1ULL << 53));
+}
+
+/**
+ * @brief Splits "host:port" in place, returning the port.
+ */
+static char *split_hostport(char *hostport) {
+    char *colon = strrchr(hostport, ':');
+    if (colon == NULL || colon[1] == '\0') {
+        fprintf(stderr, "%s: expected host:port\n", hostport);
+        exit(1);
+    }
+    *colon = '\0';
+    return colon + 1;
+}
+
+/**
+ * @brief Makes the table of object popularity for a Zipf law.
+ *
+ * Object i is picked with a chance in proportion to 1 / (i + 1)^skew.
+ */
+static void init_popularity(void) {
+    popularity = malloc(opts.objects * sizeof(double));
+    if (popularity == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    double sum = 0;
+    for (unsigned int i = 0; i < opts.objects; i++) {
+        sum += 1 / pow(i + 1, opts.skew);
+        popularity[i] = sum;
+    }
+    for (unsigned int i = 0; i < opts.objects; i++) {
+        popularity[i] /= sum;
+    }
+}
+
+/**
+ * @brief Picks an object to request.
+ */
+static unsigned int pick_object(uint64_t *rng) {
+    double u = next_uniform(rng);
+    unsigned int low = 0;
+    unsigned int high = opts.objects - 1;
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (popularity[mid] <= u) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+/**
+ * @brief Fetches an object through the proxy.
+ * @param[in] conn connection to count the response against.
+ * @param[in] object the object.
+ *
+ * Returns false if the request failed before a response came back.
+ */
+static bool fetch(conn_t *conn, unsigned int object) {
+    char buf[16384];
+    int len = snprintf(buf, sizeof(buf),
+                       "GET http://%s%s%u HTTP/1.0\r\nHost: %s\r\n\r\n",
+                       opts.origin, opts.prefix, object, opts.origin);
+    if (len >= (int)sizeof(buf)) {
+        return false;
+    }
+
+    int fd = socket(proxy_addr->ai_family, proxy_addr->ai_socktype,
+                    proxy_addr->ai_protocol);
+    if (fd < 0) {
+        return false;
+    }
+    struct timeval timeout = {REQUEST_TIMEOUT, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (connect(fd, proxy_addr->ai_addr, proxy_addr->ai_addrlen) < 0 ||
+        write(fd, buf, len) != len) {
+        close(fd);
+        return false;
+    }
+
+    int status = 0;
+    unsigned long long bytes = 0;
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        if (bytes == 0 && n >= 12 && strncmp(buf, "HTTP/1.", 7) == 0) {
+            status = atoi(buf + 9);
+        }
+        bytes += (unsigned long long)n;
+    }
+    close(fd);
+    if (n < 0 || bytes == 0) {
+        return false;
+    }
+    conn->bytes += bytes;
+    if (status >= 200 && status < 300) {
+        conn->ok++;
+    } else {
+        conn->other++;
+    }
+    return true;
+}
+
+/**
+ * @brief Runs a connection in a closed loop.
+ */
+static void run_closed(conn_t *conn) {
+    long long start;
+    while ((start = now_ns()) < run_end) {
+        if (fetch(conn, pick_object(&conn->rng))) {
+            hist_record(&conn->hist, now_ns() - start);
+        } else {
+            conn->errors++;
+        }
+    }
+}
+
+/**
+ * @brief Runs a connection in an open loop.
+ *
+ * Connections take the next due request in turn. One that finds its
+ * request already overdue sends it at once, and its latency still counts
+ * from when it was due. Requests due after the end of the run, or not
+ * sent by then, are left out.
+ */
+static void run_open(conn_t *conn) {
+    double interval = 1e9 / opts.rate;
+    while (1) {
+        unsigned long i = __atomic_fetch_add(&scheduled, 1, __ATOMIC_RELAXED);
+        long long due = run_start + (long long)(i * interval);
+        if (due >= run_end || now_ns() >= run_end) {
+            return;
+        }
+        struct timespec ts = {due / 1000000000, due % 1000000000};
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+               EINTR) {
+        }
+        if (fetch(conn, pick_object(&conn->rng))) {
+            hist_record(&conn->hist, now_ns() - due);
+        } else {
+            conn->errors++;
+        }
+    }
+}
+
+static void *run_conn(void *vargp) {
+    conn_t *conn = vargp;
+    if (opts.rate > 0) {
+        run_open(conn);
+    } else {
+        run_closed(conn);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Prints what the connections measured.
+ */
+static void print_report(conn_t *conns, double elapsed) {
+    static hist_t hist;
+    unsigned long ok = 0;
+    unsigned long other = 0;
+    unsigned long errors = 0;
+    unsigned long long bytes = 0;
+    for (unsigned int i = 0; i < opts.conns; i++) {
+        hist_merge(&hist, &conns[i].hist);
+        ok += conns[i].ok;
+        other += conns[i].other;
+        errors += conns[i].errors;
+        bytes += conns[i].bytes;
+    }
+
+    if (opts.rate > 0) {
+        printf("open loop at %.0f requests/s", opts.rate);
+    } else {
+        printf("closed loop");
+    }
+    printf(", %u connections, %.1f s, %u objects, skew %.2f\n", opts.conns,
+           elapsed, opts.objects, opts.skew);
+    printf("requests   %lu (%.1f/s), %lu not 2xx, %lu errors\n", ok + other,
+           (ok + other) / elapsed, other, errors);
+    if (opts.rate > 0) {
+        unsigned long due = (unsigned long)(opts.rate * opts.seconds);
+        unsigned long sent = ok + other + errors;
+        if (due > sent) {
+            printf("unsent     %lu of %lu due, the proxy fell behind\n",
+                   due - sent, due);
+        }
+    }
+    printf("throughput %.2f MB/s\n", bytes / elapsed / 1e6);
+    if (hist.total == 0) {
+        return;
+    }
+    printf("%10s %10s %10s %10s %10s %10s %10s\n", "mean_us", "p50_us",
+           "p90_us", "p99_us", "p99.9_us", "p99.99_us", "max_us");
+    printf("%10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+           hist_mean(&hist) / 1000, hist_percentile(&hist, 50) / 1000.0,
+           hist_percentile(&hist, 90) / 1000.0,
+           hist_percentile(&hist, 99) / 1000.0,
+           hist_percentile(&hist, 99.9) / 1000.0,
+           hist_percentile(&hist, 99.99) / 1000.0, hist.max / 1000.0);
+}
+
+/**
+ * @brief Writes objects for the origin to serve.
+ * @param[in] dir directory to write them into.
+ * @param[in] sizes size of every object, or "min-max" for sizes spread
+ *            evenly on a log scale in between.
+ */
+static void write_objects(const char *dir, const char *sizes) {
+    char *end;
+    unsigned long min = strtoul(sizes, &end, 10);
+    unsigned long max = *end == '-' ? strtoul(end + 1, NULL, 10) : min;
+    if (min == 0 || max < min) {
+        fprintf(stderr, "%s: bad object sizes\n", sizes);
+        exit(1);
+    }
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        perror(dir);
+        exit(1);
+    }
+
+    char *body = malloc(max);
+    if (body == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (unsigned long i = 0; i < max; i++) {
+        body[i] = "0123456789abcdef"[i % 16];
+    }
+    uint64_t rng = 0x9e3779b97f4a7c15ULL;
+    unsigned long long total = 0;
+    for (unsigned int i = 0; i < opts.objects; i++) {
+        double scale = pow((double)max / min, next_uniform(&rng));
+        size_t size = (size_t)(min * scale);
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/obj%u", dir, i);
+        FILE *fp = fopen(path, "wb");
+        if (fp == NULL || fwrite(body, 1, size, fp) != size || fclose(fp)) {
+            perror(path);
+            exit(1);
+        }
+        total += size;
+    }
+    free(body);
+    printf("wrote %u objects of %llu bytes in all to %s\n", opts.objects,
+           total, dir);
+}
+
+int main(int argc, char **argv) {
+    const char *dir = NULL;
+    const char *sizes = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:r:d:n:z:u:w:s:")) != -1) {
+        switch (opt) {
+        case 'c':
+            opts.conns = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            opts.rate = strtod(optarg, NULL);
+            break;
+        case 'd':
+            opts.seconds = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            opts.objects = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'z':
+            opts.skew = strtod(optarg, NULL);
+            break;
+        case 'u':
+            opts.prefix = optarg;
+            break;
+        case 'w':
+            dir = optarg;
+            break;
+        case 's':
+            sizes = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (opts.conns == 0 || opts.objects == 0 || opts.seconds == 0 ||
+        opts.rate < 0 || opts.skew < 0) {
+        usage(argv[0]);
+    }
+    if (dir != NULL) {
+        char size[32];
+        snprintf(size, sizeof(size), "%d", DEF_SIZE);
+        write_objects(dir, sizes != NULL ? sizes : size);
+        return 0;
+    }
+    if (argc - optind != 2) {
+        usage(argv[0]);
+    }
+
+    char *proxy = argv[optind];
+    char *port = split_hostport(proxy);
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    int rc = getaddrinfo(proxy, port, &hints, &proxy_addr);
+    if (rc != 0) {
+        fprintf(stderr, "%s: %s\n", proxy, gai_strerror(rc));
+        exit(1);
+    }
+    opts.origin = argv[optind + 1];
+    init_popularity();
+    signal(SIGPIPE, SIG_IGN);
+
+    conn_t *conns = calloc(opts.conns, sizeof(conn_t));
+    if (conns == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    run_start = now_ns();
+    run_end = run_start + opts.seconds * 1000000000LL;
+    for (unsigned int i = 0; i < opts.conns; i++) {
+        conns[i].rng = (uint64_t)run_start ^ ((i + 1) * 0x9e3779b97f4a7c15ULL);
+        if (pthread_create(&conns[i].tid, NULL, run_conn, &conns[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    for (unsigned int i = 0; i < opts.conns; i++) {
+        pthread_join(conns[i].tid, NULL);
+    }
+    print_report(conns, (now_ns() - run_start) / 1e9);
+
+    free(conns);
+    free(popularity);
+    freeaddrinfo(proxy_addr);
+    return 0;
+}
@@ -0,0 +1,251 @@
+/**
+ * @file tracestat.c
+ * @brief Breaks down where the time of traced requests went
+ *
+ * Reads trace files written by the proxy's -t option and prints, for each
+ * phase of serving a request, the percentiles of the time spent in it,
+ * followed by the slowest requests phase by phase. The time of a phase is
+ * from the end of the last phase the request reached before it, so a
+ * hit's relay phase is the write from the cache right after its lookup.
+ *
+ * usage: tracestat [-n <slowest>] <trace file>...
+ *
+ * @author Taiming Liu <taimingl@andrew.cmu.edu>
+ */
+#include "proxy_log.h"
+#include "proxy_trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Slowest requests listed when -n is not given */
+#define DEF_SLOWEST 10
+
+/* Columns of the breakdown: the phases, then lock waits and the total */
+#define COL_LOCK NUM_TRACE_PHASES
+#define COL_TOTAL (NUM_TRACE_PHASES + 1)
+#define NUM_COLS (NUM_TRACE_PHASES + 2)
+
+static const char *col_names[NUM_COLS] = {
+    [TRACE_HEADER] = "header",   [TRACE_LOOKUP] = "lookup",
+    [TRACE_RESOLVED] = "resolve", [TRACE_CONNECTED] = "connect",
+    [TRACE_FIRST_BYTE] = "first", [TRACE_RELAYED] = "relay",
+    [TRACE_CLOSED] = "close",    [COL_LOCK] = "lock",
+    [COL_TOTAL] = "total",
+};
+
+static const char *cache_names[] = {
+    [LOG_NONE] = "-",
+    [LOG_HIT] = "hit",
+    [LOG_MISS] = "miss",
+    [LOG_BYPASS] = "bypass",
+};
+
+/* A traced request, with the time of each column in ns, -1 if not reached */
+typedef struct request {
+    const trace_record_t *record;
+    long long cols[NUM_COLS];
+} request_t;
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-n <slowest>] <trace file>...\n", prog);
+    exit(1);
+}
+
+/**
+ * @brief Appends the records of a trace file to an array.
+ *
+ * Exits if the file cannot be read or was not written by this version.
+ */
+static void read_trace(const char *path, trace_record_t **records,
+                       size_t *count, size_t *room) {
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        perror(path);
+        exit(1);
+    }
+    trace_header_t header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "%s: not a trace file\n", path);
+        exit(1);
+    }
+    if (header.version != TRACE_VERSION ||
+        header.record_size != sizeof(trace_record_t)) {
+        fprintf(stderr, "%s: trace version %u, expected %d\n", path,
+                header.version, TRACE_VERSION);
+        exit(1);
+    }
+
+    while (1) {
+        if (*count == *room) {
+            *room = *room > 0 ? 2 * *room : 1024;
+            *records = realloc(*records, *room * sizeof(trace_record_t));
+            if (*records == NULL) {
+                perror("realloc");
+                exit(1);
+            }
+        }
+        if (fread(*records + *count, sizeof(trace_record_t), 1, fp) != 1) {
+            break;
+        }
+        (*count)++;
+    }
+    fclose(fp);
+}
+
+/**
+ * @brief Splits a record into the time of each column.
+ */
+static void split_record(const trace_record_t *record, request_t *request) {
+    long long prev = 0;
+    request->record = record;
+    for (int p = 0; p < NUM_TRACE_PHASES; p++) {
+        if (record->phase_ns[p] == 0) {
+            request->cols[p] = -1;
+            continue;
+        }
+        request->cols[p] = record->phase_ns[p] - prev;
+        prev = record->phase_ns[p];
+    }
+    request->cols[COL_LOCK] = record->lock_us * 1000;
+    request->cols[COL_TOTAL] = prev;
+}
+
+static int compare_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a;
+    long long y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+static int compare_total(const void *a, const void *b) {
+    long long x = ((const request_t *)a)->cols[COL_TOTAL];
+    long long y = ((const request_t *)b)->cols[COL_TOTAL];
+    return (x < y) - (x > y);
+}
+
+/**
+ * @brief Returns the pct-th percentile of sorted times, by nearest rank.
+ */
+static long long percentile(const long long *sorted, size_t n, double pct) {
+    size_t rank = (size_t)(pct / 100 * n + 0.999999);
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+/**
+ * @brief Prints the percentiles of each column, in us.
+ */
+static void print_breakdown(const request_t *requests, size_t n) {
+    long long *times = malloc(n * sizeof(long long));
+    if (times == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    printf("%-8s %8s %10s %10s %10s %10s %10s %10s\n", "phase", "count",
+           "mean_us", "p50_us", "p90_us", "p99_us", "p99.9_us", "max_us");
+    for (int c = 0; c < NUM_COLS; c++) {
+        size_t count = 0;
+        double sum = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (requests[i].cols[c] >= 0) {
+                times[count++] = requests[i].cols[c];
+                sum += requests[i].cols[c];
+            }
+        }
+        if (count == 0) {
+            printf("%-8s %8d\n", col_names[c], 0);
+            continue;
+        }
+        qsort(times, count, sizeof(long long), compare_ll);
+        printf("%-8s %8zu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+               col_names[c], count, sum / count / 1000,
+               percentile(times, count, 50) / 1000.0,
+               percentile(times, count, 90) / 1000.0,
+               percentile(times, count, 99) / 1000.0,
+               percentile(times, count, 99.9) / 1000.0,
+               times[count - 1] / 1000.0);
+    }
+    free(times);
+}
+
+/**
+ * @brief Prints the slowest requests, the time of each column in us.
+ */
+static void print_slowest(request_t *requests, size_t n, size_t slowest) {
+    qsort(requests, n, sizeof(request_t), compare_total);
+    if (slowest > n) {
+        slowest = n;
+    }
+    printf("\nslowest %zu requests, times in us:\n", slowest);
+    printf("%9s ", col_names[COL_TOTAL]);
+    for (int c = 0; c <= COL_LOCK; c++) {
+        printf("%9s ", col_names[c]);
+    }
+    printf("%6s %-6s %s\n", "status", "cache", "uri");
+
+    for (size_t i = 0; i < slowest; i++) {
+        const request_t *request = &requests[i];
+        const trace_record_t *record = request->record;
+        printf("%9.1f ", request->cols[COL_TOTAL] / 1000.0);
+        for (int c = 0; c <= COL_LOCK; c++) {
+            if (request->cols[c] < 0) {
+                printf("%9s ", "-");
+            } else {
+                printf("%9.1f ", request->cols[c] / 1000.0);
+            }
+        }
+        printf("%6u %-6s %.*s\n", record->status,
+               record->cache <= LOG_BYPASS ? cache_names[record->cache] : "?",
+               TRACE_URI_LEN, record->uri);
+    }
+}
+
+int main(int argc, char **argv) {
+    size_t slowest = DEF_SLOWEST;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt != 'n') {
+            usage(argv[0]);
+        }
+        slowest = (size_t)strtoul(optarg, NULL, 10);
+    }
+    if (optind == argc) {
+        usage(argv[0]);
+    }
+
+    trace_record_t *records = NULL;
+    size_t count = 0;
+    size_t room = 0;
+    for (int i = optind; i < argc; i++) {
+        read_trace(argv[i], &records, &count, &room);
+    }
+    if (count == 0) {
+        printf("no traced requests\n");
+        return 0;
+    }
+
+    request_t *requests = malloc(count * sizeof(request_t));
+    if (requests == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    size_t outcomes[LOG_BYPASS + 1] = {0};
+    for (size_t i = 0; i < count; i++) {
+        split_record(&records[i], &requests[i]);
+        if (records[i].cache <= LOG_BYPASS) {
+            outcomes[records[i].cache]++;
+        }
+    }
+
+    printf("%zu requests: %zu hits, %zu misses, %zu bypassed, %zu other\n\n",
+           count, outcomes[LOG_HIT], outcomes[LOG_MISS], outcomes[LOG_BYPASS],
+           outcomes[LOG_NONE]);
+    print_breakdown(requests, count);
+    print_slowest(requests, count, slowest);
+
+    free(requests);
+    free(records);
+    return 0;
+}